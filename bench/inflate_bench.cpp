@@ -0,0 +1,140 @@
+// Compares the speed of Inflate with lodepng_inflate.
+// Usage: inflate_bench [files...]
+// Every file is deflated with lodepng first, synthetic data is used if no file is given.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <zopflipng/lodepng/lodepng.h>
+
+#include "../inflate.h"
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+namespace {
+
+vector<std::pair<string, vector<uint8_t>>> SyntheticData() {
+  const size_t kSize = 16 << 20;
+  std::mt19937 rng(1);
+  vector<std::pair<string, vector<uint8_t>>> result;
+
+  // words from a small vocabulary, compresses like text
+  vector<string> words;
+  for (int i = 0; i < 2000; i++) {
+    string word;
+    for (int j = rng() % 8 + 2; j > 0; j--)
+      word += static_cast<char>('a' + rng() % 26);
+    words.push_back(word);
+  }
+  vector<uint8_t> text;
+  while (text.size() < kSize) {
+    const string& word = words[rng() % words.size()];
+    text.insert(text.end(), word.begin(), word.end());
+    text.push_back(rng() % 10 ? ' ' : '\n');
+  }
+  result.emplace_back("text", text);
+
+  // smooth gradient like a filtered image
+  vector<uint8_t> image(kSize);
+  for (size_t i = 0; i < kSize; i++)
+    image[i] = static_cast<uint8_t>((i % 4096) / 16 + (rng() % 100 == 0 ? rng() % 8 : 0));
+  result.emplace_back("image", image);
+
+  // mostly incompressible
+  vector<uint8_t> random(kSize);
+  for (auto& c : random)
+    c = static_cast<uint8_t>(rng());
+  result.emplace_back("random", random);
+  return result;
+}
+
+// Runs the decoder a few times and returns the best speed in MB/s of uncompressed data.
+template <typename F>
+double Measure(F decode, size_t uncompressed_size) {
+  double best = 0;
+  for (int i = 0; i < 5; i++) {
+    auto start = std::chrono::steady_clock::now();
+    decode();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    double speed = uncompressed_size / elapsed.count() / (1 << 20);
+    if (speed > best)
+      best = speed;
+  }
+  return best;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  vector<std::pair<string, vector<uint8_t>>> inputs;
+  for (int i = 1; i < argc; i++) {
+    std::ifstream file(argv[i], std::ios::binary);
+    if (!file) {
+      cerr << "Can't open " << argv[i] << endl;
+      return 1;
+    }
+    inputs.emplace_back(argv[i], vector<uint8_t>(std::istreambuf_iterator<char>(file), {}));
+  }
+  if (inputs.empty())
+    inputs = SyntheticData();
+
+  LodePNGCompressSettings compress_settings;
+  lodepng_compress_settings_init(&compress_settings);
+  compress_settings.windowsize = 32768;
+
+  printf("%-20s %12s %12s %14s %14s\n", "input", "size", "deflated", "lodepng MB/s", "Inflate MB/s");
+  for (const auto& input : inputs) {
+    const vector<uint8_t>& data = input.second;
+    uint8_t* deflated = nullptr;
+    size_t deflated_size = 0;
+    if (lodepng_deflate(&deflated, &deflated_size, data.data(), data.size(), &compress_settings)) {
+      cerr << "Deflate failed: " << input.first << endl;
+      return 1;
+    }
+
+    uint8_t* out = nullptr;
+    size_t outsize = 0;
+    bool ok = !Inflate(&out, &outsize, deflated, deflated_size) && outsize == data.size() &&
+              memcmp(out, data.data(), outsize) == 0;
+    free(out);
+    if (!ok) {
+      cerr << "Decompressed data mismatch: " << input.first << endl;
+      return 1;
+    }
+
+    double lodepng_speed = Measure(
+        [&] {
+          uint8_t* out = nullptr;
+          size_t outsize = 0;
+          lodepng_inflate(&out, &outsize, deflated, deflated_size, &lodepng_default_decompress_settings);
+          free(out);
+        },
+        data.size());
+    double inflate_speed = Measure(
+        [&] {
+          uint8_t* out = nullptr;
+          size_t outsize = 0;
+          Inflate(&out, &outsize, deflated, deflated_size);
+          free(out);
+        },
+        data.size());
+    free(deflated);
+
+    printf("%-20s %12zu %12zu %14.1f %14.1f\n", input.first.c_str(), data.size(), deflated_size, lodepng_speed,
+           inflate_speed);
+  }
+  return 0;
+}
@@ -0,0 +1,573 @@
+// Measures LeanifyFile on a synthetic corpus of every supported format and prints CSV.
+// Usage: leanify_bench [-n runs] [-i iterations] [formats...]
+// Every format runs in its own process, so the peak RSS is its own. The inputs are made with fast encoders
+// (lodepng, baseline JPEG without optimized Huffman tables) and contain metadata, so there is something to save.
+
+#include <chrono>
+#include <csetjmp>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <mozjpeg/jpeglib.h>
+#include <zopflipng/lodepng/lodepng.h>
+
+#include "../crc32.h"
+#include "../leanify.h"
+
+using std::cerr;
+using std::endl;
+using std::string;
+using std::vector;
+
+namespace {
+
+// A file of the corpus, the name matters for the formats detected by the extension.
+struct BenchFile {
+  string name;
+  vector<uint8_t> data;
+};
+
+void Put16(vector<uint8_t>* out, uint16_t v) {
+  out->push_back(v & 0xFF);
+  out->push_back(v >> 8);
+}
+
+void Put32(vector<uint8_t>* out, uint32_t v) {
+  Put16(out, v & 0xFFFF);
+  Put16(out, v >> 16);
+}
+
+void Append(vector<uint8_t>* out, const vector<uint8_t>& data) {
+  out->insert(out->end(), data.begin(), data.end());
+}
+
+void Append(vector<uint8_t>* out, const string& str) {
+  out->insert(out->end(), str.begin(), str.end());
+}
+
+// words from a small vocabulary, compresses like text
+string Text(size_t size, unsigned seed) {
+  std::mt19937 rng(seed);
+  vector<string> words;
+  for (int i = 0; i < 500; i++) {
+    string word;
+    for (int j = rng() % 8 + 2; j > 0; j--)
+      word += static_cast<char>('a' + rng() % 26);
+    words.push_back(word);
+  }
+  string text;
+  while (text.size() < size) {
+    text += words[rng() % words.size()];
+    text += rng() % 10 ? ' ' : '\n';
+  }
+  return text;
+}
+
+// RGB gradient with some noise, like a photo or a screenshot
+vector<uint8_t> Pixels(unsigned width, unsigned height, unsigned seed) {
+  std::mt19937 rng(seed);
+  vector<uint8_t> pixels;
+  for (unsigned y = 0; y < height; y++) {
+    for (unsigned x = 0; x < width; x++) {
+      int noise = rng() % 16 == 0 ? rng() % 32 : 0;
+      pixels.push_back(static_cast<uint8_t>(x * 255 / width + noise));
+      pixels.push_back(static_cast<uint8_t>(y * 255 / height));
+      pixels.push_back(static_cast<uint8_t>((x + y) * 127 / (width + height) + noise));
+    }
+  }
+  return pixels;
+}
+
+vector<uint8_t> Deflate(const vector<uint8_t>& data) {
+  uint8_t* out = nullptr;
+  size_t outsize = 0;
+  lodepng_deflate(&out, &outsize, data.data(), data.size(), &lodepng_default_compress_settings);
+  vector<uint8_t> result(out, out + outsize);
+  free(out);
+  return result;
+}
+
+vector<uint8_t> ZlibCompress(const vector<uint8_t>& data) {
+  uint8_t* out = nullptr;
+  size_t outsize = 0;
+  lodepng_zlib_compress(&out, &outsize, data.data(), data.size(), &lodepng_default_compress_settings);
+  vector<uint8_t> result(out, out + outsize);
+  free(out);
+  return result;
+}
+
+vector<uint8_t> MakePng(unsigned width, unsigned height, unsigned seed) {
+  vector<uint8_t> pixels = Pixels(width, height, seed);
+  LodePNGState state;
+  lodepng_state_init(&state);
+  state.info_raw.colortype = LCT_RGB;
+  state.info_png.color.colortype = LCT_RGB;
+  // metadata that is removed
+  lodepng_add_text(&state.info_png, "Comment", Text(2000, seed).c_str());
+  uint8_t* out = nullptr;
+  size_t outsize = 0;
+  lodepng_encode(&out, &outsize, pixels.data(), width, height, &state);
+  lodepng_state_cleanup(&state);
+  vector<uint8_t> png(out, out + outsize);
+  free(out);
+  return png;
+}
+
+// Baseline JPEG made from synthetic DCT coefficients, since only the transcoding part of mozjpeg is built.
+vector<uint8_t> MakeJpeg(unsigned width, unsigned height, unsigned seed) {
+  std::mt19937 rng(seed);
+  jpeg_compress_struct cinfo;
+  jpeg_error_mgr jerr;
+  cinfo.err = jpeg_std_error(&jerr);
+  jpeg_create_compress(&cinfo);
+  cinfo.image_width = width;
+  cinfo.image_height = height;
+  cinfo.input_components = 3;
+  cinfo.in_color_space = JCS_RGB;
+  // no progressive mode and no optimized Huffman tables, so there is something to save
+  jpeg_c_set_int_param(&cinfo, JINT_COMPRESS_PROFILE, JCP_FASTEST);
+  jpeg_set_defaults(&cinfo);
+  cinfo.optimize_coding = FALSE;
+
+  unsigned width_in_blocks = (width + 7) / 8, height_in_blocks = (height + 7) / 8;
+  jvirt_barray_ptr coef_arrays[3];
+  for (int c = 0; c < 3; c++) {
+    // 4:4:4, so all the components have the same number of blocks
+    cinfo.comp_info[c].h_samp_factor = cinfo.comp_info[c].v_samp_factor = 1;
+    coef_arrays[c] = (*cinfo.mem->request_virt_barray)(reinterpret_cast<j_common_ptr>(&cinfo), JPOOL_IMAGE, TRUE,
+                                                       width_in_blocks, height_in_blocks, 1);
+  }
+
+  uint8_t* out = nullptr;
+  unsigned long outsize = 0;
+  jpeg_mem_dest(&cinfo, &out, &outsize);
+  // the arrays are allocated here and only read by jpeg_finish_compress
+  jpeg_write_coefficients(&cinfo, coef_arrays);
+  // a comment like the ones left by editors
+  string comment = Text(1000, seed);
+  jpeg_write_marker(&cinfo, JPEG_COM, reinterpret_cast<const JOCTET*>(comment.data()), comment.size());
+
+  for (int c = 0; c < 3; c++) {
+    for (unsigned y = 0; y < height_in_blocks; y++) {
+      JBLOCKARRAY row =
+          (*cinfo.mem->access_virt_barray)(reinterpret_cast<j_common_ptr>(&cinfo), coef_arrays[c], y, 1, TRUE);
+      for (unsigned x = 0; x < width_in_blocks; x++) {
+        JCOEF* block = row[0][x];
+        memset(block, 0, sizeof(JBLOCK));
+        block[0] = static_cast<JCOEF>(c == 0 ? (x + y) * 4 % 128 - 64 : (x * 2) % 16 - 8);
+        for (int k = 1; k < 10; k++)
+          block[k] = static_cast<JCOEF>(static_cast<int>(rng() % 7) - 3);
+      }
+    }
+  }
+  jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
+  vector<uint8_t> jpeg(out, out + outsize);
+  free(out);
+  return jpeg;
+}
+
+vector<uint8_t> MakeZip(const vector<BenchFile>& files) {
+  vector<uint8_t> zip, cd;
+  for (const auto& file : files) {
+    // text is deflated, the rest is stored
+    bool deflate = file.name.size() > 4 && file.name.compare(file.name.size() - 4, 4, ".txt") == 0;
+    vector<uint8_t> data = deflate ? Deflate(file.data) : file.data;
+    uint32_t crc = Crc32(file.data.data(), file.data.size());
+    uint32_t offset = zip.size();
+
+    Put32(&zip, 0x04034B50);
+    Put16(&zip, 20);
+    Put16(&zip, 0);
+    Put16(&zip, deflate ? 8 : 0);
+    Put32(&zip, 0);
+    Put32(&zip, crc);
+    Put32(&zip, data.size());
+    Put32(&zip, file.data.size());
+    Put16(&zip, file.name.size());
+    Put16(&zip, 0);
+    Append(&zip, file.name);
+    Append(&zip, data);
+
+    Put32(&cd, 0x02014B50);
+    Put16(&cd, 20);
+    Put16(&cd, 20);
+    Put16(&cd, 0);
+    Put16(&cd, deflate ? 8 : 0);
+    Put32(&cd, 0);
+    Put32(&cd, crc);
+    Put32(&cd, data.size());
+    Put32(&cd, file.data.size());
+    Put16(&cd, file.name.size());
+    Put16(&cd, 0);
+    Put16(&cd, 0);
+    Put16(&cd, 0);
+    Put16(&cd, 0);
+    Put32(&cd, 0);
+    Put32(&cd, offset);
+    Append(&cd, file.name);
+  }
+  uint32_t cd_offset = zip.size();
+  Append(&zip, cd);
+  Put32(&zip, 0x06054B50);
+  Put16(&zip, 0);
+  Put16(&zip, 0);
+  Put16(&zip, files.size());
+  Put16(&zip, files.size());
+  Put32(&zip, cd.size());
+  Put32(&zip, cd_offset);
+  Put16(&zip, 0);
+  return zip;
+}
+
+vector<uint8_t> MakeGz(const string& name, const vector<uint8_t>& data) {
+  // FNAME is set
+  vector<uint8_t> gz = { 0x1F, 0x8B, 8, 8, 0, 0, 0, 0, 0, 3 };
+  Append(&gz, name);
+  gz.push_back(0);
+  Append(&gz, Deflate(data));
+  Put32(&gz, Crc32(data.data(), data.size()));
+  Put32(&gz, data.size());
+  return gz;
+}
+
+void PutSwfTag(vector<uint8_t>* swf, uint16_t type, const vector<uint8_t>& content) {
+  // always the long form, which is valid for any length
+  Put16(swf, type << 6 | 0x3F);
+  Put32(swf, content.size());
+  Append(swf, content);
+}
+
+vector<uint8_t> MakeSwf(unsigned seed) {
+  vector<uint8_t> swf = { 'F', 'W', 'S', 10, 0, 0, 0, 0 };
+  // empty RECT, frame rate, frame count
+  swf.push_back(0);
+  Put16(&swf, 24 << 8);
+  Put16(&swf, 1);
+
+  // Metadata, removed
+  PutSwfTag(&swf, 77, vector<uint8_t>(100, ' '));
+  // DefineBitsJPEG2
+  vector<uint8_t> jpeg_tag;
+  Put16(&jpeg_tag, 1);
+  Append(&jpeg_tag, MakeJpeg(128, 128, seed));
+  PutSwfTag(&swf, 21, jpeg_tag);
+  // DefineBitsLossless with 24-bit pixels, as 32-bit XRGB
+  vector<uint8_t> lossless_tag, argb;
+  Put16(&lossless_tag, 2);
+  lossless_tag.push_back(5);
+  Put16(&lossless_tag, 64);
+  Put16(&lossless_tag, 64);
+  vector<uint8_t> pixels = Pixels(64, 64, seed);
+  for (size_t i = 0; i < pixels.size(); i += 3) {
+    argb.push_back(0xFF);
+    argb.insert(argb.end(), pixels.begin() + i, pixels.begin() + i + 3);
+  }
+  Append(&lossless_tag, ZlibCompress(argb));
+  PutSwfTag(&swf, 20, lossless_tag);
+  // DefineBinaryData with text, for LZMA
+  vector<uint8_t> binary_tag;
+  Put16(&binary_tag, 3);
+  Put32(&binary_tag, 0);
+  Append(&binary_tag, Text(100000, seed));
+  PutSwfTag(&swf, 87, binary_tag);
+  // ShowFrame, End
+  Put16(&swf, 1 << 6);
+  Put16(&swf, 0);
+
+  uint32_t size = swf.size();
+  memcpy(&swf[4], &size, 4);
+  return swf;
+}
+
+// PE32 executable with oversized headers and a relocation section, both are removed.
+vector<uint8_t> MakePe(unsigned seed) {
+  const uint32_t kFileAlignment = 0x200, kSectionAlignment = 0x1000, kHeaderSize = 0x1000;
+  string code = Text(200000, seed);
+  uint32_t code_size = (code.size() + kFileAlignment - 1) / kFileAlignment * kFileAlignment;
+  uint32_t reloc_size = kFileAlignment;
+  uint32_t code_rva = kSectionAlignment;
+  uint32_t reloc_rva = code_rva + (code_size + kSectionAlignment - 1) / kSectionAlignment * kSectionAlignment;
+
+  vector<uint8_t> pe(0x80);
+  pe[0] = 'M';
+  pe[1] = 'Z';
+  pe[0x3C] = 0x80;
+  Put32(&pe, 0x00004550);
+  // file header
+  Put16(&pe, 0x14C);
+  Put16(&pe, 2);
+  Put32(&pe, 0);
+  Put32(&pe, 0);
+  Put32(&pe, 0);
+  Put16(&pe, 0xE0);
+  Put16(&pe, 0x0102);
+  // optional header
+  Put16(&pe, 0x10B);
+  Put16(&pe, 0);
+  Put32(&pe, code_size);
+  Put32(&pe, 0);
+  Put32(&pe, 0);
+  Put32(&pe, code_rva);
+  Put32(&pe, code_rva);
+  Put32(&pe, reloc_rva);
+  Put32(&pe, 0x400000);
+  Put32(&pe, kSectionAlignment);
+  Put32(&pe, kFileAlignment);
+  for (int i = 0; i < 6; i++)
+    Put16(&pe, i == 0 || i == 4 ? 4 : 0);
+  Put32(&pe, 0);
+  Put32(&pe, reloc_rva + kSectionAlignment);
+  Put32(&pe, kHeaderSize);
+  Put32(&pe, 0);
+  // console subsystem
+  Put16(&pe, 3);
+  Put16(&pe, 0);
+  for (int i = 0; i < 4; i++)
+    Put32(&pe, 0x100000);
+  Put32(&pe, 0);
+  Put32(&pe, 16);
+  // data directories, only the base relocation table
+  for (int i = 0; i < 16; i++) {
+    Put32(&pe, i == 5 ? reloc_rva : 0);
+    Put32(&pe, i == 5 ? 8 : 0);
+  }
+  // section table
+  const uint32_t sections[2][4] = { { code_rva, code_size, kHeaderSize, 0x60000020 },
+                                    { reloc_rva, reloc_size, kHeaderSize + code_size, 0x42000040 } };
+  const char* names[2] = { ".text", ".reloc" };
+  for (int i = 0; i < 2; i++) {
+    char name[8] = {};
+    strncpy(name, names[i], sizeof(name));
+    pe.insert(pe.end(), name, name + 8);
+    Put32(&pe, sections[i][1]);
+    Put32(&pe, sections[i][0]);
+    Put32(&pe, sections[i][1]);
+    Put32(&pe, sections[i][2]);
+    Put32(&pe, 0);
+    Put32(&pe, 0);
+    Put32(&pe, 0);
+    Put32(&pe, sections[i][3]);
+  }
+  pe.resize(kHeaderSize);
+  Append(&pe, code);
+  pe.resize(kHeaderSize + code_size);
+  Put32(&pe, code_rva);
+  Put32(&pe, 8);
+  pe.resize(kHeaderSize + code_size + reloc_size);
+  return pe;
+}
+
+string MakeSvg(unsigned seed) {
+  std::mt19937 rng(seed);
+  string svg =
+      "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"no\"?>\n"
+      "<!-- Created with a vector editor -->\n"
+      "<svg xmlns=\"http://www.w3.org/2000/svg\" version=\"1.1\" width=\"512\" height=\"512\">\n"
+      "  <metadata>\n    " +
+      Text(2000, seed) + "\n  </metadata>\n";
+  for (int i = 0; i < 3000; i++) {
+    svg += "  <g>\n    <path   d=\"M " + std::to_string(rng() % 512) + " " + std::to_string(rng() % 512) + " L " +
+           std::to_string(rng() % 512) + " " + std::to_string(rng() % 512) + " Z\"   fill=\"#" +
+           std::to_string(100000 + rng() % 900000) + "\" />\n  </g>\n";
+  }
+  return svg + "</svg>\n";
+}
+
+vector<uint8_t> MakeTar(const vector<BenchFile>& files) {
+  vector<uint8_t> tar;
+  for (const auto& file : files) {
+    vector<uint8_t> header(512);
+    char* h = reinterpret_cast<char*>(header.data());
+    strncpy(h, file.name.c_str(), 99);
+    snprintf(h + 100, 8, "%07o", 0644);
+    snprintf(h + 108, 8, "%07o", 0);
+    snprintf(h + 116, 8, "%07o", 0);
+    snprintf(h + 124, 12, "%011o", static_cast<unsigned>(file.data.size()));
+    snprintf(h + 136, 12, "%011o", 0);
+    h[156] = '0';
+    memcpy(h + 257, "ustar", 6);
+    memcpy(h + 263, "00", 2);
+    memset(h + 148, ' ', 8);
+    unsigned sum = 0;
+    for (uint8_t c : header)
+      sum += c;
+    snprintf(h + 148, 8, "%06o", sum);
+    Append(&tar, header);
+    Append(&tar, file.data);
+    tar.resize((tar.size() + 511) / 512 * 512);
+  }
+  tar.resize(tar.size() + 1024);
+  return tar;
+}
+
+vector<uint8_t> MakeIco(const vector<vector<uint8_t>>& pngs) {
+  vector<uint8_t> ico;
+  Put16(&ico, 0);
+  Put16(&ico, 1);
+  Put16(&ico, pngs.size());
+  uint32_t offset = 6 + 16 * pngs.size();
+  for (const auto& png : pngs) {
+    // 0 means 256 pixels, the real size is in the PNG
+    ico.push_back(0);
+    ico.push_back(0);
+    ico.push_back(0);
+    ico.push_back(0);
+    Put16(&ico, 1);
+    Put16(&ico, 32);
+    Put32(&ico, png.size());
+    Put32(&ico, offset);
+    offset += png.size();
+  }
+  for (const auto& png : pngs)
+    Append(&ico, png);
+  return ico;
+}
+
+string Base64(const vector<uint8_t>& data) {
+  const char* table = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  string out;
+  for (size_t i = 0; i < data.size(); i += 3) {
+    uint32_t v = data[i] << 16;
+    if (i + 1 < data.size())
+      v |= data[i + 1] << 8;
+    if (i + 2 < data.size())
+      v |= data[i + 2];
+    out += table[v >> 18];
+    out += table[(v >> 12) & 63];
+    out += i + 1 < data.size() ? table[(v >> 6) & 63] : '=';
+    out += i + 2 < data.size() ? table[v & 63] : '=';
+  }
+  return out;
+}
+
+vector<uint8_t> Bytes(const string& str) {
+  return vector<uint8_t>(str.begin(), str.end());
+}
+
+// The corpus of one format.
+vector<BenchFile> MakeCorpus(const string& format) {
+  if (format == "png")
+    return { { "a.png", MakePng(256, 256, 1) }, { "b.png", MakePng(100, 300, 2) } };
+  if (format == "jpeg")
+    return { { "a.jpg", MakeJpeg(512, 512, 1) }, { "b.jpg", MakeJpeg(200, 120, 2) } };
+  if (format == "zip") {
+    return { { "a.zip", MakeZip({ { "readme.txt", Bytes(Text(200000, 1)) },
+                                  { "icon.png", MakePng(64, 64, 2) },
+                                  { "photo.jpg", MakeJpeg(128, 128, 3) } }) } };
+  }
+  if (format == "gz")
+    return { { "a.txt.gz", MakeGz("a.txt", Bytes(Text(300000, 1))) } };
+  if (format == "swf")
+    return { { "a.swf", MakeSwf(1) } };
+  if (format == "pe")
+    return { { "a.exe", MakePe(1) } };
+  if (format == "xml")
+    return { { "a.svg", Bytes(MakeSvg(1)) } };
+  if (format == "tar") {
+    return { { "a.tar", MakeTar({ { "readme.txt", Bytes(Text(100000, 1)) },
+                                  { "icon.png", MakePng(64, 64, 2) },
+                                  { "image.svg", Bytes(MakeSvg(3)) } }) } };
+  }
+  if (format == "ico")
+    return { { "a.ico", MakeIco({ MakePng(32, 32, 1), MakePng(48, 48, 2), MakePng(256, 256, 3) }) } };
+  if (format == "datauri") {
+    string html = "<html>\n<body>\n<img src=\"data:image/png;base64," + Base64(MakePng(64, 64, 1)) +
+                  "\">\n<img src=\"data:image/jpeg;base64," + Base64(MakeJpeg(64, 64, 2)) + "\">\n</body>\n</html>\n";
+    return { { "a.html", Bytes(html) } };
+  }
+  return {};
+}
+
+const char* const kFormats[] = { "png", "jpeg", "zip", "gz", "swf", "pe", "xml", "tar", "ico", "datauri" };
+
+// Runs in a child process, prints the CSV line of |format|.
+int RunFormat(const string& format, int runs, const Context& ctx) {
+  vector<BenchFile> corpus = MakeCorpus(format);
+  if (corpus.empty()) {
+    cerr << "Unknown format: " << format << endl;
+    return 1;
+  }
+
+  size_t input_size = 0, output_size = 0;
+  double seconds = 0;
+  for (int run = 0; run < runs; run++) {
+    // every run starts from nothing, like a new process
+    ClearLeanifyMemo();
+    for (const auto& file : corpus) {
+      vector<uint8_t> data = file.data;
+      auto start = std::chrono::steady_clock::now();
+      size_t new_size = LeanifyFile(data.data(), data.size(), ctx, 0, file.name);
+      seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      if (run == 0) {
+        input_size += file.data.size();
+        output_size += new_size;
+      }
+    }
+  }
+
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  long peak_rss_kb = usage.ru_maxrss / 1024;
+#else
+  long peak_rss_kb = usage.ru_maxrss;
+#endif
+  printf("%s,%zu,%zu,%zu,%zu,%d,%.3f,%.3f,%ld\n", format.c_str(), corpus.size(), input_size, output_size,
+         input_size - output_size, runs, seconds, input_size * runs / seconds / (1 << 20), peak_rss_kb);
+  fflush(stdout);
+  return 0;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  int runs = 3;
+  Context ctx;
+  // the default of 15 Zopfli iterations takes too long for a quick comparison
+  ctx.iterations = 1;
+  vector<string> formats;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      runs = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+      ctx.iterations = atoi(argv[++i]);
+    } else {
+      formats.push_back(argv[i]);
+    }
+  }
+  if (runs <= 0 || ctx.iterations <= 0) {
+    cerr << "Usage: leanify_bench [-n runs] [-i iterations] [formats...]" << endl;
+    return 1;
+  }
+  if (formats.empty())
+    formats.assign(std::begin(kFormats), std::end(kFormats));
+
+  // the messages of Leanify would mix with the CSV
+  std::cout.setstate(std::ios::failbit);
+  printf("format,files,input_bytes,output_bytes,saved_bytes,runs,seconds,mb_per_s,peak_rss_kb\n");
+  fflush(stdout);
+  int result = 0;
+  for (const auto& format : formats) {
+    pid_t pid = fork();
+    if (pid == 0)
+      _exit(RunFormat(format, runs, ctx));
+    int status = 0;
+    if (pid == -1 || waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      cerr << "Benchmark failed: " << format << endl;
+      result = 1;
+    }
+  }
+  return result;
+}
@@ -3,7 +3,7 @@ Pushd %~dp0
 SetLocal EnableDelayedExpansion
 Set Args=-std=c++14 -O3 -msse2 -mfpmath=sse -fno-exceptions -fno-rtti -flto -I./lib -s -o "Leanify" Leanify.res
 For /r "%~dp0" %%i In (*.cpp *.c *.cc) Do (Set t=%%i && Set Args=!Args!!t:%~dp0=!)
-For %%i In (fileio_linux.cpp lib\mozjpeg\jstdhuff.c) Do Set Args=!Args:%%i =!
+For %%i In (fileio_linux.cpp lib\mozjpeg\jstdhuff.c bench\inflate_bench.cpp bench\leanify_bench.cpp) Do Set Args=!Args:%%i =!
 windres --output-format=coff Leanify.rc Leanify.res
 g++ %Args%
 Del Leanify.res
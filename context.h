@@ -0,0 +1,49 @@
+#ifndef CONTEXT_H_
+#define CONTEXT_H_
+
+#include <climits>
+#include <cstddef>
+#include <string>
+
+// Settings and state of a Leanify job.
+// Every format keeps its own copy, so jobs with different settings can run at the same time.
+struct Context {
+  // fast mode, no recompression
+  bool is_fast = false;
+  bool is_verbose = false;
+
+  // iteration of zopfli
+  int iterations = 15;
+  // stop zopfli early if it hasn't improved in this many iterations, 0 to always do all iterations
+  int convergence_iterations = 0;
+  // size of the zopfli master blocks, 0 for the default, smaller blocks use less memory
+  size_t zopfli_block_size = 0;
+
+  // a normal file: depth 1
+  // file inside zip that is inside another zip: depth 3
+  int depth = 1;
+  int max_depth = INT_MAX;
+
+  // maximum number of threads used to process the entries of an archive
+  int num_threads = 1;
+
+  bool keep_exif = false;
+  bool keep_icc_profile = false;
+  bool jpeg_keep_all_metadata = false;
+  bool jpeg_arithmetic_coding = false;
+  // number of the best PNG filter strategies that are compressed with zopfli
+  int png_filter_candidates = 1;
+  bool zip_force_deflate = false;
+
+  // path of the file, with the names of the files it is embedded in, only kept for --stats-json
+  std::string path;
+
+  // Context for files embedded in the current file.
+  Context Nested() const {
+    Context nested = *this;
+    nested.depth++;
+    return nested;
+  }
+};
+
+#endif  // CONTEXT_H_
@@ -0,0 +1,150 @@
+#include "crc32.h"
+
+#include <cstring>
+
+#include "profile.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define CRC32_PCLMUL
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_PCLMUL
+#else
+#include <cpuid.h>
+#define TARGET_PCLMUL __attribute__((target("pclmul,sse4.1")))
+#endif
+#include <emmintrin.h>
+#include <smmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+namespace {
+
+struct Tables {
+  uint32_t t[8][256];
+};
+
+// t[0] is the usual byte-wise table, t[k] advances the crc of a byte followed by k zero bytes.
+const Tables& GetTables() {
+  static const Tables tables = [] {
+    Tables tables;
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int j = 0; j < 8; j++)
+        c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+      tables.t[0][i] = c;
+    }
+    for (int k = 1; k < 8; k++)
+      for (int i = 0; i < 256; i++)
+        tables.t[k][i] = (tables.t[k - 1][i] >> 8) ^ tables.t[0][tables.t[k - 1][i] & 0xFF];
+    return tables;
+  }();
+  return tables;
+}
+
+// |crc| is the inverted crc like in the other functions below.
+uint32_t Crc32SliceBy8(const uint8_t* data, size_t size, uint32_t crc) {
+  const auto& t = GetTables().t;
+  for (; size >= 8; data += 8, size -= 8) {
+    // the input is little-endian like everything else in Leanify
+    uint32_t lo, hi;
+    memcpy(&lo, data, 4);
+    memcpy(&hi, data + 4, 4);
+    lo ^= crc;
+    crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+          t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+  }
+  for (; size; data++, size--)
+    crc = t[0][(crc ^ *data) & 0xFF] ^ (crc >> 8);
+  return crc;
+}
+
+#ifdef CRC32_PCLMUL
+
+bool HasPclmul() {
+#ifdef _MSC_VER
+  int info[4];
+  __cpuid(info, 1);
+  unsigned ecx = info[2];
+#else
+  unsigned eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    return false;
+#endif
+  // PCLMULQDQ and SSE4.1
+  return (ecx & (1 << 1)) && (ecx & (1 << 19));
+}
+
+// Multiplies x by the folding constants k and adds next.
+TARGET_PCLMUL inline __m128i Fold(__m128i x, __m128i k, __m128i next) {
+  __m128i lo = _mm_clmulepi64_si128(x, k, 0x00);
+  __m128i hi = _mm_clmulepi64_si128(x, k, 0x11);
+  return _mm_xor_si128(_mm_xor_si128(hi, lo), next);
+}
+
+// Folds 64 bytes at a time with carry-less multiplication, then reduces to 32 bits with Barrett reduction.
+// See "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction" by Intel.
+// |size| must be a multiple of 16 and at least 64.
+TARGET_PCLMUL uint32_t Crc32Pclmul(const uint8_t* data, size_t size, uint32_t crc) {
+  // constants of the bit-reflected polynomial
+  const __m128i k1k2 = _mm_set_epi64x(0x01C6E41596, 0x0154442BD4);
+  const __m128i k3k4 = _mm_set_epi64x(0x00CCAA009E, 0x01751997D0);
+  const __m128i k5k0 = _mm_set_epi64x(0, 0x0163CD6124);
+  const __m128i poly = _mm_set_epi64x(0x01F7011641, 0x01DB710641);
+  const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+
+  __m128i x1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+  __m128i x2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16));
+  __m128i x3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 32));
+  __m128i x4 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 48));
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(static_cast<int>(crc)));
+  data += 64;
+  size -= 64;
+
+  // fold the four lanes in parallel
+  for (; size >= 64; data += 64, size -= 64) {
+    x1 = Fold(x1, k1k2, _mm_loadu_si128(reinterpret_cast<const __m128i*>(data)));
+    x2 = Fold(x2, k1k2, _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16)));
+    x3 = Fold(x3, k1k2, _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 32)));
+    x4 = Fold(x4, k1k2, _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 48)));
+  }
+
+  // fold the lanes into one, then the remaining 16 byte blocks
+  x1 = Fold(x1, k3k4, x2);
+  x1 = Fold(x1, k3k4, x3);
+  x1 = Fold(x1, k3k4, x4);
+  for (; size >= 16; data += 16, size -= 16)
+    x1 = Fold(x1, k3k4, _mm_loadu_si128(reinterpret_cast<const __m128i*>(data)));
+
+  // 128 bits to 64 bits
+  x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k5k0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  // Barrett reduction to 32 bits
+  x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), poly, 0x10);
+  x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask32), poly, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+  return static_cast<uint32_t>(_mm_extract_epi32(x1, 1));
+}
+
+#endif  // CRC32_PCLMUL
+
+}  // namespace
+
+uint32_t Crc32(const uint8_t* data, size_t size, uint32_t crc /*= 0*/) {
+  ScopedTimer timer(kStageCrc32, size);
+  crc = ~crc;
+#ifdef CRC32_PCLMUL
+  static const bool has_pclmul = HasPclmul();
+  if (has_pclmul && size >= 64) {
+    size_t folded_size = size & ~static_cast<size_t>(15);
+    crc = Crc32Pclmul(data, folded_size, crc);
+    data += folded_size;
+    size -= folded_size;
+  }
+#endif
+  return ~Crc32SliceBy8(data, size, crc);
+}
@@ -0,0 +1,12 @@
+#ifndef CRC32_H_
+#define CRC32_H_
+
+#include <cstddef>
+#include <cstdint>
+
+// Computes the CRC-32 used by zip, gzip and PNG, same result as lodepng_crc32.
+// Pass the result of the previous call as |crc| to continue a checksum over several buffers.
+// Uses PCLMULQDQ if the CPU supports it, slice-by-8 otherwise.
+uint32_t Crc32(const uint8_t* data, size_t size, uint32_t crc = 0);
+
+#endif  // CRC32_H_
@@ -16,19 +16,22 @@
 #include <sys/types.h>
 #endif  // _WIN32
 
+#include "output_sink.h"
+
 class File {
  public:
+  // A |read_only| file is mapped copy-on-write, the changes are never written back to it.
 #ifdef _WIN32
-  explicit File(const wchar_t* filepath);
+  explicit File(const wchar_t* filepath, bool read_only = false);
 #else
-  explicit File(const char* filepath);
+  explicit File(const char* filepath, bool read_only = false);
 #endif  // _WIN32
 
   void* GetFilePionter() const {
     return fp_;
   }
 
-  unsigned int GetSize() const {
+  size_t GetSize() const {
     return size_;
   }
 
@@ -46,14 +49,36 @@ class File {
 #endif  // _WIN32
   void* fp_;
   size_t size_;
+  bool read_only_;
 };
 
+// Tells the OS that [p, p + size) won't be touched again soon if it is inside a file that is mapped in place,
+// so the pages are written back and leave the memory of the process instead of piling up while a big file is
+// processed from the start to the end. They are read back from the file if they are touched again.
+// Does nothing for any other memory, like a read-only file whose changes only exist in memory.
+void ReleaseMappedPages(void* p, size_t size);
+
+// Calls Callback() for every regular file under |dir|, one call at a time.
+// The tree is walked by |num_threads| threads on Linux, so Callback() can be called from any of them.
 #ifdef _WIN32
-void TraverseDirectory(const wchar_t* dir, int Callback(const wchar_t* file_path));
+void TraverseDirectory(const wchar_t* dir, int Callback(const wchar_t* file_path), int num_threads = 1);
 bool IsDirectory(const wchar_t* path);
+bool IsFile(const wchar_t* path);
 #else
-void TraverseDirectory(const char* dir, int Callback(const char* file_path, const struct stat* sb, int typeflag));
+void TraverseDirectory(const char* dir, int Callback(const char* file_path), int num_threads = 1);
 bool IsDirectory(const char* path);
+bool IsFile(const char* path);
+#endif  // _WIN32
+
+// Writes the data to a temporary file next to |file_path| and renames it to |file_path|, so the file is either
+// the old one or complete even after a crash. The missing directories are created.
+// The sink is written with as few system calls as possible.
+#ifdef _WIN32
+bool WriteFileAtomically(const wchar_t* file_path, const void* data, size_t size);
+bool WriteFileAtomically(const wchar_t* file_path, const OutputSink& sink);
+#else
+bool WriteFileAtomically(const char* file_path, const void* data, size_t size);
+bool WriteFileAtomically(const char* file_path, const OutputSink& sink);
 #endif  // _WIN32
 
 #endif  // FILEIO_H_
@@ -1,21 +1,198 @@
 #include "fileio.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <condition_variable>
+#include <cstdint>
 #include <cstdio>
+#include <cstring>
 #include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include <sys/mman.h>
+#include <sys/uio.h>
 
+#include <dirent.h>
 #include <fcntl.h>
-#include <ftw.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif  // __linux__
 
 using std::cerr;
 using std::endl;
+using std::string;
 
-// traverse directory and call callback() for each file
-void TraverseDirectory(const char* dir, int callback(const char* file_path, const struct stat* sb, int typeflag)) {
-  if (ftw(dir, callback, 16))
-    perror("ftw");
+namespace {
+
+// Reads the names and d_type of the entries of the open directory |fd|, except . and ..
+bool ReadDirectory(int fd, std::vector<std::pair<string, unsigned char>>* entries) {
+#ifdef __linux__
+  // getdents64 returns many entries per call and their types, without a stat for each of them
+  struct LinuxDirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1];  // null-terminated, as long as d_reclen allows
+  };
+  std::vector<char> buffer(32768);
+  while (true) {
+    long size = syscall(SYS_getdents64, fd, buffer.data(), buffer.size());
+    if (size == -1)
+      return false;
+    if (size == 0)
+      return true;
+    for (long pos = 0; pos < size;) {
+      const LinuxDirent64* d = reinterpret_cast<const LinuxDirent64*>(&buffer[pos]);
+      pos += d->d_reclen;
+      if (strcmp(d->d_name, ".") != 0 && strcmp(d->d_name, "..") != 0)
+        entries->emplace_back(d->d_name, d->d_type);
+    }
+  }
+#else
+  DIR* dir = fdopendir(dup(fd));
+  if (!dir)
+    return false;
+  while (struct dirent* d = readdir(dir)) {
+    if (strcmp(d->d_name, ".") != 0 && strcmp(d->d_name, "..") != 0)
+      entries->emplace_back(d->d_name, d->d_type);
+  }
+  closedir(dir);
+  return true;
+#endif  // __linux__
+}
+
+// Walks a directory tree with several threads. A thread walks depth-first like ftw() and hands the
+// subdirectories it finds to the idle threads, so with one thread the order is the same as ftw().
+// Symbolic links to files are followed, symbolic links to directories are not.
+class DirectoryWalker {
+ public:
+  DirectoryWalker(int callback(const char* file_path), int num_threads)
+      : callback_(callback), num_threads_(num_threads) {}
+
+  void Run(const string& root) {
+    // this thread is busy with the root before the others start waiting
+    busy_ = 1;
+    std::vector<std::thread> threads;
+    for (int i = 1; i < num_threads_; i++)
+      threads.emplace_back(&DirectoryWalker::Worker, this);
+
+    Walk(root);
+    Done();
+    Worker();
+    for (auto& t : threads)
+      t.join();
+  }
+
+ private:
+  void Worker() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      pending_available_.wait(lock, [this] { return !pending_.empty() || busy_ == 0; });
+      if (pending_.empty())
+        return;
+      string dir = std::move(pending_.back());
+      pending_.pop_back();
+      busy_++;
+      lock.unlock();
+      Walk(dir);
+      lock.lock();
+      busy_--;
+      if (busy_ == 0)
+        pending_available_.notify_all();
+    }
+  }
+
+  void Done() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    busy_--;
+    if (busy_ == 0)
+      pending_available_.notify_all();
+  }
+
+  // Gives |dir| to an idle thread if there is any.
+  bool HandOver(const string& dir) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (busy_ + static_cast<int>(pending_.size()) >= num_threads_)
+      return false;
+    pending_.push_back(dir);
+    pending_available_.notify_one();
+    return true;
+  }
+
+  void Walk(const string& dir) {
+    // O_NOFOLLOW in case the directory has been replaced by a symbolic link since it was read
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    std::vector<std::pair<string, unsigned char>> entries;
+    if (fd == -1 || !ReadDirectory(fd, &entries)) {
+      perror(("Read directory error: " + dir).c_str());
+      if (fd != -1)
+        close(fd);
+      return;
+    }
+
+    for (auto& entry : entries) {
+      unsigned char type = entry.second;
+      if (type == DT_UNKNOWN || type == DT_LNK) {
+        struct stat sb;
+        // the type of the entry itself if unknown, of the target for a link
+        if (fstatat(fd, entry.first.c_str(), &sb, type == DT_LNK ? 0 : AT_SYMLINK_NOFOLLOW) == -1)
+          continue;
+        if (S_ISREG(sb.st_mode))
+          type = DT_REG;
+        else if (S_ISDIR(sb.st_mode) && entry.second == DT_UNKNOWN)
+          type = DT_DIR;
+        else
+          continue;
+      }
+      entry.second = type;
+    }
+    // no descriptors stay open while walking the subdirectories
+    close(fd);
+
+    for (const auto& entry : entries) {
+      string path = dir + '/' + entry.first;
+      if (entry.second == DT_DIR) {
+        if (!HandOver(path))
+          Walk(path);
+      } else if (entry.second == DT_REG) {
+        std::lock_guard<std::mutex> lock(callback_mutex_);
+        callback_(path.c_str());
+      }
+    }
+  }
+
+  int (*callback_)(const char* file_path);
+  const int num_threads_;
+
+  std::mutex mutex_;
+  std::condition_variable pending_available_;
+  std::vector<string> pending_;
+  // number of threads walking a directory
+  int busy_ = 0;
+
+  std::mutex callback_mutex_;
+};
+
+// start and end of the files that are mapped in place, one for each file being processed
+std::mutex mappings_mutex;
+std::vector<std::pair<uint8_t*, uint8_t*>> shared_mappings;
+
+}  // namespace
+
+void TraverseDirectory(const char* dir, int callback(const char* file_path), int num_threads /*= 1*/) {
+  string root(dir);
+  // "dir/" gives "dir/file" like ftw()
+  while (root.size() > 1 && root.back() == '/')
+    root.pop_back();
+  DirectoryWalker(callback, num_threads).Run(root);
 }
 
 bool IsDirectory(const char* path) {
@@ -25,9 +202,69 @@ bool IsDirectory(const char* path) {
   return false;
 }
 
-File::File(const char* filepath) {
+bool IsFile(const char* path) {
+  struct stat sb;
+  if (!stat(path, &sb))
+    return S_ISREG(sb.st_mode);
+  return false;
+}
+
+bool WriteFileAtomically(const char* file_path, const void* data, size_t size) {
+  OutputSink sink;
+  sink.Reference(data, size);
+  return WriteFileAtomically(file_path, sink);
+}
+
+bool WriteFileAtomically(const char* file_path, const OutputSink& sink) {
+  string path(file_path);
+  // mkdir fails for the directories that exist already
+  for (size_t pos = path.find('/', 1); pos != string::npos; pos = path.find('/', pos + 1))
+    mkdir(path.substr(0, pos).c_str(), 0777);
+
+  // unique among the threads and processes writing next to the file
+  static std::atomic<unsigned> counter(0);
+  string temp_path = path + ".tmp" + std::to_string(getpid()) + "-" + std::to_string(counter++);
+  int fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0666);
+  if (fd == -1) {
+    perror("Create file error");
+    return false;
+  }
+
+  // all the slices with as few system calls as possible
+  std::vector<iovec> iov;
+  for (const OutputSink::Slice& slice : sink.slices())
+    iov.push_back({ const_cast<uint8_t*>(slice.data), slice.size });
+  bool ok = true;
+  for (size_t i = 0; i < iov.size();) {
+    ssize_t written = writev(fd, &iov[i], std::min<size_t>(iov.size() - i, IOV_MAX));
+    if (written == -1) {
+      if (errno == EINTR)
+        continue;
+      ok = false;
+      break;
+    }
+    // skip what is written, the last one may be written partly
+    for (; i < iov.size() && static_cast<size_t>(written) >= iov[i].iov_len; i++)
+      written -= iov[i].iov_len;
+    if (i < iov.size()) {
+      iov[i].iov_base = static_cast<uint8_t*>(iov[i].iov_base) + written;
+      iov[i].iov_len -= written;
+    }
+  }
+  // the data has to be on the disk before the rename, otherwise a crash could leave an empty file
+  ok = ok && fsync(fd) == 0;
+  ok = close(fd) == 0 && ok;
+  if (ok && rename(temp_path.c_str(), file_path) == 0)
+    return true;
+
+  perror("Write file error");
+  unlink(temp_path.c_str());
+  return false;
+}
+
+File::File(const char* filepath, bool read_only /*= false*/) : read_only_(read_only) {
   fp_ = nullptr;
-  fd_ = open(filepath, O_RDWR);
+  fd_ = open(filepath, read_only ? O_RDONLY : O_RDWR);
 
   if (fd_ == -1) {
     perror("Open file error");
@@ -40,22 +277,61 @@ File::File(const char* filepath) {
     return;
   }
   size_ = sb.st_size;
+  // only possible in 32-bit builds
+  if (static_cast<off_t>(size_) != sb.st_size) {
+    cerr << "File is too big to map: " << filepath << endl;
+    return;
+  }
 
   // map the file into memory
-  fp_ = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  fp_ = mmap(nullptr, size_, PROT_READ | PROT_WRITE, read_only ? MAP_PRIVATE : MAP_SHARED, fd_, 0);
   if (fp_ == MAP_FAILED) {
     perror("Map file error");
     fp_ = nullptr;
+    return;
+  }
+  if (!read_only_) {
+    std::lock_guard<std::mutex> lock(mappings_mutex);
+    shared_mappings.emplace_back(static_cast<uint8_t*>(fp_), static_cast<uint8_t*>(fp_) + size_);
   }
 }
 
 void File::UnMapFile(size_t new_size) {
+  if (!read_only_) {
+    std::lock_guard<std::mutex> lock(mappings_mutex);
+    for (auto it = shared_mappings.begin(); it != shared_mappings.end(); ++it) {
+      if (it->first == fp_) {
+        shared_mappings.erase(it);
+        break;
+      }
+    }
+  }
   if (munmap(fp_, size_) == -1)
     perror("munmap");
-  if (new_size)
+  if (new_size && !read_only_)
     if (ftruncate(fd_, new_size) == -1)
       perror("ftruncate");
 
   close(fd_);
   fp_ = nullptr;
 }
+
+void ReleaseMappedPages(void* p, size_t size) {
+  static const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+  uint8_t* begin = static_cast<uint8_t*>(p);
+  uint8_t* end = begin + size;
+  {
+    std::lock_guard<std::mutex> lock(mappings_mutex);
+    bool found = false;
+    for (const auto& mapping : shared_mappings)
+      found = found || (mapping.first <= begin && end <= mapping.second);
+    if (!found)
+      return;
+  }
+  // only the whole pages in the range, the others may still be in use
+  uintptr_t page_begin = (reinterpret_cast<uintptr_t>(begin) + page_size - 1) & ~(page_size - 1);
+  uintptr_t page_end = reinterpret_cast<uintptr_t>(end) & ~(page_size - 1);
+  // the mapping is shared, so dropping the pages keeps the changes in the page cache
+  if (page_begin < page_end && madvise(reinterpret_cast<void*>(page_begin), page_end - page_begin, MADV_DONTNEED))
+    perror("madvise");
+}
@@ -1,7 +1,14 @@
 #include "fileio.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
 #include <cstdio>
 #include <iostream>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
 
 using std::cerr;
 using std::endl;
@@ -19,10 +26,15 @@ void PrintErrorMessage(const char* msg) {
   }
 }
 
+// start and end of the files that are mapped in place, one for each file being processed
+std::mutex mappings_mutex;
+std::vector<std::pair<uint8_t*, uint8_t*>> shared_mappings;
+
 }  // namespace
 
 // traverse directory and call Callback() for each file
-void TraverseDirectory(const wchar_t* dir, int callback(const wchar_t* file_path)) {
+// walking in parallel is not implemented on Windows, |num_threads| is ignored
+void TraverseDirectory(const wchar_t* dir, int callback(const wchar_t* file_path), int num_threads /*= 1*/) {
   WIN32_FIND_DATA FindFileData;
   wchar_t DirSpec[MAX_PATH];
   lstrcpy(DirSpec, dir);
@@ -66,26 +78,102 @@ bool IsDirectory(const wchar_t* path) {
   return (fa & FILE_ATTRIBUTE_DIRECTORY) != 0;
 }
 
-File::File(const wchar_t* filepath) {
+bool IsFile(const wchar_t* path) {
+  DWORD fa = GetFileAttributes(path);
+  if (fa == INVALID_FILE_ATTRIBUTES)
+    return false;
+  return (fa & FILE_ATTRIBUTE_DIRECTORY) == 0;
+}
+
+bool WriteFileAtomically(const wchar_t* file_path, const void* data, size_t size) {
+  OutputSink sink;
+  sink.Reference(data, size);
+  return WriteFileAtomically(file_path, sink);
+}
+
+bool WriteFileAtomically(const wchar_t* file_path, const OutputSink& sink) {
+  std::wstring path(file_path);
+  // CreateDirectory fails for the directories that exist already
+  for (size_t pos = path.find_first_of(L"\\/", 1); pos != std::wstring::npos;
+       pos = path.find_first_of(L"\\/", pos + 1))
+    CreateDirectory(path.substr(0, pos).c_str(), nullptr);
+
+  // unique among the threads and processes writing next to the file
+  static std::atomic<unsigned> counter(0);
+  std::wstring temp_path =
+      path + L".tmp" + std::to_wstring(GetCurrentProcessId()) + L"-" + std::to_wstring(counter++);
+  HANDLE hFile = CreateFile(temp_path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (hFile == INVALID_HANDLE_VALUE) {
+    PrintErrorMessage("Create file error!");
+    return false;
+  }
+
+  // WriteFileGather needs unbuffered I/O with aligned pages, so one WriteFile per slice
+  bool ok = true;
+  for (const OutputSink::Slice& slice : sink.slices()) {
+    for (size_t pos = 0; ok && pos < slice.size;) {
+      DWORD written = 0;
+      DWORD size = static_cast<DWORD>(std::min<size_t>(slice.size - pos, 1 << 30));
+      ok = WriteFile(hFile, slice.data + pos, size, &written, nullptr) && written == size;
+      pos += size;
+    }
+  }
+  // the data has to be on the disk before the rename, otherwise a crash could leave an empty file
+  ok = FlushFileBuffers(hFile) && ok;
+  CloseHandle(hFile);
+  if (ok && MoveFileEx(temp_path.c_str(), file_path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+    return true;
+
+  PrintErrorMessage("Write file error!");
+  DeleteFile(temp_path.c_str());
+  return false;
+}
+
+File::File(const wchar_t* filepath, bool read_only /*= false*/) : read_only_(read_only) {
   fp_ = nullptr;
-  hFile_ = CreateFile(filepath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
-                      FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN | FILE_FLAG_WRITE_THROUGH, nullptr);
+  size_ = 0;
+  hFile_ = CreateFile(filepath, read_only ? GENERIC_READ : GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr,
+                      OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN | FILE_FLAG_WRITE_THROUGH,
+                      nullptr);
   if (hFile_ == INVALID_HANDLE_VALUE) {
     PrintErrorMessage("Open file error!");
+    return;
+  }
+  LARGE_INTEGER file_size;
+  if (!GetFileSizeEx(hFile_, &file_size)) {
+    PrintErrorMessage("GetFileSizeEx error!");
+    return;
+  }
+  size_ = static_cast<size_t>(file_size.QuadPart);
+  // only possible in 32-bit builds
+  if (static_cast<LONGLONG>(size_) != file_size.QuadPart) {
+    cerr << "File is too big to map!" << endl;
     size_ = 0;
     return;
   }
-  size_ = GetFileSize(hFile_, nullptr);
-  hMap_ = CreateFileMapping(hFile_, nullptr, PAGE_READWRITE, 0, 0, nullptr);
-  if (hMap_ == INVALID_HANDLE_VALUE) {
+  hMap_ = CreateFileMapping(hFile_, nullptr, read_only ? PAGE_WRITECOPY : PAGE_READWRITE, 0, 0, nullptr);
+  if (hMap_ == nullptr) {
     PrintErrorMessage("Map file error!");
     return;
   }
-  fp_ = MapViewOfFile(hMap_, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+  fp_ = MapViewOfFile(hMap_, read_only ? FILE_MAP_COPY : FILE_MAP_ALL_ACCESS, 0, 0, 0);
+  if (fp_ && !read_only_) {
+    std::lock_guard<std::mutex> lock(mappings_mutex);
+    shared_mappings.emplace_back(static_cast<uint8_t*>(fp_), static_cast<uint8_t*>(fp_) + size_);
+  }
 }
 
 void File::UnMapFile(size_t new_size) {
-  if (new_size < size_)
+  if (!read_only_) {
+    std::lock_guard<std::mutex> lock(mappings_mutex);
+    for (auto it = shared_mappings.begin(); it != shared_mappings.end(); ++it) {
+      if (it->first == fp_) {
+        shared_mappings.erase(it);
+        break;
+      }
+    }
+  }
+  if (new_size < size_ && !read_only_)
     if (!FlushViewOfFile(fp_, 0))
       PrintErrorMessage("Write file error!");
 
@@ -93,11 +181,29 @@ void File::UnMapFile(size_t new_size) {
     PrintErrorMessage("UnmapViewOfFile error!");
 
   CloseHandle(hMap_);
-  if (new_size) {
-    SetFilePointer(hFile_, new_size, nullptr, FILE_BEGIN);
+  if (new_size && !read_only_) {
+    LARGE_INTEGER end;
+    end.QuadPart = new_size;
+    SetFilePointerEx(hFile_, end, nullptr, FILE_BEGIN);
     if (!SetEndOfFile(hFile_))
       PrintErrorMessage("SetEndOfFile error!");
   }
   CloseHandle(hFile_);
   fp_ = nullptr;
 }
+
+void ReleaseMappedPages(void* p, size_t size) {
+  uint8_t* begin = static_cast<uint8_t*>(p);
+  uint8_t* end = begin + size;
+  {
+    std::lock_guard<std::mutex> lock(mappings_mutex);
+    bool found = false;
+    for (const auto& mapping : shared_mappings)
+      found = found || (mapping.first <= begin && end <= mapping.second);
+    if (!found)
+      return;
+  }
+  // Unlocking pages that are not locked removes them from the working set, the modified pages of a file
+  // mapping are written back by the system. Fails with ERROR_NOT_LOCKED, which is expected.
+  VirtualUnlock(p, size);
+}
@@ -10,7 +10,7 @@ size_t Dwf::Leanify(size_t size_leanified /*= 0*/) {
   if (memcmp(fp_ + dwf_header_len, Zip::header_magic, sizeof(Zip::header_magic))) {
     return Format::Leanify(size_leanified);
   }
-  size_ = Zip(fp_, size_).Leanify(size_leanified);
+  size_ = Zip(fp_, size_, ctx_).Leanify(size_leanified);
   fp_ -= size_leanified;
   return size_;
 }
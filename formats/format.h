@@ -6,15 +6,21 @@
 #include <cstring>  // memmove
 #include <vector>
 
+#include "../context.h"
+#include "../memory_budget.h"
+#include "../output_sink.h"
+#include "../profile.h"
+
 class Format {
  public:
-  explicit Format(std::vector<uint8_t>& data) : fp_(data.data()), size_(data.size()) {}
-  explicit Format(void* p, size_t s = 0) : fp_(static_cast<uint8_t*>(p)), size_(s) {}
+  Format(std::vector<uint8_t>& data, const Context& ctx) : fp_(data.data()), size_(data.size()), ctx_(ctx) {}
+  Format(void* p, size_t s, const Context& ctx) : fp_(static_cast<uint8_t*>(p)), size_(s), ctx_(ctx) {}
 
   virtual ~Format() = default;
 
   virtual size_t Leanify(size_t size_leanified = 0) {
     if (size_leanified) {
+      ScopedTimer timer(kStageMemmove, size_);
       memmove(fp_ - size_leanified, fp_, size_);
       fp_ -= size_leanified;
     }
@@ -22,11 +28,36 @@ class Format {
     return size_;
   }
 
+  // Appends the result to |sink| and returns its size. The result may reference the input, which must stay valid
+  // until the sink is written. By default the file is leanified in place and referenced, a container overrides it
+  // to reference the parts it keeps instead of moving them.
+  virtual size_t LeanifyTo(OutputSink* sink) {
+    const uint8_t* p = fp_;
+    size_t size = Leanify();
+    sink->Reference(p, size);
+    return size;
+  }
+
+  // Peak memory of leanifying the file with |ctx| on one thread, not counting the file itself, for --max-memory.
+  // By default it is guessed from the size, the formats that know better override it.
+  virtual size_t MemoryEstimate(const Context& ctx) const {
+    return EmbeddedMemory(size_, ctx);
+  }
+
+  // the encoder that produced the output, for --stats-json
+  const char* engine() const {
+    return engine_;
+  }
+
  protected:
   // pointer to the file content
   uint8_t* fp_;
   // size of the file
   size_t size_;
+  // settings and depth of this file
+  const Context ctx_;
+  // "store" if the data is only moved or minified, not encoded again
+  const char* engine_ = "store";
 };
 
 #endif  // FORMATS_FORMAT_H_
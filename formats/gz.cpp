@@ -1,12 +1,14 @@
 #include "gz.h"
 
+#include <algorithm>
 #include <cstdint>
 #include <cstring>
 #include <iostream>
 
-#include <zopfli/deflate.h>
-#include <zopflipng/lodepng/lodepng.h>
+#include <zopfli/zopfli.h>
 
+#include "../crc32.h"
+#include "../inflate.h"
 #include "../leanify.h"
 #include "../utils.h"
 
@@ -27,7 +29,7 @@ size_t Gz::Leanify(size_t size_leanified /*= 0*/) {
     return Format::Leanify(size_leanified);
   }
 
-  depth++;
+  const Context nested_ctx = ctx_.Nested();
   uint8_t flags = *(fp_ + 3);
 
   memmove(fp_ - size_leanified, fp_, 10);
@@ -50,7 +52,7 @@ size_t Gz::Leanify(size_t size_leanified /*= 0*/) {
   // FNAME
   if (flags & (1 << 3)) {
     filename.assign(reinterpret_cast<char*>(p_read));
-    PrintFileName(filename);
+    PrintFileName(nested_ctx, filename);
     while (p_read < fp_ + size_ && *p_read++) {
       // skip string
     }
@@ -73,49 +75,61 @@ size_t Gz::Leanify(size_t size_leanified /*= 0*/) {
     return size_;
   }
 
-  if (is_fast) {
+  if (ctx_.is_fast) {
     memmove(p_write, p_read, fp_ + size_ - p_read);
     return size_ - (p_read - p_write);
   }
 
-  uint32_t uncompressed_size = *(uint32_t*)(fp_ + size_ - 4);
+  // ISIZE is the size modulo 2^32, only a hint for files of 4 GB and up
+  uint32_t isize = *(uint32_t*)(fp_ + size_ - 4);
   uint32_t crc = *(uint32_t*)(fp_ + size_ - 8);
   size_t original_size = fp_ + size_ - 8 - p_read;
 
-  size_t actual_uncompressed_size = 0;
+  size_t uncompressed_size = 0;
   uint8_t* buffer = nullptr;
-  if (lodepng_inflate(&buffer, &actual_uncompressed_size, p_read, original_size,
-                      &lodepng_default_decompress_settings) ||
-      !buffer || actual_uncompressed_size != uncompressed_size || crc != lodepng_crc32(buffer, uncompressed_size)) {
+  if (Inflate(&buffer, &uncompressed_size, p_read, original_size, isize) || !buffer ||
+      static_cast<uint32_t>(uncompressed_size) != isize || crc != Crc32(buffer, uncompressed_size)) {
     cerr << "GZ corrupted!" << endl;
     free(buffer);
     memmove(p_write, p_read, original_size + 8);
     return size_ - (p_read - p_write);
   }
 
-  uncompressed_size = LeanifyFile(buffer, uncompressed_size, 0, filename);
+  uncompressed_size = LeanifyFile(buffer, uncompressed_size, nested_ctx, 0, filename);
 
   ZopfliOptions options;
   ZopfliInitOptions(&options);
-  options.numiterations = iterations;
+  options.numiterations = ctx_.iterations;
+  options.convergenceiterations = ctx_.convergence_iterations;
+  if (ctx_.zopfli_block_size)
+    options.masterblocksize = ctx_.zopfli_block_size;
 
-  uint8_t bp = 0, *out = nullptr;
+  uint8_t* out = nullptr;
   size_t outsize = 0;
-  ZopfliDeflate(&options, 2, 1, buffer, uncompressed_size, &bp, &out, &outsize);
+  ZopfliDeflateParallel(&options, ctx_, buffer, uncompressed_size, &out, &outsize);
 
   if (outsize < original_size) {
+    engine_ = "Zopfli";
     memcpy(p_write, out, outsize);
     p_write += outsize;
-    *(uint32_t*)p_write = lodepng_crc32(buffer, uncompressed_size);
-    *(uint32_t*)(p_write + 4) = uncompressed_size;
+    *(uint32_t*)p_write = Crc32(buffer, uncompressed_size);
+    *(uint32_t*)(p_write + 4) = static_cast<uint32_t>(uncompressed_size);
   } else {
     memmove(p_write, p_read, original_size + 8);
     p_write += original_size;
   }
   free(buffer);
   free(out);
-  depth--;
   fp_ -= size_leanified;
   size_ = p_write + 8 - fp_;
   return size_;
+}
+
+size_t Gz::MemoryEstimate(const Context& ctx) const {
+  if (size_ <= 18 || ctx.is_fast)
+    return 0;
+  // ISIZE is the size modulo 2^32, the data is at least as big as the file unless it wrapped around
+  size_t uncompressed_size = std::max<size_t>(*(uint32_t*)(fp_ + size_ - 4), size_);
+  // the decompressed file, leanified as an embedded file, and the output of Zopfli
+  return uncompressed_size + EmbeddedMemory(uncompressed_size, ctx) + size_;
 }
\ No newline at end of file
@@ -71,7 +71,7 @@ size_t Ico::Leanify(size_t size_leanified /*= 0*/) {
 
     // Leanify PNG
     if (memcmp(fp_ + old_offset, Png::header_magic, sizeof(Png::header_magic)) == 0) {
-      entries[i].dwBytesInRes = Png(fp_ + old_offset, entries[i].dwBytesInRes)
+      entries[i].dwBytesInRes = Png(fp_ + old_offset, entries[i].dwBytesInRes, ctx_)
                                     .Leanify(size_leanified + old_offset - entries[i].dwImageOffset);
       continue;
     }
@@ -84,7 +84,7 @@ size_t Ico::Leanify(size_t size_leanified /*= 0*/) {
           dib->biCompression == 0 &&                                           // BI_RGB aka no compression
           dib->biSize + std::max(dib->biSizeImage, 256 * 256 * 4U) <= entries[i].dwBytesInRes &&
           (dib->biSizeImage == 0 || dib->biSizeImage >= 256 * 256 * 4U) && dib->biClrUsed == 0) {
-        VerbosePrint("Converting 256x256 BMP to PNG...");
+        VerbosePrint(ctx_, "Converting 256x256 BMP to PNG...");
         // BMP stores ARGB in little endian, so it's actually BGRA, convert it to normal RGBA
         // It also stores the pixels upside down for some reason, so reverse it.
         uint8_t* bmp_row = fp_ + old_offset + dib->biSize + 256 * 256 * 4;
@@ -101,7 +101,7 @@ size_t Ico::Leanify(size_t size_leanified /*= 0*/) {
         }
         if (lodepng::encode(png, raw, 256, 256) == 0) {
           // Optimize the new PNG
-          size_t png_size = Png(png).Leanify();
+          size_t png_size = Png(png, ctx_).Leanify();
           if (png_size < entries[i].dwBytesInRes) {
             entries[i].dwBytesInRes = png_size;
             memcpy(fp_ + entries[i].dwImageOffset - size_leanified, png.data(), png_size);
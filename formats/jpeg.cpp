@@ -6,31 +6,46 @@
 
 #include <mozjpeg/jpeglib.h>
 
+#include "../profile.h"
+
 const uint8_t Jpeg::header_magic[] = { 0xFF, 0xD8, 0xFF };
-bool Jpeg::keep_exif_ = false;
-bool Jpeg::keep_icc_profile_ = false;
-bool Jpeg::keep_all_metadata_ = false;
-bool Jpeg::force_arithmetic_coding_ = false;
 
 namespace {
 
-jmp_buf setjmp_buffer;
+// mozjpeg error manager extended with the jump buffer of the current call,
+// so that each Jpeg::Leanify recovers from its own errors.
+struct ErrorManager {
+  // must be the first member, mozjpeg only knows about this part
+  struct jpeg_error_mgr pub;
+  jmp_buf* setjmp_buffer;
+};
+
+// Print mozjpeg messages through std::cerr instead of stderr, so they stay with the output of the current file.
+void mozjpeg_output_message(j_common_ptr cinfo) {
+  char buffer[JMSG_LENGTH_MAX];
+  (*cinfo->err->format_message)(cinfo, buffer);
+  std::cerr << buffer << std::endl;
+}
 
 void mozjpeg_error_handler(j_common_ptr cinfo) {
   (*cinfo->err->output_message)(cinfo);
 
-  longjmp(setjmp_buffer, 1);
+  longjmp(*reinterpret_cast<ErrorManager*>(cinfo->err)->setjmp_buffer, 1);
 }
 
 }  // namespace
 
 size_t Jpeg::Leanify(size_t size_leanified /*= 0*/) {
+  ScopedTimer timer(kStageMozjpeg, size_);
   struct jpeg_decompress_struct srcinfo;
   struct jpeg_compress_struct dstinfo;
-  struct jpeg_error_mgr jsrcerr, jdsterr;
+  ErrorManager jsrcerr, jdsterr;
+  jmp_buf setjmp_buffer;
 
-  srcinfo.err = jpeg_std_error(&jsrcerr);
-  jsrcerr.error_exit = mozjpeg_error_handler;
+  srcinfo.err = jpeg_std_error(&jsrcerr.pub);
+  jsrcerr.pub.error_exit = mozjpeg_error_handler;
+  jsrcerr.pub.output_message = mozjpeg_output_message;
+  jsrcerr.setjmp_buffer = &setjmp_buffer;
   if (setjmp(setjmp_buffer)) {
     jpeg_destroy_compress(&dstinfo);
     jpeg_destroy_decompress(&srcinfo);
@@ -40,15 +55,17 @@ size_t Jpeg::Leanify(size_t size_leanified /*= 0*/) {
 
   jpeg_create_decompress(&srcinfo);
 
-  dstinfo.err = jpeg_std_error(&jdsterr);
-  jdsterr.error_exit = mozjpeg_error_handler;
+  dstinfo.err = jpeg_std_error(&jdsterr.pub);
+  jdsterr.pub.error_exit = mozjpeg_error_handler;
+  jdsterr.pub.output_message = mozjpeg_output_message;
+  jdsterr.setjmp_buffer = &setjmp_buffer;
 
   jpeg_create_compress(&dstinfo);
 
-  if (is_verbose) {
+  if (ctx_.is_verbose) {
     dstinfo.err->trace_level++;
   }
-  if (is_fast) {
+  if (ctx_.is_fast) {
     jpeg_c_set_int_param(&dstinfo, JINT_COMPRESS_PROFILE, JCP_FASTEST);
   }
 
@@ -57,10 +74,10 @@ size_t Jpeg::Leanify(size_t size_leanified /*= 0*/) {
 
   // Always save exif to show warning if orientation might change.
   jpeg_save_markers(&srcinfo, JPEG_APP0 + 1, 0xFFFF);
-  if (keep_icc_profile_ || keep_all_metadata_) {
+  if (ctx_.keep_icc_profile || ctx_.jpeg_keep_all_metadata) {
     jpeg_save_markers(&srcinfo, JPEG_APP0 + 2, 0xFFFF);
   }
-  if (keep_all_metadata_) {
+  if (ctx_.jpeg_keep_all_metadata) {
     // Save the rest APPn markers.
     for (int i = 3; i < 16; i++)
       jpeg_save_markers(&srcinfo, JPEG_APP0 + i, 0xFFFF);
@@ -77,7 +94,7 @@ size_t Jpeg::Leanify(size_t size_leanified /*= 0*/) {
   jpeg_copy_critical_parameters(&srcinfo, &dstinfo);
 
   // use arithmetic coding if input file is arithmetic coded or if forced to
-  if (srcinfo.arith_code || force_arithmetic_coding_) {
+  if (srcinfo.arith_code || ctx_.jpeg_arithmetic_coding) {
     dstinfo.arith_code = true;
     dstinfo.optimize_coding = false;
   } else {
@@ -93,7 +110,7 @@ size_t Jpeg::Leanify(size_t size_leanified /*= 0*/) {
   jpeg_write_coefficients(&dstinfo, coef_arrays);
 
   for (auto marker = srcinfo.marker_list; marker; marker = marker->next) {
-    if (marker->marker == JPEG_APP0 + 1 && !keep_exif_ && !keep_all_metadata_) {
+    if (marker->marker == JPEG_APP0 + 1 && !ctx_.keep_exif && !ctx_.jpeg_keep_all_metadata) {
       // Tag number: 0x0112, data format: unsigned short(3), number of components: 1
       const uint8_t kExifOrientation[] = { 0x12, 0x01, 0x03, 0x00, 0x01, 0x00, 0x00, 0x00 };
       const uint8_t kExifOrientationMotorola[] = { 0x01, 0x12, 0x00, 0x03, 0x00, 0x00, 0x00, 0x01 };
@@ -132,6 +149,7 @@ size_t Jpeg::Leanify(size_t size_leanified /*= 0*/) {
   if (outsize < size_) {
     memcpy(fp_, outbuffer, outsize);
     size_ = outsize;
+    engine_ = "mozjpeg";
   } else {
     memmove(fp_, fp_ + size_leanified, size_);
   }
@@ -139,4 +157,21 @@ size_t Jpeg::Leanify(size_t size_leanified /*= 0*/) {
   jpeg_destroy_compress(&dstinfo);
 
   return size_;
+}
+
+size_t Jpeg::MemoryEstimate(const Context& ctx) const {
+  // find the frame header for the size of the image
+  for (size_t pos = 2; pos + 10 <= size_ && fp_[pos] == 0xFF;) {
+    uint8_t marker = fp_[pos + 1];
+    // SOF0 - SOF15, except DHT, JPG and DAC
+    if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+      size_t height = fp_[pos + 5] << 8 | fp_[pos + 6];
+      size_t width = fp_[pos + 7] << 8 | fp_[pos + 8];
+      size_t components = fp_[pos + 9];
+      // 16-bit DCT coefficients without subsampling, and the scans mozjpeg tries and the output
+      return width * height * components * 2 + (ctx.is_fast ? 2 : 4) * size_;
+    }
+    pos += 2 + (fp_[pos + 2] << 8 | fp_[pos + 3]);
+  }
+  return Format::MemoryEstimate(ctx);
 }
\ No newline at end of file
@@ -5,8 +5,8 @@
 
 class Lua : public Format {
  public:
-  explicit Lua(void* p, size_t s = 0)
-      : Format(p, s), p_read_(static_cast<uint8_t*>(p)), p_write_(static_cast<uint8_t*>(p)) {}
+  Lua(void* p, size_t s, const Context& ctx)
+      : Format(p, s, ctx), p_read_(static_cast<uint8_t*>(p)), p_write_(static_cast<uint8_t*>(p)) {}
 
   size_t Leanify(size_t size_leanified = 0) override;
 
@@ -48,11 +48,11 @@ size_t Mime::Leanify(size_t size_leanified /*= 0*/) {
       break;
     }
 
-    if (is_verbose) {
+    if (ctx_.is_verbose) {
       cout << string(reinterpret_cast<char*>(start), 8) << "... found at offset 0x" << std::hex << start - fp_
            << std::dec << endl;
     }
-    size_t new_size = Base64(p_read, end - p_read).Leanify(p_read - p_write);
+    size_t new_size = Base64(p_read, end - p_read, ctx_).Leanify(p_read - p_write);
     p_write += new_size;
     p_read = end;
   }
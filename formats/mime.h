@@ -3,8 +3,6 @@
 
 #include "format.h"
 
-extern bool is_verbose;
-
 // Multipurpose Internet Mail Extensions
 // https://en.wikipedia.org/wiki/MIME
 
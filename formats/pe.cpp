@@ -48,7 +48,7 @@ size_t Pe::Leanify(size_t size_leanified /*= 0*/) {
   }
 
   if (optional_header->Subsystem == 1) {
-    VerbosePrint(".sys (driver file) detected, skip.");
+    VerbosePrint(ctx_, ".sys (driver file) detected, skip.");
     return Format::Leanify(size_leanified);
   }
 
@@ -72,7 +72,7 @@ size_t Pe::Leanify(size_t size_leanified /*= 0*/) {
     *(uint32_t*)(fp_ - size_leanified + 0x3C) = new_pe_header_offset;
   } else {
     // this file probably already packed with some extreme packer
-    VerbosePrint("PE Header already overlaps DOS Header.");
+    VerbosePrint(ctx_, "PE Header already overlaps DOS Header.");
     if (size_leanified) {
       // move entire SizeOfHeaders to make sure nothing was missed
       memmove(fp_ - size_leanified, fp_, *(uint32_t*)(fp_ + pe_header_offset + 0x54));
@@ -132,7 +132,7 @@ size_t Pe::Leanify(size_t size_leanified /*= 0*/) {
         total_header_size -= sizeof(ImageSectionHeader);
         i--;
 
-        VerbosePrint("Relocation Table removed.");
+        VerbosePrint(ctx_, "Relocation Table removed.");
       }
     } else if (rsrc_virtual_address && section_table[i].VirtualAddress == rsrc_virtual_address) {
       rsrc_raw_offset = section_table[i].PointerToRawData;
@@ -186,14 +186,14 @@ size_t Pe::Leanify(size_t size_leanified /*= 0*/) {
       TraverseRSRC(reinterpret_cast<ImageResourceDirectory*>(fp_ + rsrc_raw_offset));
     }
 
-    VerbosePrint(rsrc_data_.size(), " embedded resources found.");
+    VerbosePrint(ctx_, rsrc_data_.size(), " embedded resources found.");
     // sort it according to it's data offset
     std::sort(rsrc_data_.begin(), rsrc_data_.end(),
               [](const RsrcEntry& a, const RsrcEntry& b) { return a.entry->OffsetToData < b.entry->OffsetToData; });
 
     // detect non standard resource, maybe produced by some packer
     if (rsrc_data_.empty() || !IsRSRCValid(rsrc_virtual_address, rsrc_virtual_size)) {
-      VerbosePrint("Non standard resource detected.");
+      VerbosePrint(ctx_, "Non standard resource detected.");
       if (reloc_raw_size) {
         // move everything before reloc
         memmove(fp_ - size_leanified + header_size_aligned, fp_ + header_size_aligned + pe_size_leanified,
@@ -228,12 +228,11 @@ size_t Pe::Leanify(size_t size_leanified /*= 0*/) {
                     rsrc_virtual_address);
       }
 
-      depth++;
-
+      const Context nested_ctx = ctx_.Nested();
       for (auto& res : rsrc_data_) {
-        if (depth <= max_depth) {
+        if (nested_ctx.depth <= nested_ctx.max_depth) {
           // print resource name
-          PrintFileName(res.name);
+          PrintFileName(nested_ctx, res.name);
         }
 
         res.entry = reinterpret_cast<ImageResourceDataEntry*>(reinterpret_cast<char*>(res.entry) - pe_size_leanified -
@@ -250,12 +249,12 @@ size_t Pe::Leanify(size_t size_leanified /*= 0*/) {
         }
 
         size_t new_size = LeanifyFile(fp_ + rsrc_raw_offset + entry->OffsetToData - rsrc_virtual_address, entry->Size,
-                                      entry->OffsetToData - last_end + pe_size_leanified + size_leanified, res.name);
+                                      nested_ctx, entry->OffsetToData - last_end + pe_size_leanified + size_leanified,
+                                      res.name);
         entry->OffsetToData = last_end;
         entry->Size = new_size;
         last_end += new_size;
       }
-      depth--;
       rsrc_size_leanified = old_end - last_end;
       uint32_t rsrc_new_end = rsrc_raw_offset + last_end - rsrc_virtual_address;
       uint32_t rsrc_new_end_aligned = ((rsrc_new_end - 1) | (optional_header->FileAlignment - 1)) + 1;
@@ -316,7 +315,7 @@ size_t Pe::Leanify(size_t size_leanified /*= 0*/) {
 
   optional_header->SizeOfImage -= reloc_virtual_size + rsrc_decrease_size;
 
-  VerbosePrint("Update Section Table.");
+  VerbosePrint(ctx_, "Update Section Table.");
 
   for (int i = 0; i < image_file_header->NumberOfSections; i++) {
     if (section_table[i].VirtualAddress > reloc_virtual_address) {
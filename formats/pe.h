@@ -11,8 +11,6 @@
 // PE format specification
 // http://msdn.microsoft.com/en-us/gg463119.aspx
 
-extern bool is_verbose;
-
 class Pe : public Format {
  public:
   using Format::Format;
@@ -1,13 +1,18 @@
 #include "png.h"
 
+#include <algorithm>
 #include <cstdint>
 #include <cstring>
 #include <iostream>
 
-#include <zopflipng/lodepng/lodepng.h>
 #include <zopflipng/zopflipng_lib.h>
 
+#include "../crc32.h"
+#include "../inflate.h"
+#include "../job_queue.h"
 #include "../leanify.h"
+#include "../memory_budget.h"
+#include "../profile.h"
 #include "../utils.h"
 
 using std::cerr;
@@ -16,7 +21,28 @@ using std::endl;
 using std::vector;
 
 const uint8_t Png::header_magic[] = { 0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A };
-bool Png::keep_icc_profile_ = false;
+
+namespace {
+
+// Sets the size of the filtered scanlines and of the decoded pixels from IHDR, which is the first chunk.
+// Returns false if there is no IHDR.
+bool GetImageSizes(const uint8_t* fp, size_t size, size_t* raw_size, size_t* pixels_size) {
+  if (size < 33 || memcmp(fp + 12, "IHDR", 4) != 0)
+    return false;
+  size_t width = BSWAP32(*(uint32_t*)(fp + 16));
+  size_t height = BSWAP32(*(uint32_t*)(fp + 20));
+  size_t bit_depth = fp[24];
+  // gray, -, RGB, palette, gray + alpha, -, RGBA
+  const size_t kChannels[] = { 1, 0, 3, 1, 2, 0, 4 };
+  size_t channels = fp[25] < 7 ? kChannels[fp[25]] : 4;
+  // a filter type byte before every scanline
+  *raw_size = height * (1 + (width * channels * bit_depth + 7) / 8);
+  // ZopfliPNG decodes to 8 or 16 bits RGBA
+  *pixels_size = width * height * (bit_depth == 16 ? 8 : 4);
+  return true;
+}
+
+}  // namespace
 
 size_t Png::Leanify(size_t size_leanified /*= 0*/) {
   // header
@@ -73,13 +99,13 @@ size_t Png::Leanify(size_t size_leanified /*= 0*/) {
                           // tRNS must be before IDAT according to PNG spec
           return idat_addr != nullptr;
         case 0x50434369:  // iCCP     ICC profile
-          return !keep_icc_profile_;
+          return !ctx_.keep_icc_profile;
         default:
           return true;
       }
     }();
     if (should_remove) {
-      if (is_verbose) {
+      if (ctx_.is_verbose) {
         // chunk name
         for (int i = 4; i < 8; i++)
           cout << static_cast<char>(p_read[i]);
@@ -107,19 +133,37 @@ size_t Png::Leanify(size_t size_leanified /*= 0*/) {
 
   {
     ZopfliPNGOptions zopflipng_options;
-    zopflipng_options.use_zopfli = !is_fast;
+    zopflipng_options.use_zopfli = !ctx_.is_fast;
     zopflipng_options.lossy_transparent = true;
     // see the switch above for information about these chunks
     zopflipng_options.keepchunks = { "acTL", "fcTL", "fdAT", "npTc" };
-    if (keep_icc_profile_)
+    if (ctx_.keep_icc_profile)
       zopflipng_options.keepchunks.push_back("iCCP");
-    zopflipng_options.num_iterations = iterations;
-    zopflipng_options.num_iterations_large = iterations;
+    zopflipng_options.num_iterations = ctx_.iterations;
+    zopflipng_options.num_iterations_large = ctx_.iterations;
+    zopflipng_options.convergence_iterations = ctx_.convergence_iterations;
+    zopflipng_options.master_block_size = ctx_.zopfli_block_size;
+    zopflipng_options.num_auto_filter_strategies = ctx_.png_filter_candidates;
+    size_t raw_size = size_, pixels_size = size_;
+    GetImageSizes(fp_, size_, &raw_size, &pixels_size);
+    // a filter strategy trial filters the image and compresses it
+    size_t trial_memory = 2 * raw_size + ZopfliMemory(raw_size, ctx_);
+    zopflipng_options.parallel_for = [this, trial_memory](size_t num_jobs, const std::function<void(size_t)>& job) {
+      // the trials only run on more threads while their memory is free
+      MemoryGrant extra_threads(trial_memory, std::min<size_t>(ctx_.num_threads, std::max<size_t>(num_jobs, 1)) - 1);
+      JobQueue::RunParallel(static_cast<int>(extra_threads.count()) + 1, num_jobs, job);
+    };
+    zopflipng_options.custom_inflate = InflateForLodepng;
 
     const vector<uint8_t> origpng(fp_, fp_ + size_);
     vector<uint8_t> resultpng;
 
-    if (!ZopfliPNGOptimize(origpng, zopflipng_options, is_verbose, &resultpng)) {
+    unsigned error;
+    {
+      ScopedTimer timer(kStageZopfliPNG, size_);
+      error = ZopfliPNGOptimize(origpng, zopflipng_options, ctx_.is_verbose, &resultpng);
+    }
+    if (!error) {
       // only use the result PNG if it is smaller
       // sometimes the original PNG is already highly optimized
       // then maybe ZopfliPNG will produce bigger file
@@ -127,6 +171,7 @@ size_t Png::Leanify(size_t size_leanified /*= 0*/) {
       if (resultpng.size() < size_) {
         size_ = resultpng_size;
         memcpy(fp_, resultpng.data(), resultpng_size);
+        engine_ = "ZopfliPNG";
         return size_;
       }
     } else {
@@ -140,17 +185,27 @@ size_t Png::Leanify(size_t size_leanified /*= 0*/) {
   if (idat_addr && (resultpng_size != size_ || size_ < 32768)) {
     // sometimes the strategy chosen by ZopfliPNG is worse than original
     // then try to recompress IDAT chunk using only Zopfli
-    VerbosePrint("ZopfliPNG failed to reduce size, try Zopfli only.");
+    VerbosePrint(ctx_, "ZopfliPNG failed to reduce size, try Zopfli only.");
     uint32_t idat_length = BSWAP32(*(uint32_t*)idat_addr);
-    uint32_t new_idat_length = ZlibRecompress(idat_addr + 8, idat_length);
+    uint32_t new_idat_length = ZlibRecompress(idat_addr + 8, idat_length, ctx_);
     if (idat_length != new_idat_length) {
       *(uint32_t*)idat_addr = BSWAP32(new_idat_length);
-      *(uint32_t*)(idat_addr + new_idat_length + 8) = BSWAP32(lodepng_crc32(idat_addr + 4, new_idat_length + 4));
+      *(uint32_t*)(idat_addr + new_idat_length + 8) = BSWAP32(Crc32(idat_addr + 4, new_idat_length + 4));
       uint8_t* idat_end = idat_addr + idat_length + 12;
       memmove(idat_addr + new_idat_length + 12, idat_end, fp_ + size_ - idat_end);
       size_ -= idat_length - new_idat_length;
+      engine_ = "Zopfli";
     }
   }
 
   return size_;
 }
+
+size_t Png::MemoryEstimate(const Context& ctx) const {
+  size_t raw_size, pixels_size;
+  if (!GetImageSizes(fp_, size_, &raw_size, &pixels_size))
+    return Format::MemoryEstimate(ctx);
+  // The copy of the file and the result, the decoded pixels and a converted copy of them, and a filter strategy
+  // trial. Zopfli compresses the trials and the final image one after another.
+  return 2 * size_ + 2 * pixels_size + 2 * raw_size + ZopfliMemory(raw_size, ctx);
+}
@@ -9,9 +9,10 @@
 #include <LZMA/Alloc.h>
 #include <LZMA/LzmaDec.h>
 #include <LZMA/LzmaEnc.h>
-#include <zopflipng/lodepng/lodepng.h>
 
+#include "../inflate.h"
 #include "../leanify.h"
+#include "../profile.h"
 #include "../utils.h"
 
 using std::cerr;
@@ -39,6 +40,7 @@ size_t GetRECTSize(uint8_t* rect) {
 }
 
 bool LZMACompress(const uint8_t* src, size_t src_len, vector<uint8_t>* out) {
+  ScopedTimer timer(kStageLzma, src_len);
   // Reserve enough space.
   out->resize(src_len + src_len / 8);
 
@@ -76,7 +78,7 @@ bool LZMADecompress(const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst
 }  // namespace
 
 size_t Swf::Leanify(size_t size_leanified /*= 0*/) {
-  if (is_fast && *fp_ != 'F')
+  if (ctx_.is_fast && *fp_ != 'F')
     return Format::Leanify(size_leanified);
 
   uint8_t* in_buffer = fp_ + 8;
@@ -85,12 +87,10 @@ size_t Swf::Leanify(size_t size_leanified /*= 0*/) {
   // if SWF is compressed, decompress it first
   if (*fp_ == 'C') {
     // deflate
-    VerbosePrint("SWF is compressed with deflate.");
+    VerbosePrint(ctx_, "SWF is compressed with deflate.");
     size_t uncompressed_size = 0;
     uint8_t* buffer = nullptr;
-    if (lodepng_zlib_decompress(&buffer, &uncompressed_size, in_buffer, size_ - 8,
-                                &lodepng_default_decompress_settings) ||
-        !buffer || uncompressed_size != in_len) {
+    if (ZlibDecompress(&buffer, &uncompressed_size, in_buffer, size_ - 8) || !buffer || uncompressed_size != in_len) {
       cerr << "SWF file corrupted!" << endl;
       free(buffer);
       return Format::Leanify(size_leanified);
@@ -98,7 +98,7 @@ size_t Swf::Leanify(size_t size_leanified /*= 0*/) {
     in_buffer = buffer;
   } else if (*fp_ == 'Z') {
     // LZMA
-    VerbosePrint("SWF is compressed with LZMA.");
+    VerbosePrint(ctx_, "SWF is compressed with LZMA.");
     // | 4 bytes         | 4 bytes   | 4 bytes       | 5 bytes    | n bytes   | 6 bytes         |
     // | 'ZWS' + version | scriptLen | compressedLen | LZMA props | LZMA data | LZMA end marker |
     uint8_t* dst_buffer = new uint8_t[in_len];
@@ -111,7 +111,7 @@ size_t Swf::Leanify(size_t size_leanified /*= 0*/) {
     }
     in_buffer = dst_buffer;
   } else {
-    VerbosePrint("SWF is not compressed.");
+    VerbosePrint(ctx_, "SWF is not compressed.");
   }
 
   // parsing SWF tags
@@ -136,11 +136,11 @@ size_t Swf::Leanify(size_t size_leanified /*= 0*/) {
       // DefineBitsLossless2
       case 36: {
         size_t header_size = 7 + (p[3] == 3);
-        VerbosePrint("DefineBitsLossless tag found.");
+        VerbosePrint(ctx_, "DefineBitsLossless tag found.");
         memmove(p - tag_size_leanified, p, header_size);
 
         // recompress Zlib bitmap data
-        size_t new_data_size = ZlibRecompress(p + header_size, tag_length - header_size, tag_size_leanified);
+        size_t new_data_size = ZlibRecompress(p + header_size, tag_length - header_size, ctx_, tag_size_leanified);
 
         UpdateTagLength(p - tag_size_leanified, tag_header_length, header_size + new_data_size);
         tag_size_leanified += tag_length - header_size - new_data_size;
@@ -148,12 +148,12 @@ size_t Swf::Leanify(size_t size_leanified /*= 0*/) {
       }
       // DefineBitsJPEG2
       case 21: {
-        VerbosePrint("DefineBitsJPEG2 tag found.");
+        VerbosePrint(ctx_, "DefineBitsJPEG2 tag found.");
         // copy id
         *(uint16_t*)(p - tag_size_leanified) = *(uint16_t*)p;
 
         // Leanify embedded image
-        size_t new_size = LeanifyFile(p + 2, tag_length - 2, tag_size_leanified);
+        size_t new_size = LeanifyFile(p + 2, tag_length - 2, ctx_, tag_size_leanified);
 
         UpdateTagLength(p - tag_size_leanified, tag_header_length, 2 + new_size);
         tag_size_leanified += tag_length - 2 - new_size;
@@ -169,14 +169,14 @@ size_t Swf::Leanify(size_t size_leanified /*= 0*/) {
         uint32_t img_size = *(uint32_t*)(p + 2);
         size_t header_size = tag_type == 90 ? 8 : 6;
 
-        VerbosePrint("DefineBitsJPEG", header_size / 2, " tag found.");
+        VerbosePrint(ctx_, "DefineBitsJPEG", header_size / 2, " tag found.");
         // Leanify embedded image
-        size_t new_img_size = LeanifyFile(p + header_size, img_size, tag_size_leanified);
+        size_t new_img_size = LeanifyFile(p + header_size, img_size, ctx_, tag_size_leanified);
         *(uint32_t*)(p + 2 - tag_size_leanified) = new_img_size;
 
         // recompress alpha data
         size_t new_alpha_data_size = ZlibRecompress(p + header_size + img_size, tag_length - img_size - header_size,
-                                                    tag_size_leanified + img_size - new_img_size);
+                                                    ctx_, tag_size_leanified + img_size - new_img_size);
 
         size_t new_tag_size = new_img_size + new_alpha_data_size + header_size;
         UpdateTagLength(p - tag_size_leanified, tag_header_length, new_tag_size);
@@ -185,7 +185,7 @@ size_t Swf::Leanify(size_t size_leanified /*= 0*/) {
       }
       // Metadata
       case 77:
-        VerbosePrint("Metadata removed.");
+        VerbosePrint(ctx_, "Metadata removed.");
         tag_size_leanified += tag_length + tag_header_length;
         break;
       // FileAttributes
@@ -200,7 +200,7 @@ size_t Swf::Leanify(size_t size_leanified /*= 0*/) {
 
   in_len -= tag_size_leanified;
 
-  if (is_fast) {
+  if (ctx_.is_fast) {
     // write header
     fp_ -= size_leanified;
     memmove(fp_, fp_ + size_leanified, 4);
@@ -229,6 +229,7 @@ size_t Swf::Leanify(size_t size_leanified /*= 0*/) {
 
   if (!lzma_data.empty() && lzma_data.size() + 12 < size_) {
     size_ = lzma_data.size() + 12;
+    engine_ = "LZMA";
 
     // write header
     memcpy(fp_, header_magic_lzma, sizeof(header_magic_lzma));
@@ -249,3 +250,18 @@ size_t Swf::Leanify(size_t size_leanified /*= 0*/) {
 
   return size_;
 }
+
+size_t Swf::MemoryEstimate(const Context& ctx) const {
+  if (size_ < 8 || (ctx.is_fast && *fp_ != 'F'))
+    return 0;
+  // decompressed size, including the header
+  size_t uncompressed_size = *(uint32_t*)(fp_ + 4);
+  // the decompressed data, with the images in it leanified one by one
+  size_t memory = uncompressed_size + EmbeddedMemory(uncompressed_size, ctx);
+  if (!ctx.is_fast) {
+    // the dictionary of level 9 is at most 64 MB, the binary tree match finder takes about 12 times that
+    const size_t kMaxDictionarySize = 64 << 20;
+    memory += 12 * std::min(uncompressed_size, kMaxDictionarySize) + uncompressed_size;
+  }
+  return memory;
+}
@@ -3,13 +3,12 @@
 
 #include "format.h"
 
-extern bool is_fast;
-
 class Swf : public Format {
  public:
   using Format::Format;
 
   size_t Leanify(size_t size_leanified = 0) override;
+  size_t MemoryEstimate(const Context& ctx) const override;
 
   static const uint8_t header_magic[3];
   static const uint8_t header_magic_deflate[3];
@@ -6,7 +6,9 @@
 #include <cstring>
 #include <iostream>
 
+#include "../fileio.h"
 #include "../leanify.h"
+#include "../profile.h"
 #include "../utils.h"
 
 using std::cerr;
@@ -28,9 +30,39 @@ int CalcChecksum(uint8_t* header) {
   return sum;
 }
 
+// Numeric fields are octal, or base-256 big-endian if the high bit of the first byte is set (GNU tar,
+// for sizes of 8 GB and up).
+uint64_t ReadNumber(const uint8_t* field, size_t len) {
+  uint64_t value = 0;
+  if (field[0] & 0x80) {
+    value = field[0] & 0x7F;
+    for (size_t i = 1; i < len; i++)
+      value = value << 8 | field[i];
+    return value;
+  }
+  for (size_t i = 0; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+    value = value << 3 | (field[i] - '0');
+  return value;
+}
+
+void WriteNumber(uint8_t* field, size_t len, uint64_t value) {
+  // len - 1 octal digits and the null
+  if (value >> (3 * (len - 1)) == 0) {
+    snprintf(reinterpret_cast<char*>(field), len, "%0*llo", static_cast<int>(len - 1),
+             static_cast<unsigned long long>(value));
+    return;
+  }
+  field[0] = 0x80;
+  for (size_t i = len - 1; i > 0; i--, value >>= 8)
+    field[i] = value & 0xFF;
+}
+
+// pages before the one being read are given back to the OS every this many bytes
+const size_t kReleaseInterval = 64 << 20;
+
 }  // namespace
 
-Tar::Tar(void* p, size_t s /*= 0*/) : Format(p, s) {
+Tar::Tar(void* p, size_t s, const Context& ctx) : Format(p, s, ctx) {
   // check file size first
   is_valid_ = s > 512 && s % 512 == 0 && CalcChecksum(fp_) == strtol(static_cast<char*>(p) + 148, nullptr, 8);
 }
@@ -40,9 +72,12 @@ size_t Tar::Leanify(size_t size_leanified /*= 0*/) {
     return Format::Leanify(size_leanified);
 
   uint8_t* p_read = fp_;
+  const uint8_t* p_end = fp_ + size_;
   fp_ -= size_leanified;
+  // the pages before this have been given back to the OS already
+  uint8_t* p_released = fp_;
   uint8_t* p_write = fp_;
-  depth++;
+  const Context nested_ctx = ctx_.Nested();
 
   do {
     int checksum = CalcChecksum(p_read);
@@ -59,26 +94,33 @@ size_t Tar::Leanify(size_t size_leanified /*= 0*/) {
       continue;
     }
     char type = *(p_write + 156);
-    size_t original_size = strtol(reinterpret_cast<char*>(p_write) + 124, nullptr, 8);
+    uint64_t original_size = ReadNumber(p_write + 124, 12);
+    if (original_size > static_cast<uint64_t>(p_end - p_read)) {
+      cerr << "Tar corrupted!" << endl;
+      // keep the rest as it is
+      memmove(p_write + 512, p_read, p_end - p_read);
+      size_ = p_write + 512 + (p_end - p_read) - fp_;
+      return size_;
+    }
     // align to 512
-    size_t size_aligned = (original_size + 0x1FF) & ~0x1FF;
+    size_t size_aligned = (original_size + 0x1FF) & ~static_cast<size_t>(0x1FF);
     if (original_size) {
-      if ((type == 0 || type == '0') && depth <= max_depth) {
+      if ((type == 0 || type == '0') && nested_ctx.depth <= nested_ctx.max_depth) {
         // normal file
         char* filename = reinterpret_cast<char*>(p_write);
-        PrintFileName(filename);
+        PrintFileName(nested_ctx, filename);
 
-        size_t new_size = LeanifyFile(p_read, original_size, size_leanified, string(filename));
+        size_t new_size = LeanifyFile(p_read, original_size, nested_ctx, size_leanified, string(filename));
         if (new_size < original_size) {
           // write new size
-          sprintf(reinterpret_cast<char*>(p_write) + 124, "%011o", (unsigned int)new_size);
+          WriteNumber(p_write + 124, 12, new_size);
 
           // update checksum
           sprintf(reinterpret_cast<char*>(p_write) + 148, "%06o", CalcChecksum(p_write));
           p_write[155] = ' ';
 
           // align to 512
-          size_t new_size_aligned = (new_size + 0x1FF) & ~0x1FF;
+          size_t new_size_aligned = (new_size + 0x1FF) & ~static_cast<size_t>(0x1FF);
 
           // make sure the rest space is all 0
           memset(p_write + new_size + 512, 0, new_size_aligned - new_size);
@@ -96,6 +138,7 @@ size_t Tar::Leanify(size_t size_leanified /*= 0*/) {
         }
       } else {
         // other type, just move it
+        ScopedTimer timer(kStageMemmove, size_aligned);
         memmove(p_write + 512, p_read, size_aligned);
         p_write += size_aligned;
       }
@@ -103,9 +146,13 @@ size_t Tar::Leanify(size_t size_leanified /*= 0*/) {
     }
     p_write += 512;
 
-  } while (p_write < fp_ + size_);
+    // the members are processed one after another, so a huge tar doesn't need to fit in memory
+    if (static_cast<size_t>(p_read - p_released) >= kReleaseInterval) {
+      ReleaseMappedPages(p_released, p_read - p_released);
+      p_released = p_read;
+    }
 
-  depth--;
+  } while (p_write < fp_ + size_);
 
   // write 2 more zero-filled records
   memset(p_write, 0, 1024);
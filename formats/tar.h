@@ -3,11 +3,9 @@
 
 #include "format.h"
 
-extern bool is_verbose;
-
 class Tar : public Format {
  public:
-  explicit Tar(void* p, size_t s = 0);
+  Tar(void* p, size_t s, const Context& ctx);
 
   size_t Leanify(size_t size_leanified = 0) override;
 
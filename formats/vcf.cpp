@@ -64,11 +64,11 @@ size_t Vcf::Leanify(size_t size_leanified /*= 0*/) {
     if (*(end - 1) == '\r')
       end--;
 
-    if (is_verbose) {
+    if (ctx_.is_verbose) {
       cout << string(reinterpret_cast<char*>(photo_magic), start + 12 - photo_magic) << "... found at offset 0x"
            << std::hex << photo_magic - fp_ << std::dec << endl;
     }
-    size_t new_size = Base64(p_read, end - p_read).Leanify(p_read - p_write);
+    size_t new_size = Base64(p_read, end - p_read, ctx_).Leanify(p_read - p_write);
     p_write += new_size;
     p_read = end;
   }
@@ -3,8 +3,6 @@
 
 #include "format.h"
 
-extern bool is_verbose;
-
 class Vcf : public Format {
  public:
   using Format::Format;
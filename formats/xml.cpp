@@ -14,7 +14,7 @@
 using std::map;
 using std::string;
 
-Xml::Xml(void* p, size_t s /*= 0*/) : Format(p, s) {
+Xml::Xml(void* p, size_t s, const Context& ctx) : Format(p, s, ctx) {
   pugi::xml_parse_result result = doc_.load_buffer(
       fp_, size_, pugi::parse_default | pugi::parse_declaration | pugi::parse_doctype | pugi::parse_ws_pcdata_single);
   is_valid_ = result;
@@ -183,9 +183,9 @@ size_t Xml::Leanify(size_t size_leanified /*= 0*/) {
 
   // if the XML is fb2 file
   if (doc_.child("FictionBook")) {
-    VerbosePrint("FB2 detected.");
-    if (depth < max_depth) {
-      depth++;
+    VerbosePrint(ctx_, "FB2 detected.");
+    if (ctx_.depth < ctx_.max_depth) {
+      const Context nested_ctx = ctx_.Nested();
 
       pugi::xml_node root = doc_.child("FictionBook");
 
@@ -198,28 +198,27 @@ size_t Xml::Leanify(size_t size_leanified /*= 0*/) {
           continue;
         }
 
-        PrintFileName(id.value());
+        PrintFileName(nested_ctx, id.value());
 
         const char* base64_data = binary.child_value();
         if (base64_data == nullptr || base64_data[0] == 0) {
-          VerbosePrint("No data found.");
+          VerbosePrint(ctx_, "No data found.");
           continue;
         }
         size_t base64_len = strlen(base64_data);
         // copy to a new location because base64_data is const
         std::vector<char> new_base64_data(base64_data, base64_data + base64_len + 1);
 
-        size_t new_base64_len = Base64(new_base64_data.data(), base64_len).Leanify();
+        size_t new_base64_len = Base64(new_base64_data.data(), base64_len, nested_ctx).Leanify();
 
         if (new_base64_len < base64_len) {
           new_base64_data[new_base64_len] = 0;
           binary.text() = new_base64_data.data();
         }
       }
-      depth--;
     }
   } else if (doc_.child("svg")) {
-    VerbosePrint("SVG detected.");
+    VerbosePrint(ctx_, "SVG detected.");
 
     // remove XML declaration and doctype
     for (pugi::xml_node child = doc_.first_child(), next; child; child = next) {
@@ -229,7 +228,7 @@ size_t Xml::Leanify(size_t size_leanified /*= 0*/) {
         doc_.remove_child(child);
     }
 
-    TraverseElements(doc_.child("svg"), [](pugi::xml_node node) {
+    TraverseElements(doc_.child("svg"), [this](pugi::xml_node node) {
       auto single_default_attrs_iter = kSingleDefaultAttributes.find(node.name());
       const map<string, string>* single_default_attrs = nullptr;
       if (single_default_attrs_iter != kSingleDefaultAttributes.end())
@@ -262,7 +261,7 @@ size_t Xml::Leanify(size_t size_leanified /*= 0*/) {
         if ((strcmp(attr.name(), "href") == 0 || strcmp(attr.name(), "xlink:href") == 0) &&
             value.size() > kDataURIMagic.size() &&
             memcmp(value.data(), kDataURIMagic.data(), kDataURIMagic.size()) == 0) {
-          DataURI data_uri(&value[0], value.size());
+          DataURI data_uri(&value[0], value.size(), ctx_);
           data_uri.SetSingleMode(true);
           size_t new_size = data_uri.Leanify();
           value.resize(new_size);
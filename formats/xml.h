@@ -5,11 +5,9 @@
 
 #include "format.h"
 
-extern bool is_verbose;
-
 class Xml : public Format {
  public:
-  explicit Xml(void* p, size_t s = 0);
+  Xml(void* p, size_t s, const Context& ctx);
 
   bool IsValid() const {
     return is_valid_;
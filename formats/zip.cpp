@@ -2,13 +2,18 @@
 
 #include <algorithm>
 #include <cstdint>
+#include <initializer_list>
 #include <iostream>
+#include <mutex>
 #include <string>
 #include <vector>
 
-#include <zopflipng/lodepng/lodepng.h>
-
+#include "../crc32.h"
+#include "../inflate.h"
+#include "../job_queue.h"
 #include "../leanify.h"
+#include "../memory_budget.h"
+#include "../profile.h"
 #include "../utils.h"
 
 using std::cerr;
@@ -17,7 +22,6 @@ using std::string;
 using std::vector;
 
 const uint8_t Zip::header_magic[] = { 0x50, 0x4B, 0x03, 0x04 };
-bool Zip::force_deflate_ = false;
 
 namespace {
 
@@ -66,14 +70,109 @@ PACK(struct EOCD {
   uint16_t comment_len;
 });
 
-bool GetCDHeaders(const uint8_t* fp, size_t size, const EOCD& eocd, size_t zip_offset, vector<CDHeader>* out_cd_headers,
-                  size_t* out_base_offset) {
-  vector<CDHeader> cd_headers;
+PACK(struct Zip64EOCD {
+  uint8_t magic[4] = { 0x50, 0x4B, 0x06, 0x06 };
+  // size of the rest of the record
+  uint64_t record_size;
+  uint16_t version_made_by;
+  uint16_t version_needed;
+  uint32_t disk_num;
+  uint32_t disk_cd_start;
+  uint64_t num_records;
+  uint64_t num_records_total;
+  uint64_t cd_size;
+  uint64_t cd_offset;
+});
+
+PACK(struct Zip64EOCDLocator {
+  uint8_t magic[4] = { 0x50, 0x4B, 0x06, 0x07 };
+  uint32_t disk_zip64_eocd;
+  uint64_t zip64_eocd_offset;
+  uint32_t num_disks;
+});
+
+// A 32-bit field with this value is in the ZIP64 extra field or the ZIP64 EOCD instead.
+const uint32_t kZip64Marker = 0xFFFFFFFF;
+const uint16_t kZip64ExtraId = 0x0001;
+// version needed to extract ZIP64
+const uint16_t kZip64Version = 45;
+
+// Where the central directory is, from the EOCD or the ZIP64 EOCD.
+struct CDLocation {
+  uint64_t num_records;
+  uint64_t cd_size;
+  uint64_t cd_offset;
+  // the archive has a ZIP64 EOCD
+  bool zip64;
+};
+
+// A central directory header, the sizes and the offset are 64-bit and come from the ZIP64 extra field if needed.
+struct CDEntry {
+  CDHeader header;
+  uint64_t compressed_size;
+  uint64_t uncompressed_size;
+  uint64_t local_header_offset;
+  std::string filename;
+};
+
+// Reads the ZIP64 extra field into the |values| that are |kZip64Marker|, they are stored in this order.
+// Returns false if they are not all there.
+bool ReadZip64Extra(const uint8_t* extra, size_t extra_len, std::initializer_list<uint64_t*> values) {
+  if (std::none_of(values.begin(), values.end(), [](const uint64_t* v) { return *v == kZip64Marker; }))
+    return true;
+
+  for (size_t pos = 0; pos + 4 <= extra_len;) {
+    uint16_t id, len;
+    memcpy(&id, extra + pos, 2);
+    memcpy(&len, extra + pos + 2, 2);
+    pos += 4;
+    if (id == kZip64ExtraId) {
+      size_t end = std::min(pos + len, extra_len);
+      for (uint64_t* v : values) {
+        if (*v != kZip64Marker)
+          continue;
+        if (pos + 8 > end)
+          return false;
+        memcpy(v, extra + pos, 8);
+        pos += 8;
+      }
+      return true;
+    }
+    pos += len;
+  }
+  return false;
+}
+
+// Writes a ZIP64 extra field with the |values| that don't fit in 32 bits, in this order.
+// Returns the size of the field, 0 if it is not needed.
+size_t WriteZip64Extra(uint8_t* p, std::initializer_list<uint64_t> values) {
+  uint16_t len = 0;
+  for (uint64_t v : values) {
+    if (v >= kZip64Marker) {
+      memcpy(p + 4 + len, &v, 8);
+      len += 8;
+    }
+  }
+  if (len == 0)
+    return 0;
+  memcpy(p, &kZip64ExtraId, 2);
+  memcpy(p + 2, &len, 2);
+  return 4 + len;
+}
+
+// The 32-bit field of |value|, |kZip64Marker| if it is in the ZIP64 extra field.
+uint32_t Field32(uint64_t value) {
+  return static_cast<uint32_t>(std::min<uint64_t>(value, kZip64Marker));
+}
+
+bool GetCDHeaders(const uint8_t* fp, size_t size, const CDLocation& cd, size_t zip_offset,
+                  vector<CDEntry>* out_cd_entries, size_t* out_base_offset) {
+  vector<CDEntry> cd_entries;
   size_t base_offset = 0;
   // Copy cd headers to vector
-  const uint8_t* p_cdheader = fp + eocd.cd_offset;
-  const uint8_t* cd_end = p_cdheader + eocd.cd_size;
-  for (int i = 0; i < eocd.num_records; i++) {
+  const uint8_t* p_cdheader = fp + cd.cd_offset;
+  const uint8_t* cd_end = p_cdheader + cd.cd_size;
+  for (uint64_t i = 0; i < cd.num_records; i++) {
     CDHeader cd_header;
     if (p_cdheader + sizeof(CDHeader) > cd_end)
       return false;
@@ -89,58 +188,254 @@ bool GetCDHeaders(const uint8_t* fp, size_t size, const EOCD& eocd, size_t zip_o
       cd_end += base_offset;
     }
     memcpy(&cd_header, p_cdheader, sizeof(CDHeader));
-    const uint8_t* p_local_header = fp + base_offset + cd_header.local_header_offset;
+    const uint8_t* p_next = p_cdheader + sizeof(CDHeader) + cd_header.filename_len + cd_header.extra_field_len +
+                            cd_header.comment_len;
+    if (p_next > cd_end)
+      return false;
+
+    CDEntry entry = { cd_header, cd_header.compressed_size, cd_header.uncompressed_size,
+                      cd_header.local_header_offset,
+                      string(reinterpret_cast<const char*>(p_cdheader) + sizeof(CDHeader), cd_header.filename_len) };
+    if (!ReadZip64Extra(p_cdheader + sizeof(CDHeader) + cd_header.filename_len, cd_header.extra_field_len,
+                        { &entry.uncompressed_size, &entry.compressed_size, &entry.local_header_offset }))
+      return false;
 
     // Check if local header magic matches.
-    if (p_local_header + sizeof(LocalHeader) + cd_header.filename_len + cd_header.compressed_size > fp + size ||
-        memcmp(p_local_header, Zip::header_magic, sizeof(Zip::header_magic)) != 0) {
+    uint64_t local_header_size = sizeof(LocalHeader) + cd_header.filename_len;
+    if (base_offset + local_header_size > size ||
+        entry.local_header_offset > size - base_offset - local_header_size ||
+        entry.compressed_size > size - base_offset - local_header_size - entry.local_header_offset)
+      return false;
+    const uint8_t* p_local_header = fp + base_offset + entry.local_header_offset;
+    if (memcmp(p_local_header, Zip::header_magic, sizeof(Zip::header_magic)) != 0)
       return false;
-    }
     const LocalHeader* local_header = reinterpret_cast<const LocalHeader*>(p_local_header);
     // Check if file name matches.
     if (local_header->filename_len != cd_header.filename_len ||
         memcmp(p_local_header + sizeof(LocalHeader), p_cdheader + sizeof(CDHeader), cd_header.filename_len) != 0)
       return false;
 
-    p_cdheader += sizeof(CDHeader) + cd_header.filename_len + cd_header.extra_field_len + cd_header.comment_len;
-    if (p_cdheader > cd_end)
-      return false;
-    cd_headers.push_back(cd_header);
+    p_cdheader = p_next;
+    cd_entries.push_back(std::move(entry));
   }
-  std::sort(cd_headers.begin(), cd_headers.end(),
-            [](const CDHeader& a, const CDHeader& b) { return a.local_header_offset < b.local_header_offset; });
+  std::sort(cd_entries.begin(), cd_entries.end(),
+            [](const CDEntry& a, const CDEntry& b) { return a.local_header_offset < b.local_header_offset; });
   // Check if there's any overlaps.
-  for (size_t i = 1; i < cd_headers.size(); i++) {
-    if (cd_headers[i - 1].local_header_offset + sizeof(LocalHeader) + cd_headers[i - 1].filename_len +
-            cd_headers[i - 1].compressed_size >
-        cd_headers[i].local_header_offset) {
+  for (size_t i = 1; i < cd_entries.size(); i++) {
+    if (cd_entries[i - 1].local_header_offset + sizeof(LocalHeader) + cd_entries[i - 1].header.filename_len +
+            cd_entries[i - 1].compressed_size >
+        cd_entries[i].local_header_offset) {
       return false;
     }
   }
 
-  *out_cd_headers = std::move(cd_headers);
+  *out_cd_entries = std::move(cd_entries);
   *out_base_offset = base_offset;
   return true;
 }
 
+// Reads the ZIP64 EOCD that the locator before |p_eocd| points to, if there is one, into |cd|.
+// Returns false if there is a locator but no valid ZIP64 EOCD.
+bool GetZip64Location(const uint8_t* fp, const uint8_t* p_eocd, size_t zip_offset, CDLocation* cd) {
+  Zip64EOCDLocator locator;
+  if (p_eocd - fp < static_cast<ptrdiff_t>(sizeof(Zip64EOCDLocator)))
+    return true;
+  const uint8_t* p_locator = p_eocd - sizeof(Zip64EOCDLocator);
+  if (memcmp(p_locator, locator.magic, sizeof(locator.magic)) != 0)
+    return true;
+  memcpy(&locator, p_locator, sizeof(Zip64EOCDLocator));
+
+  Zip64EOCD zip64_eocd;
+  // the ZIP64 EOCD is before the locator
+  if (static_cast<size_t>(p_locator - fp) < sizeof(Zip64EOCD))
+    return false;
+  uint64_t max_offset = static_cast<uint64_t>(p_locator - fp) - sizeof(Zip64EOCD);
+  // like the central directory, the offset might be relative to the first local file header
+  for (uint64_t offset : { locator.zip64_eocd_offset, locator.zip64_eocd_offset + zip_offset }) {
+    // the second one may have wrapped around
+    if (offset > max_offset || offset < locator.zip64_eocd_offset ||
+        memcmp(fp + offset, zip64_eocd.magic, sizeof(zip64_eocd.magic)) != 0)
+      continue;
+    memcpy(&zip64_eocd, fp + offset, sizeof(Zip64EOCD));
+    cd->num_records = zip64_eocd.num_records;
+    cd->cd_size = zip64_eocd.cd_size;
+    cd->cd_offset = zip64_eocd.cd_offset;
+    cd->zip64 = true;
+    return true;
+  }
+  return false;
+}
+
+// A file in the zip archive, the data is leanified separately so that it can be done in parallel.
+struct ZipEntry {
+  CDEntry* cd;
+  // the 32-bit sizes are only set when it is written
+  LocalHeader local_header;
+  uint64_t compressed_size;
+  uint64_t uncompressed_size;
+  // Original data, its size is |compressed_size| unless |output| is not empty.
+  const uint8_t* data;
+  // New data if it's changed, its size is |compressed_size|.
+  OutputSink output;
+  // The data goes beyond the end of the file.
+  bool truncated;
+  // Bytes between the original data and the next entry or the central directory, where a data descriptor can go.
+  size_t descriptor_space;
+};
+
+// Peak memory of leanifying an entry with LeanifyEntry.
+size_t EntryMemory(uint16_t compression_method, uint64_t compressed_size, uint64_t uncompressed_size,
+                   const Context& ctx) {
+  if (compression_method == 0) {
+    // leanified where it is, with --zip-force-deflate copied out and compressed
+    size_t size = static_cast<size_t>(compressed_size);
+    return EmbeddedMemory(size, ctx) + (ctx.zip_force_deflate ? size + ZopfliMemory(size, ctx) : 0);
+  }
+  if (compression_method != 8 || ctx.is_fast)
+    return 0;
+  // decompressed, leanified and compressed again
+  size_t size = static_cast<size_t>(uncompressed_size);
+  return size + EmbeddedMemory(size, ctx) + static_cast<size_t>(compressed_size);
+}
+
+// Leanify the data of |entry| and update both of its headers accordingly.
+// Returns true if the new data is compressed with Zopfli.
+bool LeanifyEntry(ZipEntry* entry, const Context& ctx, const ZopfliOptions& zopfli_options) {
+  const Context nested_ctx = ctx.Nested();
+  CDEntry& cd = *entry->cd;
+  CDHeader& cd_header = cd.header;
+  LocalHeader& local_header = entry->local_header;
+  const string& filename = cd.filename;
+
+  // do not output filename if it is a directory
+  if ((entry->compressed_size || local_header.compression_method) && nested_ctx.depth <= nested_ctx.max_depth)
+    PrintFileName(nested_ctx, filename);
+
+  if (entry->truncated) {
+    cerr << "Compressed size too large: " << entry->compressed_size << endl;
+    return false;
+  }
+
+  bool deflated = false;
+  // If the method is store, just Leanify the embedded file
+  // don't try to change it to deflate, it might break some file.
+  if (local_header.compression_method == 0) {
+    // method is store
+    if (entry->compressed_size) {
+      // The entry is leanified where it is, nothing else uses that part of the file. An embedded archive only
+      // references the parts it keeps, so they are not moved at every depth.
+      OutputSink& output = entry->output;
+      size_t new_size =
+          LeanifyFileTo(const_cast<uint8_t*>(entry->data), entry->compressed_size, nested_ctx, filename, &output);
+      uint32_t crc = 0;
+      for (const OutputSink::Slice& slice : output.slices())
+        crc = Crc32(slice.data, slice.size, crc);
+      cd_header.crc32 = local_header.crc32 = crc;
+      cd.compressed_size = entry->compressed_size = new_size;
+      cd.uncompressed_size = entry->uncompressed_size = new_size;
+      if (ctx.zip_force_deflate) {
+        vector<uint8_t> buffer(new_size);
+        output.CopyTo(buffer.data());
+        uint8_t* compress_buf = nullptr;
+        size_t deflate_size = 0;
+        ZopfliDeflateParallel(&zopfli_options, ctx, buffer.data(), new_size, &compress_buf, &deflate_size);
+        if (deflate_size < new_size) {
+          // switch to deflate
+          cd_header.compression_method = local_header.compression_method = 8;
+          cd.compressed_size = entry->compressed_size = deflate_size;
+          output = OutputSink();
+          output.Write(compress_buf, deflate_size);
+          deflated = true;
+        }
+        free(compress_buf);
+      }
+    }
+    return deflated;
+  }
+
+  // If unsupported compression method or fast mode or encrypted, just move it.
+  if (local_header.compression_method != 8 || ctx.is_fast || local_header.flag & 1)
+    return false;
+
+  // Switch from deflate to store for empty file.
+  if (entry->uncompressed_size == 0) {
+    cd_header.compression_method = local_header.compression_method = 0;
+    cd.compressed_size = entry->compressed_size = 0;
+    return false;
+  }
+
+  // decompress
+  size_t decompressed_size = 0;
+  uint8_t* decompress_buf = nullptr;
+  if (Inflate(&decompress_buf, &decompressed_size, entry->data, entry->compressed_size, entry->uncompressed_size) ||
+      !decompress_buf || decompressed_size != entry->uncompressed_size ||
+      local_header.crc32 != Crc32(decompress_buf, decompressed_size)) {
+    cerr << "Decompression failed or CRC32 mismatch, skipping this file." << endl;
+    free(decompress_buf);
+    return false;
+  }
+
+  // Leanify uncompressed file
+  size_t new_uncomp_size = LeanifyFile(decompress_buf, decompressed_size, nested_ctx, 0, filename);
+
+  // recompress
+  uint8_t* compress_buf = nullptr;
+  size_t new_comp_size = 0;
+  ZopfliDeflateParallel(&zopfli_options, ctx, decompress_buf, new_uncomp_size, &compress_buf, &new_comp_size);
+
+  // switch to store if deflate makes file larger
+  if (new_uncomp_size <= new_comp_size && new_uncomp_size <= entry->compressed_size) {
+    cd_header.compression_method = local_header.compression_method = 0;
+    cd_header.crc32 = local_header.crc32 = Crc32(decompress_buf, new_uncomp_size);
+    cd.compressed_size = entry->compressed_size = new_uncomp_size;
+    cd.uncompressed_size = entry->uncompressed_size = new_uncomp_size;
+    entry->output.Take(vector<uint8_t>(decompress_buf, decompress_buf + new_uncomp_size));
+  } else if (new_comp_size < entry->compressed_size) {
+    deflated = true;
+    cd_header.crc32 = local_header.crc32 = Crc32(decompress_buf, new_uncomp_size);
+    cd.compressed_size = entry->compressed_size = new_comp_size;
+    cd.uncompressed_size = entry->uncompressed_size = new_uncomp_size;
+    entry->output.Take(vector<uint8_t>(compress_buf, compress_buf + new_comp_size));
+  }
+
+  free(decompress_buf);
+  free(compress_buf);
+  return deflated;
+}
+
 }  // namespace
 
 size_t Zip::Leanify(size_t size_leanified /*= 0*/) {
-  depth++;
+  return LeanifyZip(size_leanified, nullptr);
+}
+
+size_t Zip::LeanifyTo(OutputSink* sink) {
+  return LeanifyZip(0, sink);
+}
+
+size_t Zip::LeanifyZip(size_t size_leanified, OutputSink* sink) {
+  // not a valid zip, kept as it is
+  auto keep = [&] {
+    if (!sink)
+      return Format::Leanify(size_leanified);
+    sink->Reference(fp_, size_);
+    return size_;
+  };
 
   uint8_t* first_local_header = std::search(fp_, fp_ + size_, header_magic, std::end(header_magic));
   // The offset of the first local header, we should keep everything before this offset.
   size_t zip_offset = first_local_header - fp_;
   if (zip_offset == size_) {
     cerr << "ZIP header magic not found!" << endl;
-    return Format::Leanify(size_leanified);
+    return keep();
   }
   // The offset that all the offsets in the zip file based on (relative to).
   // Should be 0 by default except when we detected that the input file has a base offset.
   size_t base_offset = 0;
 
   EOCD eocd;
-  vector<CDHeader> cd_headers;
+  CDLocation cd_location;
+  vector<CDEntry> cd_entries;
   uint8_t* p_end = fp_ + size_;
   // smallest possible location of EOCD if there's a 64K comment
   uint8_t* p_searchstart = std::max(fp_, p_end - 65535 - sizeof(eocd.magic));
@@ -153,172 +448,257 @@ size_t Zip::Leanify(size_t size_leanified /*= 0*/) {
     p_eocd = std::find_end(p_searchstart, p_end, eocd.magic, std::end(eocd.magic));
     if (p_eocd == p_end) {
       cerr << "EOCD not found!" << endl;
-      return Format::Leanify(size_leanified);
+      return keep();
     }
 
     if (p_eocd + sizeof(EOCD) > p_end)
       continue;
 
     memcpy(&eocd, p_eocd, sizeof(EOCD));
-    uint8_t* cd_end = fp_ + eocd.cd_offset + eocd.cd_size;
-    if (cd_end > p_eocd)
+    cd_location = { eocd.num_records, eocd.cd_size, eocd.cd_offset, false };
+    // the ZIP64 EOCD has the values that don't fit in the EOCD
+    if (!GetZip64Location(fp_, p_eocd, zip_offset, &cd_location))
+      continue;
+    if (cd_location.cd_offset > static_cast<uint64_t>(p_eocd - fp_) ||
+        cd_location.cd_size > p_eocd - fp_ - cd_location.cd_offset)
       continue;
 
     // Try to get all CD headers using this EOCD, if everything checks out then proceed.
-    if (GetCDHeaders(fp_, size_, eocd, zip_offset, &cd_headers, &base_offset)) {
+    if (GetCDHeaders(fp_, size_, cd_location, zip_offset, &cd_entries, &base_offset)) {
       break;
     }
   }
 
+  // The output is written in place, or to |sink| without modifying the input except for the stored entries.
+  // Only the size written so far is needed for the offsets then.
   uint8_t* fp_w = fp_ - size_leanified;
-  uint8_t* fp_w_base = fp_w + base_offset;
-  memmove(fp_w, fp_, zip_offset);
-  uint8_t* p_write = fp_w + zip_offset;
-  // Local file header
-  for (CDHeader& cd_header : cd_headers) {
-    uint8_t* p_read = fp_ + base_offset + cd_header.local_header_offset;
-
-    cd_header.local_header_offset = p_write - fp_w_base;
-
-    size_t header_size = sizeof(LocalHeader) + cd_header.filename_len;
-    // move header
-    memmove(p_write, p_read, header_size);
-    LocalHeader* local_header = reinterpret_cast<LocalHeader*>(p_write);
+  size_t written = 0;
+  auto write = [&](const void* data, size_t size) {
+    if (sink)
+      sink->Write(data, size);
+    else
+      memcpy(fp_w + written, data, size);
+    written += size;
+  };
+  // |data| is in the input, ahead of where it is written
+  auto move = [&](const uint8_t* data, size_t size) {
+    if (sink) {
+      sink->Reference(data, size);
+    } else {
+      ScopedTimer timer(kStageMemmove, size);
+      memmove(fp_w + written, data, size);
+    }
+    written += size;
+  };
+  move(fp_, zip_offset);
+
+  // Read all the local file headers first, the data of the entries are leanified in parallel,
+  // then written back in order. Each part of an entry only goes where it ends before the same part of the input,
+  // so in place it never overwrites data that is not read yet.
+  vector<ZipEntry> entries;
+  entries.reserve(cd_entries.size());
+  for (CDEntry& cd : cd_entries) {
+    CDHeader& cd_header = cd.header;
+    const uint8_t* p_read = fp_ + base_offset + cd.local_header_offset;
+
+    ZipEntry entry;
+    entry.cd = &cd;
+    memcpy(&entry.local_header, p_read, sizeof(LocalHeader));
+    LocalHeader& local_header = entry.local_header;
+    entry.compressed_size = local_header.compressed_size;
+    entry.uncompressed_size = local_header.uncompressed_size;
 
     // if Extra field length is not 0, then skip it and set it to 0
-    if (local_header->extra_field_len) {
-      p_read += local_header->extra_field_len;
-      local_header->extra_field_len = 0;
-    }
+    p_read += sizeof(LocalHeader) + local_header.filename_len + local_header.extra_field_len;
+    local_header.extra_field_len = 0;
 
-    if (local_header->flag & 8) {
+    if (local_header.flag & 8) {
       // set this bit to 0, we don't use data descriptor to save 16 byte
-      local_header->flag &= ~8;
+      local_header.flag &= ~8;
       cd_header.flag &= ~8;
 
       // Use the correct value from central directory
-      local_header->crc32 = cd_header.crc32;
-      local_header->compressed_size = cd_header.compressed_size;
-      local_header->uncompressed_size = cd_header.uncompressed_size;
+      local_header.crc32 = cd_header.crc32;
+      entry.compressed_size = cd.compressed_size;
+      entry.uncompressed_size = cd.uncompressed_size;
+    } else if (entry.compressed_size == kZip64Marker || entry.uncompressed_size == kZip64Marker) {
+      // the same values are in the ZIP64 extra field of the local header
+      entry.compressed_size = cd.compressed_size;
+      entry.uncompressed_size = cd.uncompressed_size;
     }
 
-    string filename(reinterpret_cast<char*>(local_header) + sizeof(LocalHeader), local_header->filename_len);
-    // do not output filename if it is a directory
-    if ((local_header->compressed_size || local_header->compression_method) && depth <= max_depth)
-      PrintFileName(filename);
-
-    p_read += header_size;
-    p_write += header_size;
-
-    if (p_read + local_header->compressed_size > p_end) {
-      cerr << "Compressed size too large: " << local_header->compressed_size << endl;
+    entry.data = p_read;
+    entry.truncated = p_read > p_end || entry.compressed_size > static_cast<uint64_t>(p_end - p_read);
+    entries.push_back(std::move(entry));
+    if (entries.back().truncated)
       break;
-    }
+  }
+  for (size_t i = 0; i < entries.size(); i++) {
+    const uint8_t* data_end = entries[i].data + entries[i].compressed_size;
+    const uint8_t* next = i + 1 < entries.size() ? fp_ + base_offset + entries[i + 1].cd->local_header_offset
+                                                 : fp_ + base_offset + cd_location.cd_offset;
+    entries[i].descriptor_space = !entries[i].truncated && next > data_end ? next - data_end : 0;
+  }
 
-    // If the method is store, just Leanify the embedded file
-    // don't try to change it to deflate, it might break some file.
-    if (local_header->compression_method == 0) {
-      // method is store
-      if (local_header->compressed_size) {
-        uint32_t new_size = LeanifyFile(p_read, local_header->compressed_size, p_read - p_write, filename);
-        cd_header.crc32 = local_header->crc32 = lodepng_crc32(p_write, new_size);
-        cd_header.compressed_size = local_header->compressed_size = new_size;
-        cd_header.uncompressed_size = local_header->uncompressed_size = new_size;
-        if (force_deflate_) {
-          uint8_t bp = 0, *compress_buf = nullptr;
-          size_t deflate_size = 0;
-          ZopfliDeflate(&zopfli_options_, 2, 1, p_write, new_size, &bp, &compress_buf, &deflate_size);
-          if (deflate_size < new_size) {
-            // switch to deflate
-            cd_header.compression_method = local_header->compression_method = 8;
-            cd_header.compressed_size = local_header->compressed_size = deflate_size;
-            memcpy(p_write, compress_buf, deflate_size);
-          }
-          delete[] compress_buf;
+  std::mutex write_mutex;
+  vector<bool> done(entries.size());
+  size_t next_write = 0;
+  auto leanify_entry = [&](size_t i) {
+    bool deflated = LeanifyEntry(&entries[i], ctx_, zopfli_options_);
+
+    std::lock_guard<std::mutex> lock(write_mutex);
+    if (deflated)
+      engine_ = "Zopfli";
+    done[i] = true;
+    for (; next_write < entries.size() && done[next_write]; next_write++) {
+      ZipEntry& entry = entries[next_write];
+      LocalHeader& local_header = entry.local_header;
+      entry.cd->local_header_offset = written - base_offset;
+      uint8_t extra[20];
+      size_t descriptor_len = 0;
+      local_header.extra_field_len = 0;
+      local_header.uncompressed_size = Field32(entry.uncompressed_size);
+      local_header.compressed_size = Field32(entry.compressed_size);
+      if (local_header.uncompressed_size == kZip64Marker || local_header.compressed_size == kZip64Marker) {
+        size_t header_size = sizeof(LocalHeader) + entry.cd->filename.size() + sizeof(extra);
+        if (written + header_size <= size_leanified + static_cast<size_t>(entry.data - fp_)) {
+          // both sizes must be in the extra field of a local header
+          local_header.uncompressed_size = local_header.compressed_size = kZip64Marker;
+          const uint16_t len = 16;
+          memcpy(extra, &kZip64ExtraId, 2);
+          memcpy(extra + 2, &len, 2);
+          memcpy(extra + 4, &entry.uncompressed_size, 8);
+          memcpy(extra + 12, &entry.compressed_size, 8);
+          local_header.extra_field_len = sizeof(extra);
+          local_header.version_needed = std::max<uint16_t>(local_header.version_needed, kZip64Version);
+        } else {
+          // The original entry had no room for the extra field, the sizes were in a data descriptor.
+          // Keep it in the space of the original one, the sizes are in the central directory.
+          local_header.flag |= 8;
+          entry.cd->header.flag |= 8;
+          local_header.crc32 = local_header.uncompressed_size = local_header.compressed_size = 0;
+          descriptor_len = entry.descriptor_space >= 16 ? 16 : entry.descriptor_space >= 12 ? 12 : 0;
         }
-        p_write += local_header->compressed_size;
       }
-      continue;
-    }
-
-    // If unsupported compression method or fast mode or encrypted, just move it.
-    if (local_header->compression_method != 8 || is_fast || local_header->flag & 1) {
-      memmove(p_write, p_read, local_header->compressed_size);
-      p_write += local_header->compressed_size;
-      continue;
-    }
-
-    // Switch from deflate to store for empty file.
-    if (local_header->uncompressed_size == 0) {
-      cd_header.compression_method = local_header->compression_method = 0;
-      cd_header.compressed_size = local_header->compressed_size = 0;
-      continue;
-    }
-
-    // decompress
-    size_t decompressed_size = 0;
-    uint8_t* decompress_buf = nullptr;
-    if (lodepng_inflate(&decompress_buf, &decompressed_size, p_read, local_header->compressed_size,
-                        &lodepng_default_decompress_settings) ||
-        !decompress_buf || decompressed_size != local_header->uncompressed_size ||
-        local_header->crc32 != lodepng_crc32(decompress_buf, local_header->uncompressed_size)) {
-      cerr << "Decompression failed or CRC32 mismatch, skipping this file." << endl;
-      free(decompress_buf);
-      memmove(p_write, p_read, local_header->compressed_size);
-      p_write += local_header->compressed_size;
-      continue;
-    }
-
-    // Leanify uncompressed file
-    uint32_t new_uncomp_size = LeanifyFile(decompress_buf, decompressed_size, 0, filename);
-
-    // recompress
-    uint8_t bp = 0, *compress_buf = nullptr;
-    size_t new_comp_size = 0;
-    ZopfliDeflate(&zopfli_options_, 2, 1, decompress_buf, new_uncomp_size, &bp, &compress_buf, &new_comp_size);
-
-    // switch to store if deflate makes file larger
-    if (new_uncomp_size <= new_comp_size && new_uncomp_size <= local_header->compressed_size) {
-      cd_header.compression_method = local_header->compression_method = 0;
-      cd_header.crc32 = local_header->crc32 = lodepng_crc32(decompress_buf, new_uncomp_size);
-      cd_header.compressed_size = local_header->compressed_size = new_uncomp_size;
-      cd_header.uncompressed_size = local_header->uncompressed_size = new_uncomp_size;
-      memcpy(p_write, decompress_buf, new_uncomp_size);
-    } else if (new_comp_size < local_header->compressed_size) {
-      cd_header.crc32 = local_header->crc32 = lodepng_crc32(decompress_buf, new_uncomp_size);
-      cd_header.compressed_size = local_header->compressed_size = new_comp_size;
-      cd_header.uncompressed_size = local_header->uncompressed_size = new_uncomp_size;
-      memcpy(p_write, compress_buf, new_comp_size);
-    } else {
-      memmove(p_write, p_read, local_header->compressed_size);
+      write(&local_header, sizeof(LocalHeader));
+      write(entry.cd->filename.data(), entry.cd->filename.size());
+      write(extra, local_header.extra_field_len);
+      if (entry.truncated)
+        break;
+      if (entry.output.slices().empty()) {
+        move(entry.data, entry.compressed_size);
+      } else if (sink) {
+        sink->Append(std::move(entry.output));
+        written += entry.compressed_size;
+      } else {
+        // the new data may reference the input too, in order like the entries
+        ScopedTimer timer(kStageMemmove, entry.compressed_size);
+        entry.output.CopyTo(fp_w + written);
+        written += entry.compressed_size;
+        entry.output = OutputSink();
+      }
+      if (descriptor_len) {
+        // with the optional signature if there is room for it
+        uint8_t descriptor[16] = { 0x50, 0x4B, 0x07, 0x08 };
+        uint32_t fields[3] = { entry.cd->header.crc32, Field32(entry.compressed_size),
+                               Field32(entry.uncompressed_size) };
+        memcpy(descriptor + 4, fields, sizeof(fields));
+        write(descriptor + sizeof(descriptor) - descriptor_len, descriptor_len);
+      }
     }
-    p_write += local_header->compressed_size;
-
-    free(decompress_buf);
-    delete[] compress_buf;
+  };
+
+  // the entries only run on more threads while the memory of the biggest one is free
+  size_t entry_memory = 0;
+  for (const ZipEntry& entry : entries)
+    entry_memory = std::max(entry_memory, EntryMemory(entry.local_header.compression_method, entry.compressed_size,
+                                                      entry.uncompressed_size, ctx_));
+  size_t num_threads = std::min(static_cast<size_t>(ctx_.num_threads), entries.size());
+  MemoryGrant extra_threads(entry_memory, num_threads > 1 ? num_threads - 1 : 0);
+  if (extra_threads.count() > 0) {
+    JobQueue queue(static_cast<int>(extra_threads.count()));
+    for (size_t i = 0; i < entries.size(); i++)
+      queue.Push([&leanify_entry, i] { leanify_entry(i); });
+  } else {
+    for (size_t i = 0; i < entries.size(); i++)
+      leanify_entry(i);
   }
 
   // central directory offset
-  eocd.cd_offset = p_write - fp_w_base;
-  for (CDHeader& cd_header : cd_headers) {
-    cd_header.extra_field_len = cd_header.comment_len = 0;
-
-    memcpy(p_write, &cd_header, sizeof(CDHeader));
-    p_write += sizeof(CDHeader);
-    // Copy the filename from local file header to central directory,
-    // the old central directory might have been overwritten already because we sort them.
-    memcpy(p_write, fp_w_base + cd_header.local_header_offset + 30, cd_header.filename_len);
-    p_write += cd_header.filename_len;
+  uint64_t cd_offset = written - base_offset;
+  for (CDEntry& cd : cd_entries) {
+    CDHeader& cd_header = cd.header;
+    uint8_t extra[28];
+    cd_header.extra_field_len =
+        WriteZip64Extra(extra, { cd.uncompressed_size, cd.compressed_size, cd.local_header_offset });
+    if (cd_header.extra_field_len)
+      cd_header.version_needed = std::max<uint16_t>(cd_header.version_needed, kZip64Version);
+    cd_header.uncompressed_size = Field32(cd.uncompressed_size);
+    cd_header.compressed_size = Field32(cd.compressed_size);
+    cd_header.local_header_offset = Field32(cd.local_header_offset);
+    cd_header.comment_len = 0;
+    cd_header.disk_file_start = 0;
+
+    write(&cd_header, sizeof(CDHeader));
+    write(cd.filename.data(), cd.filename.size());
+    write(extra, cd_header.extra_field_len);
   }
-
-  // Update end of central directory record
-  eocd.num_records = eocd.num_records_total = cd_headers.size();
-  eocd.cd_size = p_write - fp_w_base - eocd.cd_offset;
+  uint64_t cd_size = written - base_offset - cd_offset;
+
+  // Update end of central directory record, with a ZIP64 one before it if the original had one.
+  // Otherwise the ZIP64 records are only added if something doesn't fit and there is room for them.
+  bool zip64_needed = cd_entries.size() > 0xFFFF || cd_size >= kZip64Marker || cd_offset >= kZip64Marker;
+  size_t zip64_size = sizeof(Zip64EOCD) + sizeof(Zip64EOCDLocator);
+  if (cd_location.zip64 || (zip64_needed && written + zip64_size + sizeof(EOCD) <= size_leanified + size_)) {
+    Zip64EOCD zip64_eocd;
+    zip64_eocd.record_size = sizeof(Zip64EOCD) - 12;
+    zip64_eocd.version_made_by = zip64_eocd.version_needed = kZip64Version;
+    zip64_eocd.disk_num = zip64_eocd.disk_cd_start = 0;
+    zip64_eocd.num_records = zip64_eocd.num_records_total = cd_entries.size();
+    zip64_eocd.cd_size = cd_size;
+    zip64_eocd.cd_offset = cd_offset;
+
+    Zip64EOCDLocator locator;
+    locator.disk_zip64_eocd = 0;
+    locator.zip64_eocd_offset = written - base_offset;
+    locator.num_disks = 1;
+
+    write(&zip64_eocd, sizeof(Zip64EOCD));
+    write(&locator, sizeof(Zip64EOCDLocator));
+  }
+  eocd.num_records = eocd.num_records_total = std::min<uint64_t>(cd_entries.size(), 0xFFFF);
+  eocd.cd_size = std::min<uint64_t>(cd_size, kZip64Marker);
+  eocd.cd_offset = std::min<uint64_t>(cd_offset, kZip64Marker);
   eocd.comment_len = 0;
+  write(&eocd, sizeof(EOCD));
 
-  memcpy(p_write, &eocd, sizeof(EOCD));
-
-  fp_ -= size_leanified;
-  size_ = p_write + sizeof(EOCD) - fp_;
+  fp_ = fp_w;
+  size_ = written;
   return size_;
 }
+
+size_t Zip::MemoryEstimate(const Context& ctx) const {
+  // the central directory of the last EOCD, LeanifyZip also tries the ones before it if it is invalid
+  EOCD eocd;
+  const uint8_t* p_end = fp_ + size_;
+  const uint8_t* p_searchstart = p_end - std::min(size_, 65535 + sizeof(eocd.magic));
+  const uint8_t* p_eocd = std::find_end(p_searchstart, p_end, eocd.magic, std::end(eocd.magic));
+  if (p_eocd + sizeof(EOCD) > p_end)
+    return Format::MemoryEstimate(ctx);
+  memcpy(&eocd, p_eocd, sizeof(EOCD));
+
+  size_t zip_offset = std::search(fp_, fp_ + size_, header_magic, std::end(header_magic)) - fp_;
+  CDLocation cd = { eocd.num_records, eocd.cd_size, eocd.cd_offset, false };
+  vector<CDEntry> cd_entries;
+  size_t base_offset;
+  if (!GetZip64Location(fp_, p_eocd, zip_offset, &cd) || cd.cd_offset > static_cast<uint64_t>(p_eocd - fp_) ||
+      cd.cd_size > p_eocd - fp_ - cd.cd_offset || !GetCDHeaders(fp_, size_, cd, zip_offset, &cd_entries, &base_offset))
+    return Format::MemoryEstimate(ctx);
+
+  size_t memory = 0;
+  for (const CDEntry& entry : cd_entries)
+    memory = std::max(memory, EntryMemory(entry.header.compression_method, entry.compressed_size,
+                                          entry.uncompressed_size, ctx));
+  // the headers of all the entries are kept until the end
+  return memory + cd_entries.size() * (sizeof(CDEntry) + sizeof(ZipEntry));
+}
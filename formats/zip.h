@@ -5,26 +5,26 @@
 
 #include "format.h"
 
-extern bool is_fast;
-extern int iterations;
-extern int depth;
-
 class Zip : public Format {
  public:
-  explicit Zip(void* p, size_t s = 0) : Format(p, s) {
+  Zip(void* p, size_t s, const Context& ctx) : Format(p, s, ctx) {
     ZopfliInitOptions(&zopfli_options_);
-    zopfli_options_.numiterations = iterations;
-  }
-  ~Zip() {
-    depth--;
+    zopfli_options_.numiterations = ctx.iterations;
+    zopfli_options_.convergenceiterations = ctx.convergence_iterations;
+    if (ctx.zopfli_block_size)
+      zopfli_options_.masterblocksize = ctx.zopfli_block_size;
   }
 
   size_t Leanify(size_t size_leanified = 0) override;
+  size_t LeanifyTo(OutputSink* sink) override;
+  size_t MemoryEstimate(const Context& ctx) const override;
 
   static const uint8_t header_magic[4];
-  static bool force_deflate_;
 
  private:
+  // writes to |sink| if it is not null, in place otherwise
+  size_t LeanifyZip(size_t size_leanified, OutputSink* sink);
+
   ZopfliOptions zopfli_options_;
 };
 
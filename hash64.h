@@ -0,0 +1,10 @@
+#ifndef HASH64_H_
+#define HASH64_H_
+
+#include <cstddef>
+#include <cstdint>
+
+// 64-bit non-cryptographic hash of the data, same result as XXH64 from xxHash.
+uint64_t Hash64(const void* data, size_t size, uint64_t seed = 0);
+
+#endif  // HASH64_H_
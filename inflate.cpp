@@ -0,0 +1,422 @@
+#include "inflate.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <zopflipng/lodepng/lodepng.h>
+
+#include "profile.h"
+
+namespace {
+
+// lodepng error codes
+const unsigned kErrorEndOfInput = 23;
+const unsigned kErrorInvalidCode = 16;
+const unsigned kErrorBadTree = 13;
+const unsigned kErrorInvalidDistance = 18;
+const unsigned kErrorInvalidBlockType = 20;
+const unsigned kErrorStoredLength = 21;
+const unsigned kErrorAlloc = 83;
+
+// Bits of the first level of the decoding tables, longer codes continue in a subtable.
+const int kLitLenTableBits = 10;
+const int kDistTableBits = 8;
+const int kCodeLengthTableBits = 7;
+const int kMaxCodeLength = 15;
+
+// A table entry is packed into 32 bits:
+//   bits 0-7:   number of bits of the code, or kLitLenTableBits for a subtable pointer
+//   bits 8-11:  number of extra bits, or number of index bits for a subtable pointer
+//   bits 12-15: flags below
+//   bits 16-31: literal, length base, distance base or subtable offset
+const uint32_t kLiteral = 1 << 12;
+const uint32_t kEndOfBlock = 2 << 12;
+const uint32_t kSubtable = 4 << 12;
+const uint32_t kInvalid = 8 << 12;
+
+uint32_t Entry(uint32_t value, uint32_t flags, uint32_t extra_bits) {
+  return value << 16 | flags | extra_bits << 8;
+}
+
+const uint16_t kLengthBase[29] = { 3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+                                   31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+const uint8_t kLengthExtraBits[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                       2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+const uint16_t kDistBase[30] = { 1,   2,   3,   4,   5,   7,    9,    13,   17,   25,   33,   49,   65,    97,    129,
+                                 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+const uint8_t kDistExtraBits[30] = { 0, 0, 0, 0, 1, 1, 2, 2,  3,  3,  4,  4,  5,  5,  6,
+                                     6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+// order of the code length code lengths
+const uint8_t kCodeLengthOrder[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+// Entry templates of every symbol, without the code length.
+uint32_t LitLenSymbol(int symbol) {
+  if (symbol < 256)
+    return Entry(symbol, kLiteral, 0);
+  if (symbol == 256)
+    return Entry(0, kEndOfBlock, 0);
+  if (symbol < 286)
+    return Entry(kLengthBase[symbol - 257], 0, kLengthExtraBits[symbol - 257]);
+  return kInvalid;
+}
+
+uint32_t DistSymbol(int symbol) {
+  return symbol < 30 ? Entry(kDistBase[symbol], 0, kDistExtraBits[symbol]) : kInvalid;
+}
+
+uint32_t CodeLengthSymbol(int symbol) {
+  return Entry(symbol, 0, 0);
+}
+
+// Builds a decoding table from the code lengths of all the symbols.
+// Codes that don't exist decode to kInvalid entries.
+// Returns false if the lengths don't form a valid prefix code.
+bool BuildTable(const uint8_t* lengths, int num_symbols, uint32_t (*symbol_entry)(int), int table_bits,
+                std::vector<uint32_t>* table) {
+  int count[kMaxCodeLength + 1] = {};
+  for (int i = 0; i < num_symbols; i++)
+    count[lengths[i]]++;
+  count[0] = 0;
+
+  int max_length = 0;
+  int left = 1;
+  for (int len = 1; len <= kMaxCodeLength; len++) {
+    left = (left << 1) - count[len];
+    if (left < 0)
+      return false;
+    if (count[len])
+      max_length = len;
+  }
+
+  uint32_t next_code[kMaxCodeLength + 1];
+  uint32_t code = 0;
+  for (int len = 1; len <= kMaxCodeLength; len++) {
+    code = (code + count[len - 1]) << 1;
+    next_code[len] = code;
+  }
+
+  table->assign(static_cast<size_t>(1) << table_bits, kInvalid);
+  int subtable_bits = max_length > table_bits ? max_length - table_bits : 0;
+  for (int symbol = 0; symbol < num_symbols; symbol++) {
+    int len = lengths[symbol];
+    if (len == 0)
+      continue;
+
+    // deflate stores the codes starting from the most significant bit
+    uint32_t reversed = 0;
+    for (uint32_t c = next_code[len]++, i = 0; i < static_cast<uint32_t>(len); i++, c >>= 1)
+      reversed = reversed << 1 | (c & 1);
+
+    uint32_t entry = symbol_entry(symbol);
+    if (len <= table_bits) {
+      for (uint32_t i = reversed; i < (1u << table_bits); i += 1u << len)
+        (*table)[i] = entry | len;
+      continue;
+    }
+
+    uint32_t prefix = reversed & ((1u << table_bits) - 1);
+    if (!((*table)[prefix] & kSubtable)) {
+      (*table)[prefix] = Entry(static_cast<uint32_t>(table->size()), kSubtable, subtable_bits) | table_bits;
+      table->resize(table->size() + (static_cast<size_t>(1) << subtable_bits), kInvalid);
+    }
+    uint32_t* subtable = &(*table)[(*table)[prefix] >> 16];
+    int sub_len = len - table_bits;
+    for (uint32_t i = reversed >> table_bits; i < (1u << subtable_bits); i += 1u << sub_len)
+      subtable[i] = entry | sub_len;
+  }
+  return true;
+}
+
+class Inflater {
+ public:
+  Inflater(const uint8_t* in, size_t insize) : in_(in), in_end_(in + insize) {}
+
+  unsigned Run(uint8_t** out, size_t* outsize, size_t size_hint) {
+    out_ = *out;
+    out_pos_ = *outsize;
+    out_capacity_ = *outsize;
+    unsigned error = Reserve(size_hint + 8);
+    bool final = false;
+    while (!error && !final) {
+      Refill();
+      final = GetBits(1) != 0;
+      uint32_t type = GetBits(2);
+      if (type == 0) {
+        error = StoredBlock();
+      } else if (type == 1) {
+        error = HuffmanBlock(FixedLitLenTable(), FixedDistTable());
+      } else if (type == 2) {
+        error = ReadDynamicTables();
+        if (!error)
+          error = HuffmanBlock(litlen_table_, dist_table_);
+      } else {
+        error = kErrorInvalidBlockType;
+      }
+    }
+    if (!error && overrun_ * 8 > bit_count_)
+      error = kErrorEndOfInput;
+
+    *out = out_;
+    *outsize = out_pos_;
+    return error;
+  }
+
+ private:
+  // Fill the bit buffer with at least 56 bits. Past the end of the input zero bytes are read,
+  // they are counted in |overrun_| and it's an error if they are actually used.
+  void Refill() {
+    if (in_end_ - in_ >= 8) {
+      uint64_t word;
+      memcpy(&word, in_, 8);
+      // Bits above |bit_count_| are the following input bytes, so refilling them again is harmless.
+      bit_buffer_ |= word << bit_count_;
+      in_ += (63 - bit_count_) >> 3;
+      bit_count_ |= 56;
+      return;
+    }
+    while (bit_count_ <= 56) {
+      if (in_ < in_end_)
+        bit_buffer_ |= static_cast<uint64_t>(*in_++) << bit_count_;
+      else
+        overrun_++;
+      bit_count_ += 8;
+    }
+  }
+
+  uint32_t GetBits(int n) {
+    uint32_t bits = static_cast<uint32_t>(bit_buffer_ & ((1ull << n) - 1));
+    bit_buffer_ >>= n;
+    bit_count_ -= n;
+    return bits;
+  }
+
+  uint32_t Decode(const uint32_t* table, int table_bits) {
+    uint32_t entry = table[bit_buffer_ & ((1u << table_bits) - 1)];
+    if (entry & kSubtable) {
+      bit_buffer_ >>= table_bits;
+      bit_count_ -= table_bits;
+      entry = table[(entry >> 16) + (bit_buffer_ & ((1u << ((entry >> 8) & 15)) - 1))];
+    }
+    uint32_t len = entry & 0xFF;
+    bit_buffer_ >>= len;
+    bit_count_ -= len;
+    return entry;
+  }
+
+  unsigned Reserve(size_t size) {
+    if (out_capacity_ - out_pos_ >= size)
+      return 0;
+    size_t capacity = out_capacity_ * 2;
+    if (capacity < out_pos_ + size)
+      capacity = out_pos_ + size;
+    uint8_t* out = static_cast<uint8_t*>(realloc(out_, capacity));
+    if (!out)
+      return kErrorAlloc;
+    out_ = out;
+    out_capacity_ = capacity;
+    return 0;
+  }
+
+  unsigned StoredBlock() {
+    // skip to the byte boundary, the whole bytes left in the bit buffer are the next input bytes
+    GetBits(bit_count_ & 7);
+    if (overrun_ * 8 + 32 > bit_count_)
+      return kErrorEndOfInput;
+    uint32_t len = GetBits(16);
+    uint32_t nlen = GetBits(16);
+    if (len != (~nlen & 0xFFFF))
+      return kErrorStoredLength;
+
+    in_ -= (bit_count_ >> 3) - overrun_;
+    bit_buffer_ = 0;
+    bit_count_ = 0;
+    overrun_ = 0;
+    if (static_cast<size_t>(in_end_ - in_) < len)
+      return kErrorEndOfInput;
+    unsigned error = Reserve(len + 8);
+    if (error)
+      return error;
+    memcpy(out_ + out_pos_, in_, len);
+    out_pos_ += len;
+    in_ += len;
+    return 0;
+  }
+
+  unsigned ReadDynamicTables() {
+    uint32_t num_litlen = GetBits(5) + 257;
+    uint32_t num_dist = GetBits(5) + 1;
+    uint32_t num_code_length = GetBits(4) + 4;
+    if (num_litlen > 286 || num_dist > 30)
+      return kErrorBadTree;
+
+    uint8_t lengths[286 + 30] = {};
+    for (uint32_t i = 0; i < num_code_length; i++) {
+      Refill();
+      lengths[kCodeLengthOrder[i]] = static_cast<uint8_t>(GetBits(3));
+    }
+    if (!BuildTable(lengths, 19, CodeLengthSymbol, kCodeLengthTableBits, &code_length_table_))
+      return kErrorBadTree;
+
+    memset(lengths, 0, 19);
+    for (uint32_t i = 0; i < num_litlen + num_dist;) {
+      Refill();
+      uint32_t entry = Decode(code_length_table_.data(), kCodeLengthTableBits);
+      if (entry & kInvalid)
+        return kErrorInvalidCode;
+      uint32_t symbol = entry >> 16;
+      if (symbol < 16) {
+        lengths[i++] = static_cast<uint8_t>(symbol);
+        continue;
+      }
+
+      uint8_t value = 0;
+      uint32_t repeat;
+      if (symbol == 16) {
+        if (i == 0)
+          return kErrorBadTree;
+        value = lengths[i - 1];
+        repeat = 3 + GetBits(2);
+      } else if (symbol == 17) {
+        repeat = 3 + GetBits(3);
+      } else {
+        repeat = 11 + GetBits(7);
+      }
+      if (i + repeat > num_litlen + num_dist)
+        return kErrorBadTree;
+      memset(lengths + i, value, repeat);
+      i += repeat;
+    }
+    if (overrun_ * 8 > bit_count_)
+      return kErrorEndOfInput;
+    // the end of block code must exist
+    if (lengths[256] == 0)
+      return kErrorBadTree;
+
+    if (!BuildTable(lengths, num_litlen, LitLenSymbol, kLitLenTableBits, &litlen_table_) ||
+        !BuildTable(lengths + num_litlen, num_dist, DistSymbol, kDistTableBits, &dist_table_))
+      return kErrorBadTree;
+    return 0;
+  }
+
+  unsigned HuffmanBlock(const std::vector<uint32_t>& litlen_table, const std::vector<uint32_t>& dist_table) {
+    const uint32_t* litlen = litlen_table.data();
+    const uint32_t* dist = dist_table.data();
+    while (true) {
+      // a length code with its extra bits uses at most 20 bits
+      if (bit_count_ < 20) {
+        Refill();
+        // garbage at the end of the input could decode forever otherwise
+        if (overrun_ * 8 > bit_count_)
+          return kErrorEndOfInput;
+      }
+      // 258 bytes for the longest match and 8 bytes for copying whole words
+      if (out_capacity_ - out_pos_ < 258 + 8) {
+        unsigned error = Reserve(258 + 8);
+        if (error)
+          return error;
+      }
+
+      uint32_t entry = Decode(litlen, kLitLenTableBits);
+      if (entry & kLiteral) {
+        out_[out_pos_++] = static_cast<uint8_t>(entry >> 16);
+        continue;
+      }
+      if (entry & (kEndOfBlock | kInvalid)) {
+        if (overrun_ * 8 > bit_count_)
+          return kErrorEndOfInput;
+        return entry & kInvalid ? kErrorInvalidCode : 0;
+      }
+
+      size_t length = (entry >> 16) + GetBits((entry >> 8) & 15);
+      // a distance code with its extra bits uses at most 28 bits
+      if (bit_count_ < 28) {
+        Refill();
+        if (overrun_ * 8 > bit_count_)
+          return kErrorEndOfInput;
+      }
+      entry = Decode(dist, kDistTableBits);
+      if (entry & kInvalid)
+        return kErrorInvalidDistance;
+      size_t distance = (entry >> 16) + GetBits((entry >> 8) & 15);
+      if (distance > out_pos_)
+        return kErrorInvalidDistance;
+
+      uint8_t* dst = out_ + out_pos_;
+      const uint8_t* src = dst - distance;
+      out_pos_ += length;
+      if (distance >= 8) {
+        // copy whole words, might write up to 7 bytes past the end, there's room for them
+        uint8_t* end = dst + length;
+        do {
+          memcpy(dst, src, 8);
+          dst += 8;
+          src += 8;
+        } while (dst < end);
+      } else {
+        for (size_t i = 0; i < length; i++)
+          dst[i] = src[i];
+      }
+    }
+  }
+
+  static const std::vector<uint32_t>& FixedLitLenTable() {
+    static const std::vector<uint32_t> table = [] {
+      uint8_t lengths[288];
+      memset(lengths, 8, 144);
+      memset(lengths + 144, 9, 112);
+      memset(lengths + 256, 7, 24);
+      memset(lengths + 280, 8, 8);
+      std::vector<uint32_t> t;
+      BuildTable(lengths, 288, LitLenSymbol, kLitLenTableBits, &t);
+      return t;
+    }();
+    return table;
+  }
+
+  static const std::vector<uint32_t>& FixedDistTable() {
+    static const std::vector<uint32_t> table = [] {
+      uint8_t lengths[32];
+      memset(lengths, 5, 32);
+      std::vector<uint32_t> t;
+      BuildTable(lengths, 32, DistSymbol, kDistTableBits, &t);
+      return t;
+    }();
+    return table;
+  }
+
+  const uint8_t* in_;
+  const uint8_t* in_end_;
+  uint64_t bit_buffer_ = 0;
+  uint32_t bit_count_ = 0;
+  // number of zero bytes read past the end of the input
+  uint32_t overrun_ = 0;
+
+  uint8_t* out_ = nullptr;
+  size_t out_pos_ = 0;
+  size_t out_capacity_ = 0;
+
+  std::vector<uint32_t> litlen_table_, dist_table_, code_length_table_;
+};
+
+}  // namespace
+
+unsigned Inflate(uint8_t** out, size_t* outsize, const uint8_t* in, size_t insize, size_t size_hint /*= 0*/) {
+  ScopedTimer timer(kStageInflate, insize);
+  // don't trust the hint too much, deflate can't compress more than 1032:1
+  if (size_hint / 1032 > insize)
+    size_hint = insize * 1032;
+  return Inflater(in, insize).Run(out, outsize, size_hint);
+}
+
+unsigned InflateForLodepng(unsigned char** out, size_t* outsize, const unsigned char* in, size_t insize,
+                           const LodePNGDecompressSettings* settings) {
+  return Inflate(out, outsize, in, insize);
+}
+
+unsigned ZlibDecompress(uint8_t** out, size_t* outsize, const uint8_t* in, size_t insize) {
+  LodePNGDecompressSettings settings;
+  lodepng_decompress_settings_init(&settings);
+  settings.custom_inflate = InflateForLodepng;
+  return lodepng_zlib_decompress(out, outsize, in, insize, &settings);
+}
@@ -0,0 +1,23 @@
+#ifndef INFLATE_H_
+#define INFLATE_H_
+
+#include <cstddef>
+#include <cstdint>
+
+struct LodePNGDecompressSettings;
+
+// Decompresses raw deflate data, a lot faster than lodepng_inflate and with the same interface:
+// the data is appended to *out, which is allocated with malloc and must be freed even on failure.
+// Unlike lodepng_inflate, but like zlib, it rejects Huffman code lengths that don't form a valid prefix code.
+// size_hint is the expected size of the decompressed data, 0 if unknown.
+// Returns 0 on success, otherwise a lodepng error code.
+unsigned Inflate(uint8_t** out, size_t* outsize, const uint8_t* in, size_t insize, size_t size_hint = 0);
+
+// Same as Inflate, with the signature of LodePNGDecompressSettings::custom_inflate.
+unsigned InflateForLodepng(unsigned char** out, size_t* outsize, const unsigned char* in, size_t insize,
+                           const LodePNGDecompressSettings* settings);
+
+// Same as lodepng_zlib_decompress, but uses Inflate.
+unsigned ZlibDecompress(uint8_t** out, size_t* outsize, const uint8_t* in, size_t insize);
+
+#endif  // INFLATE_H_
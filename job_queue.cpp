@@ -0,0 +1,276 @@
+#include "job_queue.h"
+
+#include <algorithm>
+#include <climits>
+#include <iostream>
+#include <utility>
+
+using std::cerr;
+using std::cout;
+
+thread_local JobQueue::JobOutput* JobQueue::current_output_ = nullptr;
+JobQueue::CaptureBuffer* JobQueue::cout_buffer_ = nullptr;
+JobQueue::CaptureBuffer* JobQueue::cerr_buffer_ = nullptr;
+
+std::mutex JobQueue::thread_mutex_;
+std::condition_variable JobQueue::thread_available_;
+int JobQueue::available_threads_ = INT_MAX;
+int JobQueue::thread_limit_ = INT_MAX;
+
+JobQueue::Pool* JobQueue::pool_ = nullptr;
+
+JobQueue::CaptureBuffer::int_type JobQueue::CaptureBuffer::overflow(int_type c) {
+  if (traits_type::eq_int_type(c, traits_type::eof()))
+    return traits_type::not_eof(c);
+
+  if (current_output_) {
+    (current_output_->*field_) += traits_type::to_char_type(c);
+    return c;
+  }
+  return original_->sputc(traits_type::to_char_type(c));
+}
+
+std::streamsize JobQueue::CaptureBuffer::xsputn(const char* s, std::streamsize n) {
+  if (current_output_) {
+    (current_output_->*field_).append(s, static_cast<size_t>(n));
+    return n;
+  }
+  return original_->sputn(s, n);
+}
+
+int JobQueue::CaptureBuffer::sync() {
+  // Captured output is flushed when the job is done.
+  if (current_output_)
+    return 0;
+  return original_->pubsync();
+}
+
+JobQueue::JobQueue(int num_workers)
+    : parent_output_(current_output_),
+      num_workers_(num_workers),
+      max_pending_(static_cast<size_t>(num_workers) * 4 + 1) {
+  static std::once_flag capture_installed;
+  std::call_once(capture_installed, [] {
+    // Never restored, the streams might still be used while exiting.
+    cout_buffer_ = new CaptureBuffer(cout.rdbuf(), &JobOutput::out);
+    cerr_buffer_ = new CaptureBuffer(cerr.rdbuf(), &JobOutput::err);
+    // rdbuf() clears the failbit of -q
+    std::ios::iostate state = cout.rdstate();
+    cout.rdbuf(cout_buffer_);
+    cout.setstate(state);
+    cerr.rdbuf(cerr_buffer_);
+    pool_ = new Pool;
+  });
+
+  if (parent_output_)
+    return;
+  for (int i = 0; i < num_workers; i++)
+    workers_.emplace_back(&JobQueue::Worker, this);
+}
+
+JobQueue::~JobQueue() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (parent_output_) {
+    Job job;
+    while (Pop(&job)) {
+      lock.unlock();
+      Run(job);
+      lock.lock();
+    }
+    // Wake up the workers waiting for a thread, they won't be able to find any job.
+    std::lock_guard<std::mutex> thread_lock(thread_mutex_);
+    stopped_ = true;
+  }
+  closed_ = true;
+  lock.unlock();
+
+  job_available_.notify_all();
+  thread_available_.notify_all();
+  for (auto& worker : workers_)
+    worker.join();
+
+  if (parent_output_) {
+    // the pool threads must not find this queue anymore
+    std::unique_lock<std::mutex> pool_lock(pool_->mutex);
+    pool_->queues.erase(std::remove(pool_->queues.begin(), pool_->queues.end(), this), pool_->queues.end());
+    pool_->helper_done.wait(pool_lock, [this] { return helpers_ == 0; });
+  }
+}
+
+void JobQueue::Push(std::function<void()> job) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (parent_output_) {
+    // This thread is already running a job, the workers might be waiting for it to finish,
+    // so run the pending jobs here instead of waiting for them.
+    Job pending;
+    while (jobs_.size() >= max_pending_ && Pop(&pending)) {
+      lock.unlock();
+      Run(pending);
+      lock.lock();
+    }
+  } else {
+    slot_available_.wait(lock, [this] { return jobs_.size() < max_pending_; });
+  }
+  jobs_.emplace_back(next_seq_++, std::move(job));
+  lock.unlock();
+  if (parent_output_)
+    OfferToPool();
+  else
+    job_available_.notify_one();
+}
+
+void JobQueue::SetThreadLimit(int limit) {
+  std::lock_guard<std::mutex> lock(thread_mutex_);
+  available_threads_ = limit;
+  thread_limit_ = limit;
+}
+
+void JobQueue::RunParallel(int num_threads, size_t num_jobs, const std::function<void(size_t)>& job) {
+  if (num_threads <= 1 || num_jobs <= 1) {
+    for (size_t i = 0; i < num_jobs; i++)
+      job(i);
+    return;
+  }
+
+  JobQueue queue(static_cast<int>(std::min(static_cast<size_t>(num_threads), num_jobs)) - 1);
+  for (size_t i = 0; i < num_jobs; i++)
+    queue.Push([&job, i] { job(i); });
+}
+
+void JobQueue::Worker() {
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      job_available_.wait(lock, [this] { return closed_ || !jobs_.empty(); });
+      if (jobs_.empty())
+        return;
+    }
+
+    if (!AcquireThread())
+      continue;
+
+    Job job;
+    std::unique_lock<std::mutex> lock(mutex_);
+    // The job might be taken by another thread while waiting.
+    bool found = Pop(&job);
+    lock.unlock();
+    if (found)
+      Run(job);
+    ReleaseThread();
+  }
+}
+
+void JobQueue::OfferToPool() {
+  int thread_limit;
+  {
+    std::lock_guard<std::mutex> lock(thread_mutex_);
+    thread_limit = thread_limit_;
+  }
+  if (thread_limit == INT_MAX)
+    thread_limit = static_cast<int>(std::max(std::thread::hardware_concurrency(), 1u));
+
+  std::lock_guard<std::mutex> lock(pool_->mutex);
+  // the helpers that are already running take it after their current job
+  if (helpers_ >= num_workers_)
+    return;
+  pool_->queues.push_back(this);
+  if (pool_->idle_threads < static_cast<int>(pool_->queues.size()) && pool_->num_threads < thread_limit) {
+    pool_->num_threads++;
+    std::thread(&JobQueue::PoolWorker).detach();
+  }
+  pool_->queue_available.notify_one();
+}
+
+void JobQueue::PoolWorker() {
+  std::unique_lock<std::mutex> lock(pool_->mutex);
+  while (true) {
+    pool_->idle_threads++;
+    pool_->queue_available.wait(lock, [] { return !pool_->queues.empty(); });
+    pool_->idle_threads--;
+    JobQueue* queue = pool_->queues.front();
+    pool_->queues.pop_front();
+    if (queue->helpers_ >= queue->num_workers_)
+      continue;
+
+    queue->helpers_++;
+    lock.unlock();
+    queue->Help();
+    lock.lock();
+    if (--queue->helpers_ == 0)
+      pool_->helper_done.notify_all();
+  }
+}
+
+void JobQueue::Help() {
+  while (AcquireThread()) {
+    Job job;
+    std::unique_lock<std::mutex> lock(mutex_);
+    bool found = Pop(&job);
+    lock.unlock();
+    if (found)
+      Run(job);
+    ReleaseThread();
+    if (!found)
+      return;
+  }
+}
+
+void JobQueue::Run(Job& job) {
+  JobOutput output;
+  JobOutput* saved_output = current_output_;
+  current_output_ = &output;
+  job.second();
+  current_output_ = saved_output;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  finished_.emplace(job.first, std::move(output));
+  PrintFinished();
+}
+
+bool JobQueue::Pop(Job* job) {
+  if (jobs_.empty())
+    return false;
+
+  *job = std::move(jobs_.front());
+  jobs_.pop_front();
+  slot_available_.notify_one();
+  return true;
+}
+
+void JobQueue::PrintFinished() {
+  for (auto it = finished_.begin(); it != finished_.end() && it->first == next_print_seq_;
+       it = finished_.erase(it), next_print_seq_++) {
+    const JobOutput& output = it->second;
+    if (parent_output_) {
+      parent_output_->out += output.out;
+      parent_output_->err += output.err;
+      continue;
+    }
+    if (!output.out.empty()) {
+      cout_buffer_->original()->sputn(output.out.data(), output.out.size());
+      cout_buffer_->original()->pubsync();
+    }
+    if (!output.err.empty()) {
+      cerr_buffer_->original()->sputn(output.err.data(), output.err.size());
+      cerr_buffer_->original()->pubsync();
+    }
+  }
+}
+
+bool JobQueue::AcquireThread() {
+  std::unique_lock<std::mutex> lock(thread_mutex_);
+  thread_available_.wait(lock, [this] { return available_threads_ > 0 || stopped_; });
+  if (available_threads_ <= 0)
+    return false;
+
+  available_threads_--;
+  return true;
+}
+
+void JobQueue::ReleaseThread() {
+  {
+    std::lock_guard<std::mutex> lock(thread_mutex_);
+    available_threads_++;
+  }
+  thread_available_.notify_all();
+}
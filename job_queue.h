@@ -0,0 +1,125 @@
+#ifndef JOB_QUEUE_H_
+#define JOB_QUEUE_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Runs jobs on a fixed number of worker threads.
+// Everything a job writes to std::cout and std::cerr is buffered and printed after the job is done,
+// in the same order as the jobs were pushed, so the output is identical to running them one by one.
+// Queues can be nested: a queue created inside a job forwards the output to the enclosing job,
+// and the thread that created it runs jobs too, since it already counts towards the thread limit.
+// A nested queue doesn't start threads of its own, its jobs also run on threads that are shared by all the
+// nested queues and kept for the next ones.
+class JobQueue {
+ public:
+  // Up to |num_workers| threads run the jobs besides the one that pushes them.
+  explicit JobQueue(int num_workers);
+  // Waits for all pushed jobs to finish.
+  ~JobQueue();
+
+  // Blocks if there are already too many pending jobs.
+  void Push(std::function<void()> job);
+
+  // Maximum number of jobs running at the same time in all queues, unlimited by default.
+  static void SetThreadLimit(int limit);
+
+  // Runs job(0) to job(num_jobs - 1) with up to num_threads threads, including the calling one,
+  // and waits for all of them.
+  static void RunParallel(int num_threads, size_t num_jobs, const std::function<void(size_t)>& job);
+
+ private:
+  struct JobOutput {
+    std::string out, err;
+  };
+
+  // Stream buffer that appends to the output of the job running on the current thread,
+  // or writes to the original stream buffer if there is none.
+  class CaptureBuffer : public std::streambuf {
+   public:
+    CaptureBuffer(std::streambuf* original, std::string JobOutput::*field) : original_(original), field_(field) {}
+
+    std::streambuf* original() const {
+      return original_;
+    }
+
+   protected:
+    int_type overflow(int_type c) override;
+    std::streamsize xsputn(const char* s, std::streamsize n) override;
+    int sync() override;
+
+   private:
+    std::streambuf* original_;
+    std::string JobOutput::*field_;
+  };
+
+  typedef std::pair<size_t, std::function<void()>> Job;
+
+  // Threads shared by the nested queues, started as they are needed up to the thread limit. Never destroyed,
+  // the threads are still waiting for jobs at exit.
+  struct Pool {
+    std::mutex mutex;
+    // a queue is in here once for each job pushed to it that no pool thread has looked at yet
+    std::deque<JobQueue*> queues;
+    std::condition_variable queue_available, helper_done;
+    int num_threads = 0;
+    int idle_threads = 0;
+  };
+
+  void Worker();
+  // Lets a pool thread run the job just pushed, starts one if none is idle.
+  void OfferToPool();
+  static void PoolWorker();
+  // Runs jobs on a pool thread until there are none left.
+  void Help();
+  void Run(Job& job);
+  // Pop the next job if there is any, |mutex_| must be held.
+  bool Pop(Job* job);
+  // Print the output of finished jobs that are next in order, |mutex_| must be held.
+  void PrintFinished();
+
+  // Wait until less than the maximum number of jobs are running,
+  // returns false if the queue was stopped before that.
+  bool AcquireThread();
+  static void ReleaseThread();
+
+  static thread_local JobOutput* current_output_;
+  static CaptureBuffer *cout_buffer_, *cerr_buffer_;
+
+  static std::mutex thread_mutex_;
+  static std::condition_variable thread_available_;
+  static int available_threads_;
+  static int thread_limit_;
+
+  static Pool* pool_;
+
+  // Output of the job that created this queue, null if it's not created inside a job.
+  JobOutput* parent_output_;
+  // The workers are pool threads if it is created inside a job.
+  std::vector<std::thread> workers_;
+  const int num_workers_;
+  // pool threads running jobs of this queue, protected by |pool_->mutex|
+  int helpers_ = 0;
+  std::mutex mutex_;
+  std::condition_variable job_available_, slot_available_;
+  // Pending jobs and their sequence number.
+  std::deque<Job> jobs_;
+  // Output of finished jobs that can't be printed yet because an earlier job is still running.
+  std::map<size_t, JobOutput> finished_;
+  size_t next_seq_ = 0;
+  size_t next_print_seq_ = 0;
+  size_t max_pending_;
+  bool closed_ = false;
+  // Set when there will be no more jobs, protected by |thread_mutex_|.
+  bool stopped_ = false;
+};
+
+#endif  // JOB_QUEUE_H_
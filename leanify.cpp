@@ -1,10 +1,15 @@
 #include "leanify.h"
 
 #include <algorithm>
+#include <chrono>
+#include <cstring>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
 
-#include <zopfli/zlib_container.h>
-#include <zopflipng/lodepng/lodepng.h>
+#include <zopfli/deflate.h>
 
 #include "formats/data_uri.h"
 #include "formats/dwf.h"
@@ -23,15 +28,30 @@
 #include "formats/vcf.h"
 #include "formats/xml.h"
 #include "formats/zip.h"
+#include "inflate.h"
+#include "job_queue.h"
+#include "memory_budget.h"
+#include "profile.h"
+#include "result_cache.h"
+#include "stats.h"
 #include "utils.h"
 
 using std::cerr;
 using std::endl;
 using std::string;
 
-Format* GetType(void* file_pointer, size_t file_size, const string& filename) {
-  if (depth > max_depth)
-    return new Format(file_pointer, file_size);
+// |type| is set to the name of the detected format, left empty if the format is not supported.
+Format* GetType(void* file_pointer, size_t file_size, const Context& ctx, const string& filename,
+                string* type = nullptr) {
+  if (ctx.depth > ctx.max_depth)
+    return new Format(file_pointer, file_size, ctx);
+
+  auto detected = [&](const string& name, Format* format) {
+    VerbosePrint(ctx, name, " detected.");
+    if (type)
+      *type = name;
+    return format;
+  };
 
   if (!filename.empty()) {
     size_t dot = filename.find_last_of('.');
@@ -41,92 +61,206 @@ Format* GetType(void* file_pointer, size_t file_size, const string& filename) {
       for (auto& c : ext)
         c &= ~0x20;
 
-      if (ext == "HTML" || ext == "HTM" || ext == "JS" || ext == "CSS") {
-        VerbosePrint(ext, " detected.");
-        return new DataURI(file_pointer, file_size);
-      }
-      if (ext == "VCF" || ext == "VCARD") {
-        VerbosePrint(ext, " detected.");
-        return new Vcf(file_pointer, file_size);
-      }
-      if (ext == "MHT" || ext == "MHTML" || ext == "MIM" || ext == "MIME" || ext == "EML") {
-        VerbosePrint(ext, " detected.");
-        return new Mime(file_pointer, file_size);
-      }
+      if (ext == "HTML" || ext == "HTM" || ext == "JS" || ext == "CSS")
+        return detected(ext, new DataURI(file_pointer, file_size, ctx));
+      if (ext == "VCF" || ext == "VCARD")
+        return detected(ext, new Vcf(file_pointer, file_size, ctx));
+      if (ext == "MHT" || ext == "MHTML" || ext == "MIM" || ext == "MIME" || ext == "EML")
+        return detected(ext, new Mime(file_pointer, file_size, ctx));
     }
   }
   if (memcmp(file_pointer, Png::header_magic, sizeof(Png::header_magic)) == 0) {
-    VerbosePrint("PNG detected.");
-    return new Png(file_pointer, file_size);
+    return detected("PNG", new Png(file_pointer, file_size, ctx));
   } else if (memcmp(file_pointer, Jpeg::header_magic, sizeof(Jpeg::header_magic)) == 0) {
-    VerbosePrint("JPEG detected.");
-    return new Jpeg(file_pointer, file_size);
+    return detected("JPEG", new Jpeg(file_pointer, file_size, ctx));
   } else if (memcmp(file_pointer, Lua::header_magic, sizeof(Lua::header_magic)) == 0) {
-    VerbosePrint("Lua detected.");
-    return new Lua(file_pointer, file_size);
+    return detected("Lua", new Lua(file_pointer, file_size, ctx));
   } else if (memcmp(file_pointer, Zip::header_magic, sizeof(Zip::header_magic)) == 0) {
-    VerbosePrint("ZIP detected.");
-    return new Zip(file_pointer, file_size);
+    return detected("ZIP", new Zip(file_pointer, file_size, ctx));
   } else if (memcmp(file_pointer, Pe::header_magic, sizeof(Pe::header_magic)) == 0) {
-    VerbosePrint("PE detected.");
-    return new Pe(file_pointer, file_size);
+    return detected("PE", new Pe(file_pointer, file_size, ctx));
   } else if (memcmp(file_pointer, Gz::header_magic, sizeof(Gz::header_magic)) == 0) {
-    VerbosePrint("GZ detected.");
-    return new Gz(file_pointer, file_size);
+    return detected("GZ", new Gz(file_pointer, file_size, ctx));
   } else if (memcmp(file_pointer, Ico::header_magic, sizeof(Ico::header_magic)) == 0) {
-    VerbosePrint("ICO detected.");
-    return new Ico(file_pointer, file_size);
+    return detected("ICO", new Ico(file_pointer, file_size, ctx));
   } else if (memcmp(file_pointer, Dwf::header_magic, sizeof(Dwf::header_magic)) == 0) {
-    VerbosePrint("DWF detected.");
-    return new Dwf(file_pointer, file_size);
+    return detected("DWF", new Dwf(file_pointer, file_size, ctx));
   } else if (memcmp(file_pointer, Gft::header_magic, sizeof(Gft::header_magic)) == 0) {
-    VerbosePrint("GFT detected.");
-    return new Gft(file_pointer, file_size);
+    return detected("GFT", new Gft(file_pointer, file_size, ctx));
   } else if (memcmp(file_pointer, Rdb::header_magic, sizeof(Rdb::header_magic)) == 0) {
-    VerbosePrint("RDB detected.");
-    return new Rdb(file_pointer, file_size);
+    return detected("RDB", new Rdb(file_pointer, file_size, ctx));
   } else if (memcmp(file_pointer, Swf::header_magic, sizeof(Swf::header_magic)) == 0 ||
              memcmp(file_pointer, Swf::header_magic_deflate, sizeof(Swf::header_magic_deflate)) == 0 ||
              memcmp(file_pointer, Swf::header_magic_lzma, sizeof(Swf::header_magic_lzma)) == 0) {
-    VerbosePrint("SWF detected.");
-    return new Swf(file_pointer, file_size);
+    return detected("SWF", new Swf(file_pointer, file_size, ctx));
   } else {
     // Search for vcard magic which might not be at the very beginning.
     const string vcard_magic = "BEGIN:VCARD";
     const char* fp = static_cast<char*>(file_pointer);
     const char* search_end = fp + std::min(static_cast<size_t>(1024), file_size);
-    if (std::search(fp, search_end, vcard_magic.begin(), vcard_magic.end()) < search_end) {
-      VerbosePrint("VCF detected.");
-      return new Vcf(file_pointer, file_size);
-    }
+    if (std::search(fp, search_end, vcard_magic.begin(), vcard_magic.end()) < search_end)
+      return detected("VCF", new Vcf(file_pointer, file_size, ctx));
 
     // tar file does not have header magic
     // ustar is optional
     {
-      Tar* t = new Tar(file_pointer, file_size);
+      Tar* t = new Tar(file_pointer, file_size, ctx);
       // checking first record checksum
-      if (t->IsValid()) {
-        VerbosePrint("tar detected.");
-        return t;
-      }
+      if (t->IsValid())
+        return detected("tar", t);
       delete t;
     }
 
     // XML file does not have header magic
     // have to parse and see if there are any errors.
     {
-      Xml* x = new Xml(file_pointer, file_size);
-      if (x->IsValid()) {
-        VerbosePrint("XML detected.");
-        return x;
-      }
+      Xml* x = new Xml(file_pointer, file_size, ctx);
+      if (x->IsValid())
+        return detected("XML", x);
       delete x;
     }
   }
 
-  VerbosePrint("Format not supported!");
+  VerbosePrint(ctx, "Format not supported!");
   // for unsupported format, just memmove it.
-  return new Format(file_pointer, file_size);
+  return new Format(file_pointer, file_size, ctx);
+}
+
+string GetTypeName(void* file_pointer, size_t file_size, const string& filename) {
+  string type;
+  delete GetType(file_pointer, file_size, Context(), filename, &type);
+  return type;
+}
+
+Context FitFileInMemory(void* file_pointer, size_t file_size, const Context& ctx, const string& filename,
+                        size_t* memory) {
+  *memory = 0;
+  if (!max_memory)
+    return ctx;
+
+  // it is detected again when it is leanified
+  Context quiet_ctx = ctx;
+  quiet_ctx.is_verbose = false;
+  string type;
+  Format* f = GetType(file_pointer, file_size, quiet_ctx, filename, &type);
+  // unsupported files are only moved
+  auto estimate = [&](const Context& c) { return type.empty() ? 0 : f->MemoryEstimate(c); };
+  Context fitted_ctx = FitInMemory(ctx, estimate);
+  *memory = estimate(fitted_ctx);
+  delete f;
+  return fitted_ctx;
+}
+
+namespace {
+
+// Outputs of LeanifyFile for embedded files in this run, so that a file embedded many times (the same icon in every
+// page of a document, the same library in every jar of a zip) is only leanified once and the copies are a memcpy.
+// Top-level files are not kept, they are rarely the same and would only take the memory.
+struct MemoEntry {
+  std::vector<uint8_t> output;
+  string type;
+  const char* engine;
+};
+std::mutex memo_mutex;
+std::unordered_map<string, MemoEntry> memo;
+size_t memo_bytes = 0;
+// nothing is added once the outputs take this much memory
+const size_t kMaxMemoBytes = 256 << 20;
+
+// with --max-memory, the memo only takes the part of it that the files are not admitted into
+size_t MaxMemoBytes() {
+  return max_memory ? std::min(kMaxMemoBytes, MemoMemory()) : kMaxMemoBytes;
+}
+
+// LeanifyFile without the statistics, |type| and |engine| are set for them.
+// The result goes to |sink| instead if it is not null.
+size_t LeanifyMemoized(void* file_pointer, size_t file_size, const Context& ctx, size_t size_leanified,
+                       const string& filename, OutputSink* sink, string* type, const char** engine) {
+  // a file this big could never be added, and hashing it would touch every page of it
+  string key;
+  if (ctx.depth > 1 && file_size <= MaxMemoBytes()) {
+    key = ResultCache::Key(file_pointer, file_size, ctx, filename);
+    std::lock_guard<std::mutex> lock(memo_mutex);
+    auto it = memo.find(key);
+    if (it != memo.end()) {
+      VerbosePrint(ctx, "Same as a file leanified before.");
+      const MemoEntry& entry = it->second;
+      if (sink)
+        sink->Write(entry.output.data(), entry.output.size());
+      else
+        memcpy(static_cast<uint8_t*>(file_pointer) - size_leanified, entry.output.data(), entry.output.size());
+      *type = entry.type;
+      *engine = entry.engine;
+      return entry.output.size();
+    }
+  }
+
+  Format* f;
+  {
+    ScopedTimer timer(kStageDetect, file_size);
+    f = GetType(file_pointer, file_size, ctx, filename, type);
+  }
+  size_t sink_offset = sink ? sink->size() : 0;
+  size_t r = sink ? f->LeanifyTo(sink) : f->Leanify(size_leanified);
+  *engine = f->engine();
+  delete f;
+
+  // unsupported files are only moved, not worth the memory
+  if (!key.empty() && !type->empty()) {
+    std::lock_guard<std::mutex> lock(memo_mutex);
+    if (memo_bytes + r <= MaxMemoBytes()) {
+      MemoEntry entry = { std::vector<uint8_t>(r), *type, *engine };
+      if (sink) {
+        sink->CopyTo(entry.output.data(), sink_offset);
+      } else {
+        const uint8_t* output = static_cast<uint8_t*>(file_pointer) - size_leanified;
+        memcpy(entry.output.data(), output, r);
+      }
+      if (memo.emplace(key, std::move(entry)).second)
+        memo_bytes += r;
+    }
+  }
+  return r;
+}
+
+// LeanifyMemoized with the statistics.
+size_t LeanifyWithStats(void* file_pointer, size_t file_size, const Context& ctx, size_t size_leanified,
+                        const string& filename, OutputSink* sink) {
+  string type;
+  const char* engine;
+  if (!IsStatsEnabled())
+    return LeanifyMemoized(file_pointer, file_size, ctx, size_leanified, filename, sink, &type, &engine);
+
+  // an embedded file is named after the files it is in
+  Context file_ctx = ctx;
+  if (!ctx.path.empty() && !filename.empty())
+    file_ctx.path += '/' + filename;
+  else if (ctx.path.empty())
+    file_ctx.path = filename;
+
+  auto start_time = std::chrono::steady_clock::now();
+  double start_cpu_time = ThreadCpuTime();
+  size_t r = LeanifyMemoized(file_pointer, file_size, file_ctx, size_leanified, filename, sink, &type, &engine);
+
+  FileStats stats;
+  stats.path = file_ctx.path;
+  stats.format = type;
+  stats.depth = ctx.depth;
+  stats.original_size = file_size;
+  stats.new_size = r;
+  stats.wall_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+  stats.cpu_time = ThreadCpuTime() - start_cpu_time;
+  stats.engine = engine;
+  WriteStats(stats);
+  return r;
+}
+
+}  // namespace
+
+void ClearLeanifyMemo() {
+  std::lock_guard<std::mutex> lock(memo_mutex);
+  memo.clear();
+  memo_bytes = 0;
 }
 
 // Leanify the file
@@ -134,34 +268,96 @@ Format* GetType(void* file_pointer, size_t file_size, const string& filename) {
 // the new location of the file will be file_pointer - size_leanified
 // it's designed this way to avoid extra memmove or memcpy
 // return new size
-size_t LeanifyFile(void* file_pointer, size_t file_size, size_t size_leanified /*= 0*/,
+size_t LeanifyFile(void* file_pointer, size_t file_size, const Context& ctx, size_t size_leanified /*= 0*/,
                    const string& filename /*= ""*/) {
-  Format* f = GetType(file_pointer, file_size, filename);
-  size_t r = f->Leanify(size_leanified);
-  delete f;
-  return r;
+  return LeanifyWithStats(file_pointer, file_size, ctx, size_leanified, filename, nullptr);
+}
+
+size_t LeanifyFileTo(void* file_pointer, size_t file_size, const Context& ctx, const string& filename,
+                     OutputSink* sink) {
+  return LeanifyWithStats(file_pointer, file_size, ctx, 0, filename, sink);
+}
+
+namespace {
+
+// Zopfli buffers that are not in use are kept up to this size by each thread, enough for the hash tables and the
+// stores of small blocks, a zip of many small files then doesn't allocate them again for every one.
+const size_t kZopfliWorkspaceBytes = 4 << 20;
+
+// the workspace of the calling thread, freed when the thread exits
+ZopfliWorkspace* ThreadZopfliWorkspace() {
+  thread_local std::unique_ptr<ZopfliWorkspace, void (*)(ZopfliWorkspace*)> workspace(
+      ZopfliCreateWorkspace(kZopfliWorkspaceBytes), ZopfliDestroyWorkspace);
+  return workspace.get();
+}
+
+}  // namespace
+
+void ZopfliDeflateParallel(const ZopfliOptions* options, const Context& ctx, const uint8_t* in, size_t insize,
+                           uint8_t** out, size_t* outsize) {
+  ScopedTimer timer(kStageZopfli, insize);
+  const size_t block_size = options->masterblocksize;
+  size_t num_parts = (insize + block_size - 1) / block_size;
+  uint8_t bp = 0;
+  // the parts only run on more threads while their memory is free
+  size_t num_threads = std::min(static_cast<size_t>(std::max(ctx.num_threads, 1)), num_parts);
+  MemoryGrant extra_threads(ZopfliMemory(block_size, ctx), num_threads > 1 ? num_threads - 1 : 0);
+  if (extra_threads.count() == 0) {
+    ZopfliOptions thread_options = *options;
+    thread_options.workspace = ThreadZopfliWorkspace();
+    ZopfliDeflate(&thread_options, 2, 1, in, insize, &bp, out, outsize);
+    return;
+  }
+
+  std::vector<ZopfliDeflatedPart> parts(num_parts);
+  std::vector<bool> computed(num_parts, false);
+  size_t num_written = 0;
+  std::mutex write_mutex;
+
+  JobQueue::RunParallel(static_cast<int>(extra_threads.count()) + 1, num_parts, [&](size_t i) {
+    size_t start = i * block_size;
+    // a workspace is only used by its own thread, the parts run on any of them
+    ZopfliOptions thread_options = *options;
+    thread_options.workspace = ThreadZopfliWorkspace();
+    ZopfliComputePart(&thread_options, in, start, std::min(start + block_size, insize), &parts[i]);
+
+    // Write all the parts that are next in order, only writing depends on the bit pointer.
+    std::lock_guard<std::mutex> lock(write_mutex);
+    computed[i] = true;
+    for (; num_written < num_parts && computed[num_written]; num_written++) {
+      ZopfliWritePart(&thread_options, num_written == num_parts - 1, &parts[num_written], &bp, out, outsize);
+      ZopfliCleanPart(&parts[num_written]);
+    }
+  });
 }
 
-size_t ZlibRecompress(uint8_t* src, size_t src_len, size_t size_leanified /*= 0*/) {
-  if (!is_fast) {
+size_t ZlibRecompress(uint8_t* src, size_t src_len, const Context& ctx, size_t size_leanified /*= 0*/) {
+  if (!ctx.is_fast) {
     size_t uncompressed_size = 0;
     uint8_t* buffer = nullptr;
-    if (lodepng_zlib_decompress(&buffer, &uncompressed_size, src, src_len, &lodepng_default_decompress_settings) ||
-        !buffer) {
+    if (ZlibDecompress(&buffer, &uncompressed_size, src, src_len) || !buffer) {
       cerr << "Decompress Zlib data failed." << endl;
     } else {
       ZopfliOptions zopfli_options;
       ZopfliInitOptions(&zopfli_options);
-      zopfli_options.numiterations = iterations;
+      zopfli_options.numiterations = ctx.iterations;
+      zopfli_options.convergenceiterations = ctx.convergence_iterations;
+      if (ctx.zopfli_block_size)
+        zopfli_options.masterblocksize = ctx.zopfli_block_size;
 
       size_t new_size = 0;
       uint8_t* out_buffer = nullptr;
-      ZopfliZlibCompress(&zopfli_options, buffer, uncompressed_size, &out_buffer, &new_size);
+      ZopfliDeflateParallel(&zopfli_options, ctx, buffer, uncompressed_size, &out_buffer, &new_size);
       free(buffer);
-      if (new_size < src_len) {
-        memcpy(src - size_leanified, out_buffer, new_size);
+      // zlib header and the Adler-32 of the data, which is the same as the original one
+      if (new_size + 6 < src_len) {
+        uint8_t* p = src - size_leanified;
+        p[0] = 0x78;
+        p[1] = 0xDA;
+        memcpy(p + 2, out_buffer, new_size);
+        memmove(p + 2 + new_size, src + src_len - 4, 4);
         free(out_buffer);
-        return new_size;
+        return new_size + 6;
       }
       free(out_buffer);
     }
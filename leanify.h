@@ -2,13 +2,39 @@
 #define LEANIFY_H_
 
 #include <cstddef>
+#include <cstdint>
 #include <string>
 
-extern int depth;
-extern int max_depth;
+#include <zopfli/zopfli.h>
 
-size_t LeanifyFile(void* file_pointer, size_t file_size, size_t size_leanified = 0, const std::string& filename = "");
+#include "context.h"
+#include "output_sink.h"
 
-size_t ZlibRecompress(uint8_t* src, size_t src_len, size_t size_leanified = 0);
+size_t LeanifyFile(void* file_pointer, size_t file_size, const Context& ctx, size_t size_leanified = 0,
+                   const std::string& filename = "");
+
+// Same as LeanifyFile, but the result is appended to |sink|. It may reference the input, which must stay valid
+// until the sink is written, and the input may be modified. Returns the new size.
+size_t LeanifyFileTo(void* file_pointer, size_t file_size, const Context& ctx, const std::string& filename,
+                     OutputSink* sink);
+
+// Forgets the files leanified so far, so the next copy of any of them is leanified again.
+void ClearLeanifyMemo();
+
+// Returns the name of the format LeanifyFile would detect, like "PNG", or "" if it is not supported.
+std::string GetTypeName(void* file_pointer, size_t file_size, const std::string& filename = "");
+
+// For --max-memory: returns |ctx|, or a cheaper one if the file is estimated to need more memory than the limit
+// with it, and sets |memory| to the estimate. Returns |ctx| and 0 without a limit.
+Context FitFileInMemory(void* file_pointer, size_t file_size, const Context& ctx, const std::string& filename,
+                        size_t* memory);
+
+// Same as ZopfliDeflate with dynamic blocks and the final bit set,
+// but the master blocks are compressed in parallel if ctx.num_threads allows it.
+// The output is identical to ZopfliDeflate.
+void ZopfliDeflateParallel(const ZopfliOptions* options, const Context& ctx, const uint8_t* in, size_t insize,
+                           uint8_t** out, size_t* outsize);
+
+size_t ZlibRecompress(uint8_t* src, size_t src_len, const Context& ctx, size_t size_leanified = 0);
 
 #endif  // LEANIFY_H_
@@ -284,9 +284,9 @@ void ZopfliBlockSplit(const ZopfliOptions* options,
   ZopfliHash hash;
   ZopfliHash* h = &hash;
 
-  ZopfliInitLZ77Store(in, &store);
+  ZopfliInitLZ77Store(in, options->workspace, &store);
   ZopfliInitBlockState(options, instart, inend, 0, &s);
-  ZopfliAllocHash(ZOPFLI_WINDOW_SIZE, h);
+  ZopfliAllocHash(ZOPFLI_WINDOW_SIZE, options->workspace, h);
 
   *npoints = 0;
   *splitpoints = 0;
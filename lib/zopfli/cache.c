@@ -25,12 +25,17 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 
 #ifdef ZOPFLI_LONGEST_MATCH_CACHE
 
-void ZopfliInitCache(size_t blocksize, ZopfliLongestMatchCache* lmc) {
+void ZopfliInitCache(size_t blocksize, ZopfliWorkspace* workspace,
+                     ZopfliLongestMatchCache* lmc) {
   size_t i;
-  lmc->length = (unsigned short*)malloc(sizeof(unsigned short) * blocksize);
-  lmc->dist = (unsigned short*)malloc(sizeof(unsigned short) * blocksize);
+  lmc->workspace = workspace;
+  lmc->length = (unsigned short*)ZopfliWorkspaceAlloc(workspace,
+      sizeof(unsigned short) * blocksize);
+  lmc->dist = (unsigned short*)ZopfliWorkspaceAlloc(workspace,
+      sizeof(unsigned short) * blocksize);
   /* Rather large amount of memory. */
-  lmc->sublen = (unsigned char*)malloc(ZOPFLI_CACHE_LENGTH * 3 * blocksize);
+  lmc->sublen = (unsigned char*)ZopfliWorkspaceAlloc(workspace,
+      ZOPFLI_CACHE_LENGTH * 3 * blocksize);
   if(lmc->sublen == NULL) {
     fprintf(stderr,
         "Error: Out of memory. Tried allocating %lu bytes of memory.\n",
@@ -46,9 +51,9 @@ void ZopfliInitCache(size_t blocksize, ZopfliLongestMatchCache* lmc) {
 }
 
 void ZopfliCleanCache(ZopfliLongestMatchCache* lmc) {
-  free(lmc->length);
-  free(lmc->dist);
-  free(lmc->sublen);
+  ZopfliWorkspaceFree(lmc->workspace, lmc->length);
+  ZopfliWorkspaceFree(lmc->workspace, lmc->dist);
+  ZopfliWorkspaceFree(lmc->workspace, lmc->sublen);
 }
 
 void ZopfliSublenToCache(const unsigned short* sublen,
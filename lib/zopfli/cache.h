@@ -40,10 +40,15 @@ typedef struct ZopfliLongestMatchCache {
   unsigned short* length;
   unsigned short* dist;
   unsigned char* sublen;
+  ZopfliWorkspace* workspace;  /* Where the arrays are from, or NULL. */
 } ZopfliLongestMatchCache;
 
-/* Initializes the ZopfliLongestMatchCache. */
-void ZopfliInitCache(size_t blocksize, ZopfliLongestMatchCache* lmc);
+/*
+Initializes the ZopfliLongestMatchCache, the arrays are taken from the workspace
+if it isn't NULL.
+*/
+void ZopfliInitCache(size_t blocksize, ZopfliWorkspace* workspace,
+                     ZopfliLongestMatchCache* lmc);
 
 /* Frees up the memory of the ZopfliLongestMatchCache. */
 void ZopfliCleanCache(ZopfliLongestMatchCache* lmc);
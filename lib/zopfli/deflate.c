@@ -767,7 +767,7 @@ static void AddLZ77BlockAutoType(const ZopfliOptions* options, int final,
     AddBits(0, 7, bp, out, outsize);  /* end symbol has code 0000000 */
     return;
   }
-  ZopfliInitLZ77Store(lz77->data, &fixedstore);
+  ZopfliInitLZ77Store(lz77->data, options->workspace, &fixedstore);
   if (expensivefixed) {
     /* Recalculate the LZ77 with ZopfliLZ77OptimalFixed */
     size_t instart = lz77->pos[lstart];
@@ -808,39 +808,15 @@ previous bytes are used as the initial dictionary for LZ77.
 This function will usually output multiple deflate blocks. If final is 1, then
 the final bit will be set on the last block.
 */
-void ZopfliDeflatePart(const ZopfliOptions* options, int btype, int final,
+void ZopfliComputePart(const ZopfliOptions* options,
                        const unsigned char* in, size_t instart, size_t inend,
-                       unsigned char* bp, unsigned char** out,
-                       size_t* outsize) {
+                       ZopfliDeflatedPart* part) {
   size_t i;
   /* byte coordinates rather than lz77 index */
   size_t* splitpoints_uncompressed = 0;
   size_t npoints = 0;
   size_t* splitpoints = 0;
   double totalcost = 0;
-  ZopfliLZ77Store lz77;
-
-  /* If btype=2 is specified, it tries all block types. If a lesser btype is
-  given, then however it forces that one. Neither of the lesser types needs
-  block splitting as they have no dynamic huffman trees. */
-  if (btype == 0) {
-    AddNonCompressedBlock(options, final, in, instart, inend, bp, out, outsize);
-    return;
-  } else if (btype == 1) {
-    ZopfliLZ77Store store;
-    ZopfliBlockState s;
-    ZopfliInitLZ77Store(in, &store);
-    ZopfliInitBlockState(options, instart, inend, 1, &s);
-
-    ZopfliLZ77OptimalFixed(&s, in, instart, inend, &store);
-    AddLZ77Block(options, btype, final, &store, 0, store.size, 0,
-                 bp, out, outsize);
-
-    ZopfliCleanBlockState(&s);
-    ZopfliCleanLZ77Store(&store);
-    return;
-  }
-
 
   if (options->blocksplitting) {
     ZopfliBlockSplit(options, in, instart, inend,
@@ -849,20 +825,22 @@ void ZopfliDeflatePart(const ZopfliOptions* options, int btype, int final,
     splitpoints = (size_t*)malloc(sizeof(*splitpoints) * npoints);
   }
 
-  ZopfliInitLZ77Store(in, &lz77);
+  /* Not from the workspace, the part may be written and cleaned on another
+  thread. */
+  ZopfliInitLZ77Store(in, 0, &part->lz77);
 
   for (i = 0; i <= npoints; i++) {
     size_t start = i == 0 ? instart : splitpoints_uncompressed[i - 1];
     size_t end = i == npoints ? inend : splitpoints_uncompressed[i];
     ZopfliBlockState s;
     ZopfliLZ77Store store;
-    ZopfliInitLZ77Store(in, &store);
+    ZopfliInitLZ77Store(in, options->workspace, &store);
     ZopfliInitBlockState(options, start, end, 1, &s);
     ZopfliLZ77Optimal(&s, in, start, end, options->numiterations, &store);
     totalcost += ZopfliCalculateBlockSizeAutoType(&store, 0, store.size);
 
-    ZopfliAppendLZ77Store(&store, &lz77);
-    if (i < npoints) splitpoints[i] = lz77.size;
+    ZopfliAppendLZ77Store(&store, &part->lz77);
+    if (i < npoints) splitpoints[i] = part->lz77.size;
 
     ZopfliCleanBlockState(&s);
     ZopfliCleanLZ77Store(&store);
@@ -874,13 +852,13 @@ void ZopfliDeflatePart(const ZopfliOptions* options, int btype, int final,
     size_t npoints2 = 0;
     double totalcost2 = 0;
 
-    ZopfliBlockSplitLZ77(options, &lz77,
+    ZopfliBlockSplitLZ77(options, &part->lz77,
                          options->blocksplittingmax, &splitpoints2, &npoints2);
 
     for (i = 0; i <= npoints2; i++) {
       size_t start = i == 0 ? 0 : splitpoints2[i - 1];
-      size_t end = i == npoints2 ? lz77.size : splitpoints2[i];
-      totalcost2 += ZopfliCalculateBlockSizeAutoType(&lz77, start, end);
+      size_t end = i == npoints2 ? part->lz77.size : splitpoints2[i];
+      totalcost2 += ZopfliCalculateBlockSizeAutoType(&part->lz77, start, end);
     }
 
     if (totalcost2 < totalcost) {
@@ -892,17 +870,60 @@ void ZopfliDeflatePart(const ZopfliOptions* options, int btype, int final,
     }
   }
 
-  for (i = 0; i <= npoints; i++) {
-    size_t start = i == 0 ? 0 : splitpoints[i - 1];
-    size_t end = i == npoints ? lz77.size : splitpoints[i];
-    AddLZ77BlockAutoType(options, i == npoints && final,
-                         &lz77, start, end, 0,
+  part->splitpoints = splitpoints;
+  part->npoints = npoints;
+  free(splitpoints_uncompressed);
+}
+
+void ZopfliWritePart(const ZopfliOptions* options, int final,
+                     const ZopfliDeflatedPart* part,
+                     unsigned char* bp, unsigned char** out, size_t* outsize) {
+  size_t i;
+  for (i = 0; i <= part->npoints; i++) {
+    size_t start = i == 0 ? 0 : part->splitpoints[i - 1];
+    size_t end = i == part->npoints ? part->lz77.size : part->splitpoints[i];
+    AddLZ77BlockAutoType(options, i == part->npoints && final,
+                         &part->lz77, start, end, 0,
                          bp, out, outsize);
   }
+}
 
-  ZopfliCleanLZ77Store(&lz77);
-  free(splitpoints);
-  free(splitpoints_uncompressed);
+void ZopfliCleanPart(ZopfliDeflatedPart* part) {
+  ZopfliCleanLZ77Store(&part->lz77);
+  free(part->splitpoints);
+}
+
+void ZopfliDeflatePart(const ZopfliOptions* options, int btype, int final,
+                       const unsigned char* in, size_t instart, size_t inend,
+                       unsigned char* bp, unsigned char** out,
+                       size_t* outsize) {
+  ZopfliDeflatedPart part;
+
+  /* If btype=2 is specified, it tries all block types. If a lesser btype is
+  given, then however it forces that one. Neither of the lesser types needs
+  block splitting as they have no dynamic huffman trees. */
+  if (btype == 0) {
+    AddNonCompressedBlock(options, final, in, instart, inend, bp, out, outsize);
+    return;
+  } else if (btype == 1) {
+    ZopfliLZ77Store store;
+    ZopfliBlockState s;
+    ZopfliInitLZ77Store(in, options->workspace, &store);
+    ZopfliInitBlockState(options, instart, inend, 1, &s);
+
+    ZopfliLZ77OptimalFixed(&s, in, instart, inend, &store);
+    AddLZ77Block(options, btype, final, &store, 0, store.size, 0,
+                 bp, out, outsize);
+
+    ZopfliCleanBlockState(&s);
+    ZopfliCleanLZ77Store(&store);
+    return;
+  }
+
+
+  ZopfliComputePart(options, in, instart, inend, &part);
+  ZopfliWritePart(options, final, &part, bp, out, outsize);
+  ZopfliCleanPart(&part);
 }
 
 void ZopfliDeflate(const ZopfliOptions* options, int btype, int final,
@@ -914,9 +935,9 @@ void ZopfliDeflate(const ZopfliOptions* options, int btype, int final,
 #else
   size_t i = 0;
   do {
-    int masterfinal = (i + ZOPFLI_MASTER_BLOCK_SIZE >= insize);
+    int masterfinal = (i + options->masterblocksize >= insize);
     int final2 = final && masterfinal;
-    size_t size = masterfinal ? insize - i : ZOPFLI_MASTER_BLOCK_SIZE;
+    size_t size = masterfinal ? insize - i : options->masterblocksize;
     ZopfliDeflatePart(options, btype, final2,
                       in, i, i + size, bp, out, outsize);
     i += size;
@@ -69,6 +69,36 @@ void ZopfliDeflatePart(const ZopfliOptions* options, int btype, int final,
                        unsigned char* bp, unsigned char** out,
                        size_t* outsize);
 
+/*
+LZ77 data and block split points of a part of the input, the result of the
+slow steps of ZopfliDeflatePart with btype 2. The parts of one input can be
+computed independently, e.g. on different threads, as long as they are written
+in order, because only writing depends on the bit pointer.
+*/
+typedef struct ZopfliDeflatedPart {
+  ZopfliLZ77Store lz77;
+  size_t* splitpoints;  /* lz77 indices where the blocks start */
+  size_t npoints;
+} ZopfliDeflatedPart;
+
+/*
+Finds the LZ77 data and the blocks of the input from instart to inend. The
+part must be cleaned up with ZopfliCleanPart.
+*/
+void ZopfliComputePart(const ZopfliOptions* options,
+                       const unsigned char* in, size_t instart, size_t inend,
+                       ZopfliDeflatedPart* part);
+
+/*
+Appends the blocks of a computed part to the output, as ZopfliDeflatePart
+would with btype 2.
+*/
+void ZopfliWritePart(const ZopfliOptions* options, int final,
+                     const ZopfliDeflatedPart* part,
+                     unsigned char* bp, unsigned char** out, size_t* outsize);
+
+void ZopfliCleanPart(ZopfliDeflatedPart* part);
+
 /*
 Calculates block size in bits.
 litlens: lz77 lit/lengths
@@ -26,19 +26,28 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 #define HASH_SHIFT 5
 #define HASH_MASK 32767
 
-void ZopfliAllocHash(size_t window_size, ZopfliHash* h) {
-  h->head = (int*)malloc(sizeof(*h->head) * 65536);
-  h->prev = (unsigned short*)malloc(sizeof(*h->prev) * window_size);
-  h->hashval = (int*)malloc(sizeof(*h->hashval) * window_size);
+void ZopfliAllocHash(size_t window_size, ZopfliWorkspace* workspace,
+                     ZopfliHash* h) {
+  h->workspace = workspace;
+  h->head = (int*)ZopfliWorkspaceAlloc(workspace,
+      sizeof(*h->head) * 65536);
+  h->prev = (unsigned short*)ZopfliWorkspaceAlloc(workspace,
+      sizeof(*h->prev) * window_size);
+  h->hashval = (int*)ZopfliWorkspaceAlloc(workspace,
+      sizeof(*h->hashval) * window_size);
 
 #ifdef ZOPFLI_HASH_SAME
-  h->same = (unsigned short*)malloc(sizeof(*h->same) * window_size);
+  h->same = (unsigned short*)ZopfliWorkspaceAlloc(workspace,
+      sizeof(*h->same) * window_size);
 #endif
 
 #ifdef ZOPFLI_HASH_SAME_HASH
-  h->head2 = (int*)malloc(sizeof(*h->head2) * 65536);
-  h->prev2 = (unsigned short*)malloc(sizeof(*h->prev2) * window_size);
-  h->hashval2 = (int*)malloc(sizeof(*h->hashval2) * window_size);
+  h->head2 = (int*)ZopfliWorkspaceAlloc(workspace,
+      sizeof(*h->head2) * 65536);
+  h->prev2 = (unsigned short*)ZopfliWorkspaceAlloc(workspace,
+      sizeof(*h->prev2) * window_size);
+  h->hashval2 = (int*)ZopfliWorkspaceAlloc(workspace,
+      sizeof(*h->hashval2) * window_size);
 #endif
 }
 
@@ -73,18 +82,18 @@ void ZopfliResetHash(size_t window_size, ZopfliHash* h) {
 }
 
 void ZopfliCleanHash(ZopfliHash* h) {
-  free(h->head);
-  free(h->prev);
-  free(h->hashval);
+  ZopfliWorkspaceFree(h->workspace, h->head);
+  ZopfliWorkspaceFree(h->workspace, h->prev);
+  ZopfliWorkspaceFree(h->workspace, h->hashval);
 
 #ifdef ZOPFLI_HASH_SAME_HASH
-  free(h->head2);
-  free(h->prev2);
-  free(h->hashval2);
+  ZopfliWorkspaceFree(h->workspace, h->head2);
+  ZopfliWorkspaceFree(h->workspace, h->prev2);
+  ZopfliWorkspaceFree(h->workspace, h->hashval2);
 #endif
 
 #ifdef ZOPFLI_HASH_SAME
-  free(h->same);
+  ZopfliWorkspaceFree(h->workspace, h->same);
 #endif
 }
 
@@ -44,10 +44,13 @@ typedef struct ZopfliHash {
 #ifdef ZOPFLI_HASH_SAME
   unsigned short* same;  /* Amount of repetitions of same byte after this .*/
 #endif
+
+  ZopfliWorkspace* workspace;  /* Where the arrays are from, or NULL. */
 } ZopfliHash;
 
-/* Allocates ZopfliHash memory. */
-void ZopfliAllocHash(size_t window_size, ZopfliHash* h);
+/* Allocates ZopfliHash memory, from the workspace if it isn't NULL. */
+void ZopfliAllocHash(size_t window_size, ZopfliWorkspace* workspace,
+                     ZopfliHash* h);
 
 /* Resets all fields of ZopfliHash. */
 void ZopfliResetHash(size_t window_size, ZopfliHash* h);
@@ -25,7 +25,8 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 #include <stdio.h>
 #include <stdlib.h>
 
-void ZopfliInitLZ77Store(const unsigned char* data, ZopfliLZ77Store* store) {
+void ZopfliInitLZ77Store(const unsigned char* data, ZopfliWorkspace* workspace,
+                         ZopfliLZ77Store* store) {
   store->size = 0;
   store->litlens = 0;
   store->dists = 0;
@@ -35,16 +36,18 @@ void ZopfliInitLZ77Store(const unsigned char* data, ZopfliLZ77Store* store) {
   store->d_symbol = 0;
   store->ll_counts = 0;
   store->d_counts = 0;
+  store->capacity = 0;
+  store->workspace = workspace;
 }
 
 void ZopfliCleanLZ77Store(ZopfliLZ77Store* store) {
-  free(store->litlens);
-  free(store->dists);
-  free(store->pos);
-  free(store->ll_symbol);
-  free(store->d_symbol);
-  free(store->ll_counts);
-  free(store->d_counts);
+  ZopfliWorkspaceFree(store->workspace, store->litlens);
+  ZopfliWorkspaceFree(store->workspace, store->dists);
+  ZopfliWorkspaceFree(store->workspace, store->pos);
+  ZopfliWorkspaceFree(store->workspace, store->ll_symbol);
+  ZopfliWorkspaceFree(store->workspace, store->d_symbol);
+  ZopfliWorkspaceFree(store->workspace, store->ll_counts);
+  ZopfliWorkspaceFree(store->workspace, store->d_counts);
 }
 
 static size_t CeilDiv(size_t a, size_t b) {
@@ -56,18 +59,23 @@ void ZopfliCopyLZ77Store(
   size_t i;
   size_t llsize = ZOPFLI_NUM_LL * CeilDiv(source->size, ZOPFLI_NUM_LL);
   size_t dsize = ZOPFLI_NUM_D * CeilDiv(source->size, ZOPFLI_NUM_D);
+  ZopfliWorkspace* workspace = dest->workspace;
   ZopfliCleanLZ77Store(dest);
-  ZopfliInitLZ77Store(source->data, dest);
-  dest->litlens =
-      (unsigned short*)malloc(sizeof(*dest->litlens) * source->size);
-  dest->dists = (unsigned short*)malloc(sizeof(*dest->dists) * source->size);
-  dest->pos = (size_t*)malloc(sizeof(*dest->pos) * source->size);
-  dest->ll_symbol =
-      (unsigned short*)malloc(sizeof(*dest->ll_symbol) * source->size);
-  dest->d_symbol =
-      (unsigned short*)malloc(sizeof(*dest->d_symbol) * source->size);
-  dest->ll_counts = (size_t*)malloc(sizeof(*dest->ll_counts) * llsize);
-  dest->d_counts = (size_t*)malloc(sizeof(*dest->d_counts) * dsize);
+  ZopfliInitLZ77Store(source->data, workspace, dest);
+  dest->litlens = (unsigned short*)ZopfliWorkspaceAlloc(workspace,
+      sizeof(*dest->litlens) * source->size);
+  dest->dists = (unsigned short*)ZopfliWorkspaceAlloc(workspace,
+      sizeof(*dest->dists) * source->size);
+  dest->pos = (size_t*)ZopfliWorkspaceAlloc(workspace,
+      sizeof(*dest->pos) * source->size);
+  dest->ll_symbol = (unsigned short*)ZopfliWorkspaceAlloc(workspace,
+      sizeof(*dest->ll_symbol) * source->size);
+  dest->d_symbol = (unsigned short*)ZopfliWorkspaceAlloc(workspace,
+      sizeof(*dest->d_symbol) * source->size);
+  dest->ll_counts = (size_t*)ZopfliWorkspaceAlloc(workspace,
+      sizeof(*dest->ll_counts) * llsize);
+  dest->d_counts = (size_t*)ZopfliWorkspaceAlloc(workspace,
+      sizeof(*dest->d_counts) * dsize);
 
   /* Allocation failed. */
   if (!dest->litlens || !dest->dists) exit(-1);
@@ -76,6 +84,7 @@ void ZopfliCopyLZ77Store(
   if (!dest->ll_counts || !dest->d_counts) exit(-1);
 
   dest->size = source->size;
+  dest->capacity = source->size;
   for (i = 0; i < source->size; i++) {
     dest->litlens[i] = source->litlens[i];
     dest->dists[i] = source->dists[i];
@@ -91,6 +100,50 @@ void ZopfliCopyLZ77Store(
   }
 }
 
+/*
+Doubles the capacity of all arrays of the store at once, instead of growing each
+of them separately for every symbol.
+*/
+static void GrowLZ77Store(ZopfliLZ77Store* store) {
+  ZopfliWorkspace* workspace = store->workspace;
+  size_t size = store->size;
+  size_t capacity = store->capacity == 0 ? ZOPFLI_NUM_LL : store->capacity * 2;
+  size_t llsize = ZOPFLI_NUM_LL * CeilDiv(size, ZOPFLI_NUM_LL);
+  size_t dsize = ZOPFLI_NUM_D * CeilDiv(size, ZOPFLI_NUM_D);
+  size_t llcapacity = ZOPFLI_NUM_LL * CeilDiv(capacity, ZOPFLI_NUM_LL);
+  size_t dcapacity = ZOPFLI_NUM_D * CeilDiv(capacity, ZOPFLI_NUM_D);
+
+  store->litlens = (unsigned short*)ZopfliWorkspaceRealloc(workspace,
+      store->litlens, sizeof(*store->litlens) * size,
+      sizeof(*store->litlens) * capacity);
+  store->dists = (unsigned short*)ZopfliWorkspaceRealloc(workspace,
+      store->dists, sizeof(*store->dists) * size,
+      sizeof(*store->dists) * capacity);
+  store->pos = (size_t*)ZopfliWorkspaceRealloc(workspace,
+      store->pos, sizeof(*store->pos) * size,
+      sizeof(*store->pos) * capacity);
+  store->ll_symbol = (unsigned short*)ZopfliWorkspaceRealloc(workspace,
+      store->ll_symbol, sizeof(*store->ll_symbol) * size,
+      sizeof(*store->ll_symbol) * capacity);
+  store->d_symbol = (unsigned short*)ZopfliWorkspaceRealloc(workspace,
+      store->d_symbol, sizeof(*store->d_symbol) * size,
+      sizeof(*store->d_symbol) * capacity);
+  store->ll_counts = (size_t*)ZopfliWorkspaceRealloc(workspace,
+      store->ll_counts, sizeof(*store->ll_counts) * llsize,
+      sizeof(*store->ll_counts) * llcapacity);
+  store->d_counts = (size_t*)ZopfliWorkspaceRealloc(workspace,
+      store->d_counts, sizeof(*store->d_counts) * dsize,
+      sizeof(*store->d_counts) * dcapacity);
+
+  /* Allocation failed. */
+  if (!store->litlens || !store->dists) exit(-1);
+  if (!store->pos) exit(-1);
+  if (!store->ll_symbol || !store->d_symbol) exit(-1);
+  if (!store->ll_counts || !store->d_counts) exit(-1);
+
+  store->capacity = capacity;
+}
+
 /*
 Appends the length and distance to the LZ77 arrays of the ZopfliLZ77Store.
 context must be a ZopfliLZ77Store*.
@@ -98,54 +151,44 @@ context must be a ZopfliLZ77Store*.
 void ZopfliStoreLitLenDist(unsigned short length, unsigned short dist,
                            size_t pos, ZopfliLZ77Store* store) {
   size_t i;
-  /* Needed for using ZOPFLI_APPEND_DATA multiple times. */
   size_t origsize = store->size;
   size_t llstart = ZOPFLI_NUM_LL * (origsize / ZOPFLI_NUM_LL);
   size_t dstart = ZOPFLI_NUM_D * (origsize / ZOPFLI_NUM_D);
 
+  if (origsize == store->capacity) GrowLZ77Store(store);
+
   /* Everytime the index wraps around, a new cumulative histogram is made: we're
   keeping one histogram value per LZ77 symbol rather than a full histogram for
   each to save memory. */
   if (origsize % ZOPFLI_NUM_LL == 0) {
-    size_t llsize = origsize;
     for (i = 0; i < ZOPFLI_NUM_LL; i++) {
-      ZOPFLI_APPEND_DATA(
-          origsize == 0 ? 0 : store->ll_counts[origsize - ZOPFLI_NUM_LL + i],
-          &store->ll_counts, &llsize);
+      store->ll_counts[origsize + i] =
+          origsize == 0 ? 0 : store->ll_counts[origsize - ZOPFLI_NUM_LL + i];
     }
   }
   if (origsize % ZOPFLI_NUM_D == 0) {
-    size_t dsize = origsize;
     for (i = 0; i < ZOPFLI_NUM_D; i++) {
-      ZOPFLI_APPEND_DATA(
-          origsize == 0 ? 0 : store->d_counts[origsize - ZOPFLI_NUM_D + i],
-          &store->d_counts, &dsize);
+      store->d_counts[origsize + i] =
+          origsize == 0 ? 0 : store->d_counts[origsize - ZOPFLI_NUM_D + i];
     }
   }
 
-  ZOPFLI_APPEND_DATA(length, &store->litlens, &store->size);
-  store->size = origsize;
-  ZOPFLI_APPEND_DATA(dist, &store->dists, &store->size);
-  store->size = origsize;
-  ZOPFLI_APPEND_DATA(pos, &store->pos, &store->size);
+  store->litlens[origsize] = length;
+  store->dists[origsize] = dist;
+  store->pos[origsize] = pos;
   assert(length < 259);
 
   if (dist == 0) {
-    store->size = origsize;
-    ZOPFLI_APPEND_DATA(length, &store->ll_symbol, &store->size);
-    store->size = origsize;
-    ZOPFLI_APPEND_DATA(0, &store->d_symbol, &store->size);
+    store->ll_symbol[origsize] = length;
+    store->d_symbol[origsize] = 0;
     store->ll_counts[llstart + length]++;
   } else {
-    store->size = origsize;
-    ZOPFLI_APPEND_DATA(ZopfliGetLengthSymbol(length),
-                       &store->ll_symbol, &store->size);
-    store->size = origsize;
-    ZOPFLI_APPEND_DATA(ZopfliGetDistSymbol(dist),
-                       &store->d_symbol, &store->size);
+    store->ll_symbol[origsize] = ZopfliGetLengthSymbol(length);
+    store->d_symbol[origsize] = ZopfliGetDistSymbol(dist);
     store->ll_counts[llstart + ZopfliGetLengthSymbol(length)]++;
     store->d_counts[dstart + ZopfliGetDistSymbol(dist)]++;
   }
+  store->size = origsize + 1;
 }
 
 void ZopfliAppendLZ77Store(const ZopfliLZ77Store* store,
@@ -225,7 +268,7 @@ void ZopfliInitBlockState(const ZopfliOptions* options,
 #ifdef ZOPFLI_LONGEST_MATCH_CACHE
   if (add_lmc) {
     s->lmc = (ZopfliLongestMatchCache*)malloc(sizeof(ZopfliLongestMatchCache));
-    ZopfliInitCache(blockend - blockstart, s->lmc);
+    ZopfliInitCache(blockend - blockstart, options->workspace, s->lmc);
   } else {
     s->lmc = 0;
   }
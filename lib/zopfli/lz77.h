@@ -59,9 +59,14 @@ typedef struct ZopfliLZ77Store {
   looping through the actual symbols of this chunk. */
   size_t* ll_counts;
   size_t* d_counts;
+
+  size_t capacity;  /* Amount of symbols the arrays have room for. */
+  ZopfliWorkspace* workspace;  /* Where the arrays are from, or NULL. */
 } ZopfliLZ77Store;
 
-void ZopfliInitLZ77Store(const unsigned char* data, ZopfliLZ77Store* store);
+/* The arrays are taken from the workspace if it isn't NULL. */
+void ZopfliInitLZ77Store(const unsigned char* data, ZopfliWorkspace* workspace,
+                         ZopfliLZ77Store* store);
 void ZopfliCleanLZ77Store(ZopfliLZ77Store* store);
 void ZopfliCopyLZ77Store(const ZopfliLZ77Store* source, ZopfliLZ77Store* dest);
 void ZopfliStoreLitLenDist(unsigned short length, unsigned short dist,
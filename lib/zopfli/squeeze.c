@@ -450,7 +450,8 @@ void ZopfliLZ77Optimal(ZopfliBlockState *s,
   /* Dist to get to here with smallest cost. */
   size_t blocksize = inend - instart;
   unsigned short* length_array =
-      (unsigned short*)malloc(sizeof(unsigned short) * (blocksize + 1));
+      (unsigned short*)ZopfliWorkspaceAlloc(s->options->workspace,
+          sizeof(unsigned short) * (blocksize + 1));
   unsigned short* path = 0;
   size_t pathsize = 0;
   ZopfliLZ77Store currentstore;
@@ -458,21 +459,25 @@ void ZopfliLZ77Optimal(ZopfliBlockState *s,
   ZopfliHash* h = &hash;
   SymbolStats stats, beststats, laststats;
   int i;
-  float* costs = (float*)malloc(sizeof(float) * (blocksize + 1));
+  float* costs = (float*)ZopfliWorkspaceAlloc(s->options->workspace,
+      sizeof(float) * (blocksize + 1));
   double cost;
   double bestcost = ZOPFLI_LARGE_FLOAT;
   double lastcost = 0;
   /* Try randomizing the costs a bit once the size stabilizes. */
   RanState ran_state;
   int lastrandomstep = -1;
+  /* Cost and iteration of the last improvement above the threshold. */
+  double convergedcost = ZOPFLI_LARGE_FLOAT;
+  int lastimprovement = 0;
 
   if (!costs) exit(-1); /* Allocation failed. */
   if (!length_array) exit(-1); /* Allocation failed. */
 
   InitRanState(&ran_state);
   InitStats(&stats);
-  ZopfliInitLZ77Store(in, &currentstore);
-  ZopfliAllocHash(ZOPFLI_WINDOW_SIZE, h);
+  ZopfliInitLZ77Store(in, s->options->workspace, &currentstore);
+  ZopfliAllocHash(ZOPFLI_WINDOW_SIZE, s->options->workspace, h);
 
   /* Do regular deflate, then loop multiple shortest path runs, each time using
   the statistics of the previous run. */
@@ -485,7 +490,7 @@ void ZopfliLZ77Optimal(ZopfliBlockState *s,
   run. */
   for (i = 0; i < numiterations; i++) {
     ZopfliCleanLZ77Store(&currentstore);
-    ZopfliInitLZ77Store(in, &currentstore);
+    ZopfliInitLZ77Store(in, s->options->workspace, &currentstore);
     LZ77OptimalRun(s, in, instart, inend, &path, &pathsize,
                    length_array, GetCostStat, (void*)&stats,
                    &currentstore, h, costs);
@@ -499,6 +504,16 @@ void ZopfliLZ77Optimal(ZopfliBlockState *s,
       CopyStats(&stats, &beststats);
       bestcost = cost;
     }
+    if (cost < convergedcost * (1 - s->options->convergencethreshold)) {
+      convergedcost = cost;
+      lastimprovement = i;
+    } else if (s->options->convergenceiterations > 0 &&
+               i - lastimprovement >= s->options->convergenceiterations) {
+      if (s->options->verbose_more) {
+        fprintf(stderr, "Converged after %d iterations\n", i + 1);
+      }
+      break;
+    }
     CopyStats(&stats, &laststats);
     ClearStatFreqs(&stats);
     GetStatistics(&currentstore, &stats);
@@ -518,9 +533,9 @@ void ZopfliLZ77Optimal(ZopfliBlockState *s,
     lastcost = cost;
   }
 
-  free(length_array);
+  ZopfliWorkspaceFree(s->options->workspace, length_array);
   free(path);
-  free(costs);
+  ZopfliWorkspaceFree(s->options->workspace, costs);
   ZopfliCleanLZ77Store(&currentstore);
   ZopfliCleanHash(h);
 }
@@ -533,17 +548,19 @@ void ZopfliLZ77OptimalFixed(ZopfliBlockState *s,
   /* Dist to get to here with smallest cost. */
   size_t blocksize = inend - instart;
   unsigned short* length_array =
-      (unsigned short*)malloc(sizeof(unsigned short) * (blocksize + 1));
+      (unsigned short*)ZopfliWorkspaceAlloc(s->options->workspace,
+          sizeof(unsigned short) * (blocksize + 1));
   unsigned short* path = 0;
   size_t pathsize = 0;
   ZopfliHash hash;
   ZopfliHash* h = &hash;
-  float* costs = (float*)malloc(sizeof(float) * (blocksize + 1));
+  float* costs = (float*)ZopfliWorkspaceAlloc(s->options->workspace,
+      sizeof(float) * (blocksize + 1));
 
   if (!costs) exit(-1); /* Allocation failed. */
   if (!length_array) exit(-1); /* Allocation failed. */
 
-  ZopfliAllocHash(ZOPFLI_WINDOW_SIZE, h);
+  ZopfliAllocHash(ZOPFLI_WINDOW_SIZE, s->options->workspace, h);
 
   s->blockstart = instart;
   s->blockend = inend;
@@ -553,8 +570,8 @@ void ZopfliLZ77OptimalFixed(ZopfliBlockState *s,
   LZ77OptimalRun(s, in, instart, inend, &path, &pathsize,
                  length_array, GetCostFixed, 0, store, h, costs);
 
-  free(length_array);
+  ZopfliWorkspaceFree(s->options->workspace, length_array);
   free(path);
-  free(costs);
+  ZopfliWorkspaceFree(s->options->workspace, costs);
   ZopfliCleanHash(h);
 }
@@ -32,4 +32,123 @@ void ZopfliInitOptions(ZopfliOptions* options) {
   options->blocksplitting = 1;
   options->blocksplittinglast = 0;
   options->blocksplittingmax = 15;
+  options->convergenceiterations = 0;
+  options->convergencethreshold = 0.0001;
+  options->masterblocksize = ZOPFLI_MASTER_BLOCK_SIZE;
+  options->workspace = 0;
+}
+
+/* Most buffers a workspace keeps track of, in use or not. */
+#define ZOPFLI_WORKSPACE_BUFFERS 64
+
+typedef struct ZopfliBuffer {
+  void* data;  /* 0 if this entry is empty */
+  size_t size;
+  int inuse;
+} ZopfliBuffer;
+
+struct ZopfliWorkspace {
+  size_t maxretained;
+  size_t retained;  /* Total size of the buffers that are not in use. */
+  ZopfliBuffer buffers[ZOPFLI_WORKSPACE_BUFFERS];
+};
+
+ZopfliWorkspace* ZopfliCreateWorkspace(size_t maxretained) {
+  ZopfliWorkspace* workspace =
+      (ZopfliWorkspace*)calloc(1, sizeof(ZopfliWorkspace));
+  if (!workspace) exit(-1); /* Allocation failed. */
+  workspace->maxretained = maxretained;
+  return workspace;
+}
+
+void ZopfliDestroyWorkspace(ZopfliWorkspace* workspace) {
+  size_t i;
+  if (!workspace) return;
+  for (i = 0; i < ZOPFLI_WORKSPACE_BUFFERS; i++) {
+    free(workspace->buffers[i].data);
+  }
+  free(workspace);
+}
+
+static ZopfliBuffer* FindBuffer(ZopfliWorkspace* workspace, void* data) {
+  size_t i;
+  for (i = 0; i < ZOPFLI_WORKSPACE_BUFFERS; i++) {
+    if (workspace->buffers[i].data == data) return &workspace->buffers[i];
+  }
+  return 0;
+}
+
+void* ZopfliWorkspaceAlloc(ZopfliWorkspace* workspace, size_t size) {
+  size_t i;
+  ZopfliBuffer* best = 0;
+  ZopfliBuffer* entry = 0;
+  void* data;
+  if (!workspace) return malloc(size);
+
+  /* The smallest kept buffer that is large enough. */
+  for (i = 0; i < ZOPFLI_WORKSPACE_BUFFERS; i++) {
+    ZopfliBuffer* buffer = &workspace->buffers[i];
+    if (buffer->data && !buffer->inuse && buffer->size >= size &&
+        (!best || buffer->size < best->size)) {
+      best = buffer;
+    }
+  }
+  if (best) {
+    best->inuse = 1;
+    workspace->retained -= best->size;
+    return best->data;
+  }
+
+  data = malloc(size);
+  if (!data) return 0;
+  /* Keep track of it in an empty entry, or in place of a buffer not in use,
+  otherwise it is simply freed later. */
+  entry = FindBuffer(workspace, 0);
+  for (i = 0; !entry && i < ZOPFLI_WORKSPACE_BUFFERS; i++) {
+    if (!workspace->buffers[i].inuse) {
+      entry = &workspace->buffers[i];
+      workspace->retained -= entry->size;
+      free(entry->data);
+    }
+  }
+  if (entry) {
+    entry->data = data;
+    entry->size = size;
+    entry->inuse = 1;
+  }
+  return data;
+}
+
+void* ZopfliWorkspaceRealloc(ZopfliWorkspace* workspace, void* buffer,
+                             size_t used, size_t size) {
+  ZopfliBuffer* entry;
+  void* data;
+  if (!workspace) return realloc(buffer, size);
+  if (!buffer) return ZopfliWorkspaceAlloc(workspace, size);
+
+  entry = FindBuffer(workspace, buffer);
+  if (!entry) return realloc(buffer, size);
+  if (entry->size >= size) return buffer;
+
+  data = ZopfliWorkspaceAlloc(workspace, size);
+  if (!data) return 0;
+  memcpy(data, buffer, used);
+  ZopfliWorkspaceFree(workspace, buffer);
+  return data;
+}
+
+void ZopfliWorkspaceFree(ZopfliWorkspace* workspace, void* buffer) {
+  ZopfliBuffer* entry;
+  if (!buffer) return;
+  entry = workspace ? FindBuffer(workspace, buffer) : 0;
+  if (!entry) {
+    free(buffer);
+  } else if (workspace->retained + entry->size <= workspace->maxretained) {
+    entry->inuse = 0;
+    workspace->retained += entry->size;
+  } else {
+    free(entry->data);
+    entry->data = 0;
+    entry->inuse = 0;
+  }
 }
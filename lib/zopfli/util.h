@@ -28,6 +28,8 @@ basic deflate specification values and generic program options.
 #include <string.h>
 #include <stdlib.h>
 
+#include "zopfli.h"
+
 /* Minimum and maximum length that can be encoded in deflate. */
 #define ZOPFLI_MAX_MATCH 258
 #define ZOPFLI_MIN_MATCH 3
@@ -154,5 +156,25 @@ equal than *size.
 }
 #endif
 
+/*
+Allocates size bytes like malloc, reusing a buffer the workspace keeps if one is
+large enough. Without a workspace (NULL) this is malloc.
+*/
+void* ZopfliWorkspaceAlloc(ZopfliWorkspace* workspace, size_t size);
+
+/*
+Resizes a buffer of ZopfliWorkspaceAlloc to size bytes like realloc, only the
+first used bytes are kept. Doesn't move it if the buffer was large enough
+already. Without a workspace (NULL) this is realloc.
+*/
+void* ZopfliWorkspaceRealloc(ZopfliWorkspace* workspace, void* buffer,
+                             size_t used, size_t size);
+
+/*
+Gives a buffer of ZopfliWorkspaceAlloc back to the workspace to be reused, or
+frees it if the workspace already keeps enough. Without a workspace (NULL) this
+is free.
+*/
+void ZopfliWorkspaceFree(ZopfliWorkspace* workspace, void* buffer);
 
 #endif  /* ZOPFLI_UTIL_H_ */
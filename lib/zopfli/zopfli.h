@@ -27,6 +27,23 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 extern "C" {
 #endif
 
+/*
+Buffers kept between compressions: the hash tables, the longest match cache and
+the arrays of the LZ77 stores. Compressing many small inputs with the same
+workspace doesn't allocate them again every time. A workspace must only be used
+by one thread at a time.
+*/
+typedef struct ZopfliWorkspace ZopfliWorkspace;
+
+/*
+Creates a workspace that keeps up to maxretained bytes of buffers that are not
+in use, larger buffers are freed as usual.
+*/
+ZopfliWorkspace* ZopfliCreateWorkspace(size_t maxretained);
+
+/* Frees the workspace and all the buffers it keeps. */
+void ZopfliDestroyWorkspace(ZopfliWorkspace* workspace);
+
 /*
 Options used throughout the program.
 */
@@ -61,6 +78,28 @@ typedef struct ZopfliOptions {
   extreme results that hurt compression on some files). Default value: 15.
   */
   int blocksplittingmax;
+
+  /*
+  Stop iterating early if the cost of the block hasn't improved by more than
+  convergencethreshold (a fraction of the cost) in the last
+  convergenceiterations iterations, numiterations is the maximum then. 0 to
+  always do numiterations iterations. Default: 0.
+  */
+  int convergenceiterations;
+  double convergencethreshold;
+
+  /*
+  Size of the master blocks the input is split into and compressed one by one.
+  The memory used is proportional to it, smaller blocks use less memory but
+  compress a bit worse. Default: ZOPFLI_MASTER_BLOCK_SIZE.
+  */
+  size_t masterblocksize;
+
+  /*
+  Workspace to take the buffers from, see ZopfliWorkspace. Default: NULL, the
+  buffers are allocated for every block.
+  */
+  ZopfliWorkspace* workspace;
 } ZopfliOptions;
 
 /* Initializes options with default values. */
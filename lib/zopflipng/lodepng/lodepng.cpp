@@ -5613,6 +5613,15 @@ static unsigned addUnknownChunks(ucvector* out, unsigned char* data, size_t data
 }
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
+unsigned lodepng_filter_scanlines(unsigned char** out, size_t* outsize,
+                                  const unsigned char* image, unsigned w, unsigned h,
+                                  const LodePNGInfo* info_png, const LodePNGEncoderSettings* settings)
+{
+  *out = 0;
+  *outsize = 0;
+  return preProcessScanlines(out, outsize, image, w, h, info_png, settings);
+}
+
 unsigned lodepng_encode(unsigned char** out, size_t* outsize,
                         const unsigned char* image, unsigned w, unsigned h,
                         LodePNGState* state)
@@ -667,6 +667,16 @@ unsigned lodepng_inspect(unsigned* w, unsigned* h,
 unsigned lodepng_encode(unsigned char** out, size_t* outsize,
                         const unsigned char* image, unsigned w, unsigned h,
                         LodePNGState* state);
+
+/*
+Pads, interlaces and filters the image the same way lodepng_encode does before compressing it, and
+gives the uncompressed IDAT data, e.g. to compare filter strategies without compressing anything.
+The image must already be in the color type of info_png, no color conversion is done.
+This function allocates the out buffer with standard malloc and stores the size in *outsize.
+*/
+unsigned lodepng_filter_scanlines(unsigned char** out, size_t* outsize,
+                                  const unsigned char* image, unsigned w, unsigned h,
+                                  const LodePNGInfo* info_png, const LodePNGEncoderSettings* settings);
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 /*
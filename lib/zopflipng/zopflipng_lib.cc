@@ -23,6 +23,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <algorithm>
+#include <cmath>
+#include <iostream>
 #include <set>
 #include <vector>
 
@@ -35,9 +38,13 @@ ZopfliPNGOptions::ZopfliPNGOptions()
   , lossy_transparent(false)
   , lossy_8bit(false)
   , auto_filter_strategy(true)
+  , num_auto_filter_strategies(1)
+  , custom_inflate(nullptr)
   , use_zopfli(true)
   , num_iterations(15)
   , num_iterations_large(5)
+  , convergence_iterations(0)
+  , master_block_size(0)
   , block_split_strategy(1) {
 }
 
@@ -55,6 +62,9 @@ unsigned CustomPNGDeflate(unsigned char** out, size_t* outsize,
   options.verbose = png_options->verbose;
   options.numiterations = insize < 200000
       ? png_options->num_iterations : png_options->num_iterations_large;
+  options.convergenceiterations = png_options->convergence_iterations;
+  if (png_options->master_block_size)
+    options.masterblocksize = png_options->master_block_size;
 
   ZopfliDeflate(&options, 2 /* Dynamic */, 1, in, insize, &bp, out, outsize);
 
@@ -154,73 +164,94 @@ void LossyOptimizeTransparent(lodepng::State* inputstate, unsigned char* image,
   }
 }
 
-// Tries to optimize given a single PNG filter strategy.
-// Returns 0 if ok, other value for error
-unsigned TryOptimize(
-    const std::vector<unsigned char>& image, unsigned w, unsigned h,
-    const lodepng::State& inputstate, bool bit16, bool keep_colortype,
-    const std::vector<unsigned char>& origfile,
-    ZopfliPNGFilterStrategy filterstrategy,
-    bool use_zopfli, int windowsize, const ZopfliPNGOptions* png_options,
-    std::vector<unsigned char>* out) {
-  unsigned error = 0;
-
-  lodepng::State state;
-  state.encoder.zlibsettings.windowsize = windowsize;
-  if (use_zopfli && png_options->use_zopfli) {
-    state.encoder.zlibsettings.custom_deflate = CustomPNGDeflate;
-    state.encoder.zlibsettings.custom_context = png_options;
-  }
-
+// Sets up the color modes of the encoder for the image decoded from the input.
+static void InitEncoderState(const lodepng::State& inputstate, bool bit16,
+                             bool keep_colortype, lodepng::State* state) {
   if (keep_colortype) {
-    state.encoder.auto_convert = 0;
-    lodepng_color_mode_copy(&state.info_png.color, &inputstate.info_png.color);
+    state->encoder.auto_convert = 0;
+    lodepng_color_mode_copy(&state->info_png.color, &inputstate.info_png.color);
   }
   if (inputstate.info_png.color.colortype == LCT_PALETTE) {
     // Make it preserve the original palette order
-    lodepng_color_mode_copy(&state.info_raw, &inputstate.info_png.color);
-    state.info_raw.colortype = LCT_RGBA;
-    state.info_raw.bitdepth = 8;
+    lodepng_color_mode_copy(&state->info_raw, &inputstate.info_png.color);
+    state->info_raw.colortype = LCT_RGBA;
+    state->info_raw.bitdepth = 8;
   }
   if (bit16) {
-    state.info_raw.bitdepth = 16;
+    state->info_raw.bitdepth = 16;
   }
 
-  state.encoder.filter_palette_zero = 0;
+  state->encoder.filter_palette_zero = 0;
+}
 
-  std::vector<unsigned char> filters;
+// Sets the filter strategy of the encoder, filters keeps the predefined
+// filters and must outlive the encoder.
+// Returns 0 if ok, other value for error
+static unsigned SetFilterStrategy(ZopfliPNGFilterStrategy filterstrategy,
+                                  unsigned h,
+                                  const std::vector<unsigned char>& origfile,
+                                  std::vector<unsigned char>* filters,
+                                  LodePNGEncoderSettings* encoder) {
   switch (filterstrategy) {
     case kStrategyZero:
-      state.encoder.filter_strategy = LFS_ZERO;
+      encoder->filter_strategy = LFS_ZERO;
       break;
     case kStrategyMinSum:
-      state.encoder.filter_strategy = LFS_MINSUM;
+      encoder->filter_strategy = LFS_MINSUM;
       break;
     case kStrategyEntropy:
-      state.encoder.filter_strategy = LFS_ENTROPY;
+      encoder->filter_strategy = LFS_ENTROPY;
       break;
     case kStrategyBruteForce:
-      state.encoder.filter_strategy = LFS_BRUTE_FORCE;
+      encoder->filter_strategy = LFS_BRUTE_FORCE;
       break;
     case kStrategyOne:
     case kStrategyTwo:
     case kStrategyThree:
     case kStrategyFour:
       // Set the filters of all scanlines to that number.
-      filters.resize(h, filterstrategy);
-      state.encoder.filter_strategy = LFS_PREDEFINED;
-      state.encoder.predefined_filters = &filters[0];
+      filters->resize(h, filterstrategy);
+      encoder->filter_strategy = LFS_PREDEFINED;
+      encoder->predefined_filters = &(*filters)[0];
       break;
     case kStrategyPredefined:
-      lodepng::getFilterTypes(filters, origfile);
-      if (filters.size() != h) return 1;  // Error getting filters
-      state.encoder.filter_strategy = LFS_PREDEFINED;
-      state.encoder.predefined_filters = &filters[0];
+      lodepng::getFilterTypes(*filters, origfile);
+      if (filters->size() != h) return 1;  // Error getting filters
+      encoder->filter_strategy = LFS_PREDEFINED;
+      encoder->predefined_filters = &(*filters)[0];
       break;
     default:
       break;
   }
 
+  return 0;
+}
+
+// Tries to optimize given a single PNG filter strategy.
+// Returns 0 if ok, other value for error
+unsigned TryOptimize(
+    const std::vector<unsigned char>& image, unsigned w, unsigned h,
+    const lodepng::State& inputstate, bool bit16, bool keep_colortype,
+    const std::vector<unsigned char>& origfile,
+    ZopfliPNGFilterStrategy filterstrategy,
+    bool use_zopfli, int windowsize, const ZopfliPNGOptions* png_options,
+    std::vector<unsigned char>* out) {
+  unsigned error = 0;
+
+  lodepng::State state;
+  state.encoder.zlibsettings.windowsize = windowsize;
+  if (use_zopfli && png_options->use_zopfli) {
+    state.encoder.zlibsettings.custom_deflate = CustomPNGDeflate;
+    state.encoder.zlibsettings.custom_context = png_options;
+  }
+
+  InitEncoderState(inputstate, bit16, keep_colortype, &state);
+
+  std::vector<unsigned char> filters;
+  error = SetFilterStrategy(filterstrategy, h, origfile, &filters,
+                            &state.encoder);
+  if (error) return error;
+
   state.encoder.add_id = false;
   state.encoder.text_compression = 1;
 
@@ -230,6 +261,7 @@ unsigned TryOptimize(
   // to no palette storage overhead.
   if (!error && out->size() < 4096 && !keep_colortype) {
     lodepng::State teststate;
+    teststate.decoder.zlibsettings.custom_inflate = png_options->custom_inflate;
     std::vector<unsigned char> temp;
     lodepng::decode(temp, w, h, teststate, *out);
     if (teststate.info_png.color.colortype == LCT_PALETTE) {
@@ -256,16 +288,130 @@ unsigned TryOptimize(
   }
 
   if (error) {
-    printf("Encoding error %u: %s\n", error, lodepng_error_text(error));
+    std::cout << "Encoding error " << error << ": " << lodepng_error_text(error) << std::endl;
     return error;
   }
 
   return 0;
 }
 
-// Use fast compression to check which PNG filter strategy gives the smallest
-// output. This allows to then do the slow and good compression only on that
-// filter type.
+// Runs job(0) to job(num_jobs - 1) with png_options.parallel_for if it's set.
+static void RunJobs(const ZopfliPNGOptions& png_options, size_t num_jobs,
+                    const std::function<void(size_t)>& job) {
+  if (png_options.parallel_for) {
+    png_options.parallel_for(num_jobs, job);
+  } else {
+    for (size_t i = 0; i < num_jobs; i++) job(i);
+  }
+}
+
+// Number of bits needed to encode the symbols with an ideal entropy coder.
+static double EntropyBits(const std::vector<size_t>& counts) {
+  size_t total = 0;
+  for (size_t i = 0; i < counts.size(); i++) total += counts[i];
+  double bits = 0;
+  for (size_t i = 0; i < counts.size(); i++) {
+    if (counts[i]) bits += counts[i] * std::log2((double)total / counts[i]);
+  }
+  return bits;
+}
+
+// Adds position pos to the hash chains of EstimateDeflateSize and returns the
+// previous position + 1 with the same hash, 0 if none.
+static size_t Insert(const unsigned char* data, size_t size, size_t pos,
+                     int hash_bits, std::vector<size_t>* head,
+                     std::vector<size_t>* prev) {
+  if (pos + 4 > size) return 0;
+  unsigned hash = (data[pos] | data[pos + 1] << 8 | data[pos + 2] << 16 |
+                   (unsigned)data[pos + 3] << 24) * 2654435761u >>
+                  (32 - hash_bits);
+  size_t candidate = (*head)[hash];
+  (*head)[hash] = pos + 1;
+  (*prev)[pos % prev->size()] = candidate;
+  return candidate;
+}
+
+// Estimates the deflated size of the data from the symbol statistics of a
+// quick greedy LZ77 pass, without actually compressing it. This is only meant
+// to compare different filterings of the same image.
+static size_t EstimateDeflateSize(const unsigned char* data, size_t size) {
+  static const unsigned kLengthBase[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59,
+    67, 83, 99, 115, 131, 163, 195, 227, 258
+  };
+  static const unsigned kLengthExtraBits[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+    4, 4, 4, 4, 5, 5, 5, 5, 0
+  };
+  const int kHashBits = 15;
+  const size_t kWindowSize = 32768;
+  const size_t kMinMatch = 4;
+  const size_t kMaxMatch = 258;
+  const size_t kMaxChainLength = 32;
+
+  // Position + 1 of the last occurrence of each hash of 4 bytes, and of the
+  // previous occurrence of the same hash for each position in the window,
+  // 0 if none.
+  std::vector<size_t> head(1 << kHashBits, 0);
+  std::vector<size_t> prev(kWindowSize, 0);
+  std::vector<size_t> ll_counts(286, 0), d_counts(30, 0);
+  double extra_bits = 0;
+
+  size_t i = 0;
+  while (i < size) {
+    size_t length = 0;
+    size_t dist = 0;
+    size_t max_length = std::min(kMaxMatch, size - i);
+    for (size_t candidate = Insert(data, size, i, kHashBits, &head, &prev),
+         chain = 0;
+         candidate && i - (candidate - 1) <= kWindowSize &&
+         chain < kMaxChainLength && length < max_length;
+         candidate = prev[(candidate - 1) % kWindowSize], chain++) {
+      const unsigned char* match = &data[candidate - 1];
+      size_t match_length = 0;
+      while (match_length < max_length &&
+             match[match_length] == data[i + match_length]) {
+        match_length++;
+      }
+      if (match_length > length) {
+        length = match_length;
+        dist = i - (candidate - 1);
+      }
+    }
+
+    if (length < kMinMatch) {
+      ll_counts[data[i]]++;
+      i++;
+      continue;
+    }
+
+    int length_code = std::upper_bound(kLengthBase, kLengthBase + 29,
+                                       (unsigned)length) - kLengthBase - 1;
+    ll_counts[257 + length_code]++;
+    // Distance codes come in pairs, the extra bits grow by one every pair.
+    int dist_extra_bits = 0;
+    while ((dist - 1) >> (dist_extra_bits + 1) >= 2) dist_extra_bits++;
+    int dist_code = dist <= 4 ? (int)dist - 1
+        : 2 * dist_extra_bits + 2 + (int)(((dist - 1) >> dist_extra_bits) & 1);
+    if (dist <= 4) dist_extra_bits = 0;
+    d_counts[dist_code]++;
+    extra_bits += kLengthExtraBits[length_code] + dist_extra_bits;
+
+    // Remember the positions inside the match too.
+    for (size_t j = i + 1; j < i + length; j++) {
+      Insert(data, size, j, kHashBits, &head, &prev);
+    }
+    i += length;
+  }
+  ll_counts[256]++;  // end code
+
+  double bits = EntropyBits(ll_counts) + EntropyBits(d_counts) + extra_bits;
+  return (size_t)(bits / 8);
+}
+
+// Uses an estimate of the compressed size to check which PNG filter strategy
+// gives the smallest output. This allows to then do the slow and good
+// compression only on the best filter types.
 unsigned AutoChooseFilterStrategy(const std::vector<unsigned char>& image,
                                   unsigned w, unsigned h,
                                   const lodepng::State& inputstate,
@@ -273,31 +419,64 @@ unsigned AutoChooseFilterStrategy(const std::vector<unsigned char>& image,
                                   const std::vector<unsigned char>& origfile,
                                   int numstrategies,
                                   ZopfliPNGFilterStrategy* strategies,
+                                  const ZopfliPNGOptions& png_options,
                                   bool* enable) {
-  std::vector<unsigned char> out;
-  size_t bestsize = 0;
-  int bestfilter = 0;
+  lodepng::State state;
+  InitEncoderState(inputstate, bit16, keep_colortype, &state);
+
+  // Convert the image to the color type of the output once, like
+  // lodepng::encode would do for every strategy.
+  LodePNGInfo info;
+  lodepng_info_init(&info);
+  unsigned error = lodepng_info_copy(&info, &state.info_png);
+  if (!error && state.encoder.auto_convert) {
+    error = lodepng_auto_choose_color(&info.color, &image[0], w, h,
+                                      &state.info_raw);
+  }
+  std::vector<unsigned char> converted;
+  if (!error) {
+    converted.resize(lodepng_get_raw_size(w, h, &info.color));
+    error = lodepng_convert(&converted[0], &image[0], &info.color,
+                            &state.info_raw, w, h);
+  }
+  if (error) {
+    lodepng_info_cleanup(&info);
+    return error;
+  }
 
-  // A large window size should still be used to do the quick compression to
-  // try out filter strategies: which filter strategy is the best depends
-  // largely on the window size, the closer to the actual used window size the
-  // better.
-  int windowsize = 8192;
+  std::vector<size_t> sizes(numstrategies);
+  std::vector<unsigned> errors(numstrategies);
+
+  RunJobs(png_options, numstrategies, [&](size_t i) {
+    LodePNGEncoderSettings encoder = state.encoder;
+    std::vector<unsigned char> filters;
+    errors[i] = SetFilterStrategy(strategies[i], h, origfile, &filters,
+                                  &encoder);
+    if (errors[i]) return;
+
+    unsigned char* data = 0;
+    size_t datasize = 0;
+    errors[i] = lodepng_filter_scanlines(&data, &datasize, &converted[0], w, h,
+                                         &info, &encoder);
+    if (!errors[i]) sizes[i] = EstimateDeflateSize(data, datasize);
+    free(data);
+  });
+  lodepng_info_cleanup(&info);
 
   for (int i = 0; i < numstrategies; i++) {
-    out.clear();
-    unsigned error = TryOptimize(image, w, h, inputstate, bit16, keep_colortype,
-                                 origfile, strategies[i], false, windowsize, 0,
-                                 &out);
-    if (error) return error;
-    if (bestsize == 0 || out.size() < bestsize) {
-      bestsize = out.size();
-      bestfilter = i;
-    }
+    if (errors[i]) return errors[i];
   }
 
+  // Enable the best strategies, the earlier one wins if the sizes are equal.
+  std::vector<int> order(numstrategies);
+  for (int i = 0; i < numstrategies; i++) order[i] = i;
+  std::stable_sort(order.begin(), order.end(), [&sizes](int a, int b) {
+    return sizes[a] < sizes[b];
+  });
+  int numbest = std::max(1, std::min(png_options.num_auto_filter_strategies,
+                                     numstrategies));
   for (int i = 0; i < numstrategies; i++) {
-    enable[i] = (i == bestfilter);
+    enable[order[i]] = (i < numbest);
   }
 
   return 0;  /* OK */
@@ -377,6 +556,7 @@ int ZopfliPNGOptimize(const std::vector<unsigned char>& origpng,
   unsigned w, h;
   unsigned error;
   lodepng::State inputstate;
+  inputstate.decoder.zlibsettings.custom_inflate = png_options.custom_inflate;
   error = lodepng::decode(image, w, h, inputstate, origpng);
 
   bool keep_colortype = false;
@@ -393,17 +573,17 @@ int ZopfliPNGOptimize(const std::vector<unsigned char>& origpng,
     ChunksToKeep(origpng, png_options.keepchunks, &keepchunks);
     keep_colortype = keepchunks.count("bKGD") || keepchunks.count("sBIT");
     if (keep_colortype && verbose) {
-      printf("Forced to keep original color type due to keeping bKGD or sBIT"
-             " chunk.\n");
+      std::cout << "Forced to keep original color type due to keeping bKGD or sBIT"
+                   " chunk." << std::endl;
     }
   }
 
   if (error) {
     if (verbose) {
       if (error == 1) {
-        printf("Decoding error\n");
+        std::cout << "Decoding error" << std::endl;
       } else {
-        printf("Decoding error %u: %s\n", error, lodepng_error_text(error));
+        std::cout << "Decoding error " << error << ": " << lodepng_error_text(error) << std::endl;
       }
     }
     return error;
@@ -414,7 +594,11 @@ int ZopfliPNGOptimize(const std::vector<unsigned char>& origpng,
       (keep_colortype || !png_options.lossy_8bit)) {
     // Decode as 16-bit
     image.clear();
-    error = lodepng::decode(image, w, h, origpng, LCT_RGBA, 16);
+    lodepng::State state16;
+    state16.info_raw.colortype = LCT_RGBA;
+    state16.info_raw.bitdepth = 16;
+    state16.decoder.zlibsettings.custom_inflate = png_options.custom_inflate;
+    error = lodepng::decode(image, w, h, state16, origpng);
     bit16 = true;
   }
 
@@ -429,24 +613,34 @@ int ZopfliPNGOptimize(const std::vector<unsigned char>& origpng,
                                        keep_colortype, origpng,
                                        /* Don't try brute force */
                                        kNumFilterStrategies - 1,
-                                       filterstrategies, strategy_enable);
+                                       filterstrategies, png_options,
+                                       strategy_enable);
     }
   }
 
   if (!error) {
     size_t bestsize = 0;
 
+    std::vector<int> enabled;
     for (int i = 0; i < kNumFilterStrategies; i++) {
-      if (!strategy_enable[i]) continue;
-
-      std::vector<unsigned char> temp;
-      error = TryOptimize(image, w, h, inputstate, bit16, keep_colortype,
-                          origpng, filterstrategies[i], true /* use_zopfli */,
-                          windowsize, &png_options, &temp);
+      if (strategy_enable[i]) enabled.push_back(i);
+    }
+    std::vector<std::vector<unsigned char> > results(enabled.size());
+    std::vector<unsigned> errors(enabled.size());
+    RunJobs(png_options, enabled.size(), [&](size_t j) {
+      errors[j] = TryOptimize(image, w, h, inputstate, bit16, keep_colortype,
+                              origpng, filterstrategies[enabled[j]],
+                              true /* use_zopfli */, windowsize, &png_options,
+                              &results[j]);
+    });
+
+    for (size_t j = 0; j < enabled.size(); j++) {
+      int i = enabled[j];
+      std::vector<unsigned char>& temp = results[j];
+      error = errors[j];
       if (!error) {
         if (verbose) {
-          printf("Filter strategy %s: %d bytes\n",
-                 strategy_name[i].c_str(), (int) temp.size());
+          std::cout << "Filter strategy " << strategy_name[i] << ": " << temp.size() << " bytes" << std::endl;
         }
         if (bestsize == 0 || temp.size() < bestsize) {
           bestsize = temp.size();
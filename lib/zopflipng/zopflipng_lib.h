@@ -24,9 +24,12 @@
 
 #ifdef __cplusplus
 
+#include <functional>
 #include <string>
 #include <vector>
 
+struct LodePNGDecompressSettings;
+
 extern "C" {
 
 #endif
@@ -105,6 +108,19 @@ struct ZopfliPNGOptions {
   // Automatically choose filter strategy using less good compression
   bool auto_filter_strategy;
 
+  // Number of the best filter strategies found by auto_filter_strategy that
+  // are tried with the final compression
+  int num_auto_filter_strategies;
+
+  // Runs job(0) to job(num_jobs - 1) and returns when all of them are done,
+  // possibly in parallel. If not set, the jobs are run one by one.
+  std::function<void(size_t num_jobs, const std::function<void(size_t)>& job)>
+      parallel_for;
+
+  // Inflate function used to decode the PNG, lodepng's own if not set.
+  unsigned (*custom_inflate)(unsigned char**, size_t*, const unsigned char*,
+                             size_t, const LodePNGDecompressSettings*);
+
   // PNG chunks to keep
   // chunks to literally copy over from the original PNG to the resulting one
   std::vector<std::string> keepchunks;
@@ -118,6 +134,14 @@ struct ZopfliPNGOptions {
   // Zopfli number of iterations on large images
   int num_iterations_large;
 
+  // Stop Zopfli early if it hasn't improved in this many iterations, 0 to
+  // always do all iterations
+  int convergence_iterations;
+
+  // Size of the Zopfli master blocks, 0 for the default. Smaller blocks use
+  // less memory.
+  size_t master_block_size;
+
   // Unused, left for backwards compatiblity.
   int block_split_strategy;
 };
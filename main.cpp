@@ -1,22 +1,30 @@
 #include "main.h"
 
-#include <climits>
+#include <cstdio>
 #include <cstring>
 #include <iomanip>
 #include <iostream>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
 
-#ifndef _WIN32
-#include <ftw.h>
+#ifdef _WIN32
+#include <fcntl.h>  // _O_BINARY
+#include <io.h>  // _setmode
 #endif
 
 #include "fileio.h"
+#include "job_queue.h"
 #include "leanify.h"
+#include "memory_budget.h"
+#include "profile.h"
+#include "result_cache.h"
+#include "stats.h"
+#include "time_budget.h"
+#include "utils.h"
 #include "version.h"
 
-#include "formats/jpeg.h"
-#include "formats/png.h"
-#include "formats/zip.h"
-
 using std::cerr;
 using std::cout;
 using std::endl;
@@ -31,41 +39,316 @@ void PrintSize(size_t size) {
     cout << size / 1024.0 / 1024.0 << " MB";
 }
 
+// workers used when processing multiple files at the same time, null if -j is 1
+JobQueue* job_queue = nullptr;
+
+// set with --cache
+ResultCache* result_cache = nullptr;
+
+// set with --time-budget
+TimeBudget* budget = nullptr;
+
+// With --time-budget or an output directory or suffix the files are only collected while traversing, they are
+// processed once all of them are known: the time can be planned then, and the new files are not traversed.
+// pairs of input and output path, the output path is empty for in place
+std::vector<std::pair<PathString, PathString>> collected_files;
+
+// the directory given in command line that is being traversed, or the directory of the given file
+PathString input_root;
+
 #ifdef _WIN32
-int ProcessFile(const wchar_t* file_path) {
+const wchar_t kSeparators[] = L"\\/";
+#else
+const char kSeparators[] = "/";
+#endif  // _WIN32
+
+void PrintResult(size_t original_size, size_t new_size) {
+  PrintSize(original_size);
+  cout << " -> ";
+  PrintSize(new_size);
+  cout << "\tLeanified: ";
+  PrintSize(original_size - new_size);
+
+  cout << " (" << 100 - 100.0 * new_size / original_size << "%)" << endl;
+}
+
+// Leanifies the file in memory with the result cache and prints the sizes, returns the new size.
+size_t LeanifyBuffer(void* file_pointer, size_t original_size, const Context& ctx, const string& filename) {
+  size_t new_size = 0;
+  bool cached = false;
+  string cache_key;
+  if (result_cache) {
+    cache_key = result_cache->Key(file_pointer, original_size, ctx, filename);
+    std::vector<uint8_t> output;
+    // the output is never bigger than the input, anything else is a broken entry
+    if (result_cache->Get(cache_key, &output) && output.size() <= original_size) {
+      VerbosePrint(ctx, "Found in cache.");
+      new_size = original_size;
+      if (!output.empty()) {
+        memcpy(file_pointer, output.data(), output.size());
+        new_size = output.size();
+      }
+      cached = true;
+      if (IsStatsEnabled()) {
+        FileStats stats = { filename, GetTypeName(file_pointer, new_size, filename), ctx.depth, original_size, new_size,
+                            0, 0, "cache" };
+        WriteStats(stats);
+      }
+    }
+  }
+
+  if (!cached) {
+    new_size = LeanifyFile(file_pointer, original_size, ctx, 0, filename);
+    if (result_cache) {
+      string output_key = result_cache->Key(file_pointer, new_size, ctx, filename);
+      if (output_key == cache_key) {
+        result_cache->Put(cache_key, nullptr, 0);
+      } else {
+        result_cache->Put(cache_key, file_pointer, new_size);
+        // leanifying the output again with the same options is not expected to make it any smaller
+        result_cache->Put(output_key, nullptr, 0);
+      }
+    }
+  }
+
+  PrintResult(original_size, new_size);
+  return new_size;
+}
+
+// With --max-memory: waits until the memory the file is estimated to need is free and keeps it in |grant|.
+// Returns the context to leanify it with, a cheaper one if it would need more than the limit.
+Context AdmitFile(void* file_pointer, size_t size, const Context& ctx, const string& filename,
+                  std::unique_ptr<MemoryGrant>* grant) {
+  size_t memory;
+  Context file_ctx = FitFileInMemory(file_pointer, size, ctx, filename, &memory);
+  if (file_ctx.is_fast != ctx.is_fast)
+    cout << "Not enough memory, using fast mode." << endl;
+  else if (file_ctx.zopfli_block_size != ctx.zopfli_block_size)
+    cout << "Not enough memory, using smaller Zopfli blocks." << endl;
+  grant->reset(new MemoryGrant(memory));
+  return file_ctx;
+}
+
+// leanifies in place if |output_path| is empty
+#ifdef _WIN32
+void LeanifyPath(const wchar_t* file_path, const PathString& output_path, const Context& ctx) {
   char mbs[MAX_PATH] = { 0 };
   WideCharToMultiByte(CP_ACP, 0, file_path, -1, mbs, sizeof(mbs) - 1, nullptr, nullptr);
   string filename(mbs);
 #else
-// written like this in order to be callback function of ftw()
-int ProcessFile(const char* file_path, const struct stat* sb = nullptr, int typeflag = FTW_F) {
-  if (typeflag != FTW_F)
-    return 0;
+void LeanifyPath(const char* file_path, const PathString& output_path, const Context& ctx) {
   string filename(file_path);
 #endif  // _WIN32
 
   cout << "Processing: " << filename << endl;
-  File input_file(file_path);
+  File input_file(file_path, !output_path.empty());
 
   if (input_file.IsOK()) {
-    size_t original_size = input_file.GetSize();
+    std::unique_ptr<MemoryGrant> grant;
+    const Context file_ctx = AdmitFile(input_file.GetFilePionter(), input_file.GetSize(), ctx, filename, &grant);
+    size_t new_size;
+    if (!output_path.empty() && !result_cache) {
+      // The new file is written straight from the parts of the mapping that are kept, and the new data.
+      // The cache needs the whole output in one piece.
+      OutputSink sink;
+      new_size = LeanifyFileTo(input_file.GetFilePionter(), input_file.GetSize(), file_ctx, filename, &sink);
+      PrintResult(input_file.GetSize(), new_size);
+      WriteFileAtomically(output_path.c_str(), sink);
+    } else {
+      new_size = LeanifyBuffer(input_file.GetFilePionter(), input_file.GetSize(), file_ctx, filename);
+      if (!output_path.empty())
+        WriteFileAtomically(output_path.c_str(), input_file.GetFilePionter(), new_size);
+    }
+    input_file.UnMapFile(new_size);
+  }
+}
 
-    size_t new_size = LeanifyFile(input_file.GetFilePionter(), original_size, 0, filename);
+// for "-" as a path: reads the whole file from stdin and writes the result to stdout
+void LeanifyStdin(const Context& ctx) {
+#ifdef _WIN32
+  _setmode(_fileno(stdin), _O_BINARY);
+  _setmode(_fileno(stdout), _O_BINARY);
+#endif  // _WIN32
 
-    PrintSize(original_size);
-    cout << " -> ";
-    PrintSize(new_size);
-    cout << "\tLeanified: ";
-    PrintSize(original_size - new_size);
+  cout << "Processing: stdin" << endl;
+  std::vector<uint8_t> buffer(1 << 16);
+  size_t size = 0;
+  while (size_t n = fread(buffer.data() + size, 1, buffer.size() - size, stdin)) {
+    size += n;
+    if (size == buffer.size())
+      buffer.resize(size * 2);
+  }
+  if (ferror(stdin)) {
+    perror("Read stdin error");
+    return;
+  }
+  if (size == 0)
+    return;
 
-    cout << " (" << 100 - 100.0 * new_size / original_size << "%)" << endl;
+  std::unique_ptr<MemoryGrant> grant;
+  const Context file_ctx = AdmitFile(buffer.data(), size, ctx, "", &grant);
+  size_t new_size = LeanifyBuffer(buffer.data(), size, file_ctx, "");
+  if (fwrite(buffer.data(), 1, new_size, stdout) != new_size || fflush(stdout) != 0)
+    perror("Write stdout error");
+}
 
-    input_file.UnMapFile(new_size);
+#ifdef _WIN32
+void AddToBudget(const wchar_t* file_path) {
+  char mbs[MAX_PATH] = { 0 };
+  WideCharToMultiByte(CP_ACP, 0, file_path, -1, mbs, sizeof(mbs) - 1, nullptr, nullptr);
+  string filename(mbs);
+#else
+void AddToBudget(const char* file_path) {
+  string filename(file_path);
+#endif  // _WIN32
+
+  // only to detect the type, the file might not be writable
+  File input_file(file_path, true);
+  string type;
+  size_t size = 0;
+  if (input_file.IsOK()) {
+    size = input_file.GetSize();
+    type = GetTypeName(input_file.GetFilePionter(), size, filename);
+    input_file.UnMapFile(0);
   }
+  budget->AddFile(type, size);
+}
+
+// Returns where the result of |path| goes, empty for in place.
+PathString OutputPath(const PathString& path) {
+  if (output_dir.empty() && output_suffix.empty())
+    return PathString();
+
+  PathString output = path;
+  if (!output_dir.empty()) {
+    size_t start = input_root.size();
+    while (start < path.size() && PathString(kSeparators).find(path[start]) != PathString::npos)
+      start++;
+    output = output_dir + kSeparators[0] + path.substr(start);
+  }
+  if (!output_suffix.empty()) {
+    size_t name = output.find_last_of(kSeparators);
+    name = name == PathString::npos ? 0 : name + 1;
+    size_t dot = output.find_last_of('.');
+    // no extension, or a hidden file without one
+    if (dot == PathString::npos || dot <= name)
+      dot = output.size();
+    output.insert(dot, output_suffix);
+  }
+  return output;
+}
+
+// Returns true if |path| is a result of an earlier run with the same suffix: its name has the suffix and the file
+// without it exists. A file that only has a name like it, such as jquery.min.js, is processed.
+bool IsOutputOfEarlierRun(const PathString& path) {
+  if (output_suffix.empty())
+    return false;
+  size_t name = path.find_last_of(kSeparators);
+  name = name == PathString::npos ? 0 : name + 1;
+  size_t dot = path.find_last_of('.');
+  if (dot == PathString::npos || dot <= name)
+    dot = path.size();
+  if (dot - name < output_suffix.size() ||
+      path.compare(dot - output_suffix.size(), output_suffix.size(), output_suffix) != 0)
+    return false;
+  PathString original = path;
+  original.erase(dot - output_suffix.size(), output_suffix.size());
+  return IsFile(original.c_str());
+}
+
+#ifdef _WIN32
+int ProcessFile(const wchar_t* file_path) {
+  std::wstring path(file_path);
+#else
+int ProcessFile(const char* file_path) {
+  string path(file_path);
+#endif  // _WIN32
+
+  if (IsOutputOfEarlierRun(path)) {
+#ifdef _WIN32
+    char mbs[MAX_PATH] = { 0 };
+    WideCharToMultiByte(CP_ACP, 0, file_path, -1, mbs, sizeof(mbs) - 1, nullptr, nullptr);
+    cout << "Skipping: " << mbs << ", the result of an earlier run." << endl;
+#else
+    cout << "Skipping: " << path << ", the result of an earlier run." << endl;
+#endif  // _WIN32
+    return 0;
+  }
+
+  PathString output_path = OutputPath(path);
+  if (budget)
+    AddToBudget(path.c_str());
+  if (budget || !output_path.empty())
+    collected_files.emplace_back(path, output_path);
+  else if (job_queue)
+    job_queue->Push([path] { LeanifyPath(path.c_str(), PathString(), context); });
+  else
+    LeanifyPath(path.c_str(), PathString(), context);
 
   return 0;
 }
 
+// a file or a directory given in command line or in the file list
+void ProcessPath(const PathString& path) {
+  if (IsDirectory(path.c_str())) {
+    // directory
+    input_root = path;
+    // the walkers feed the job queue while they are still walking
+    TraverseDirectory(path.c_str(), ProcessFile, num_jobs);
+  } else {
+    // file
+    input_root = path;
+    size_t name = input_root.find_last_of(kSeparators);
+    input_root.resize(name == PathString::npos ? 0 : name + 1);
+    ProcessFile(path.c_str());
+  }
+}
+
+// Processes every path in the file |list_path|, or in stdin for "-".
+// The paths are separated by new lines, or by null characters with -0.
+void ProcessFileList(const PathString& list_path) {
+  bool is_stdin = STRCMP(list_path.c_str(), "-") == 0;
+#ifdef _WIN32
+  FILE* list = is_stdin ? stdin : _wfopen(list_path.c_str(), L"rb");
+#else
+  FILE* list = is_stdin ? stdin : fopen(list_path.c_str(), "rb");
+#endif  // _WIN32
+  if (!list) {
+    perror("Open file list error");
+    return;
+  }
+
+  string path;
+  auto process = [&path] {
+    if (!null_separated && !path.empty() && path.back() == '\r')
+      path.pop_back();
+    if (path.empty())
+      return;
+#ifdef _WIN32
+    wchar_t wide_path[MAX_PATH] = { 0 };
+    MultiByteToWideChar(CP_ACP, 0, path.c_str(), -1, wide_path, MAX_PATH - 1);
+    ProcessPath(wide_path);
+#else
+    ProcessPath(path);
+#endif  // _WIN32
+    path.clear();
+  };
+  // one character at a time, so the paths are processed as soon as they arrive through a pipe
+  int c;
+  while ((c = getc(list)) != EOF) {
+    if (c == (null_separated ? '\0' : '\n'))
+      process();
+    else
+      path += static_cast<char>(c);
+  }
+  process();
+
+  if (ferror(list))
+    perror("Read file list error");
+  if (!is_stdin)
+    fclose(list);
+}
+
 void PauseIfNotTerminal() {
 // pause if Leanify is not started in terminal
 // so that user can see the output instead of just a flash of a black box
@@ -78,11 +361,35 @@ void PauseIfNotTerminal() {
 void PrintInfo() {
   cerr << "Leanify\t" << VERSION_STR << endl << endl;
   cerr << "Usage: leanify [options] paths\n"
+          "  A path of - reads the file from stdin and writes the result to stdout.\n"
+          "\n"
           "  -i, --iteration <iteration>   More iterations may produce better result, but\n"
           "                                  use more time, default is 15.\n"
+          "  --converge <n>                Stop iterating when the result hasn't improved in\n"
+          "                                  the last n iterations, -i is the maximum then.\n"
           "  -d, --max_depth <max depth>   Maximum recursive depth, unlimited by default.\n"
           "                                  Set to 1 will disable recursive minifying.\n"
+          "  -j, --jobs <jobs>             Number of files and archive entries to process in\n"
+          "                                  parallel, default is 1.\n"
           "  -f, --fastmode                Fast mode, no recompression.\n"
+          "  --cache <dir>                 Keep the results in this directory and skip the\n"
+          "                                  files that are found there.\n"
+          "  --files-from <file>           Also process the paths listed in this file, one\n"
+          "                                  per line, - to read the list from stdin.\n"
+          "  -0                            The paths in the list are separated by null\n"
+          "                                  characters, like find -print0 writes them.\n"
+          "  --output-dir <dir>            Write the results to this directory instead of\n"
+          "                                  replacing the files.\n"
+          "  --suffix <suffix>             Write the results next to the files, with this\n"
+          "                                  added to the names before the extension.\n"
+          "  --profile                     Print the time spent in each stage at exit.\n"
+          "  --stats-json <file>           Write a JSON line for every file and embedded file\n"
+          "                                  to this file, - for stdout together with -q.\n"
+          "  --time-budget <seconds>       Try to finish in this time by using fast mode, one\n"
+          "                                  iteration or all iterations for each file.\n"
+          "  --max-memory <MB>             Only start a file when the memory it is estimated\n"
+          "                                  to need is free, a file that would need more\n"
+          "                                  uses smaller Zopfli blocks or fast mode.\n"
           "  -q, --quiet                   No output to stdout.\n"
           "  -v, --verbose                 Verbose output.\n"
           "  --keep-exif                   Do not remove Exif.\n"
@@ -92,6 +399,10 @@ void PrintInfo() {
           "  --jpeg-keep-all-metadata      Do not remove any metadata or comments in JPEG.\n"
           "  --jpeg-arithmetic-coding      Use arithmetic coding for JPEG.\n"
           "\n"
+          "PNG specific option:\n"
+          "  --png-filter-candidates <n>   Number of the best filter strategies to try with\n"
+          "                                  Zopfli, default is 1.\n"
+          "\n"
           "ZIP specific option:\n"
           "  --zip-force-deflate           Try deflate even if not compressed originally.\n";
 
@@ -106,18 +417,15 @@ int main() {
 int main(int argc, char** argv) {
 #endif  // _WIN32
 
-  is_fast = false;
-  is_verbose = false;
-  iterations = 15;
-  depth = 1;
-  max_depth = INT_MAX;
+  num_jobs = 1;
 
 #ifdef _WIN32
   is_pause = !getenv("PROMPT");
 #endif  // _WIN32
 
   int i;
-  for (i = 1; i < argc && argv[i][0] == L'-'; i++) {
+  // a lone - is the stdin path, not an option
+  for (i = 1; i < argc && argv[i][0] == L'-' && argv[i][1]; i++) {
 #ifdef _WIN32
     // do not pause if any options are given
     is_pause = false;
@@ -126,13 +434,13 @@ int main(int argc, char** argv) {
     for (int j = 1; argv[i][j]; j++) {
       switch (argv[i][j]) {
         case 'f':
-          is_fast = true;
+          context.is_fast = true;
           break;
         case 'i':
           if (i < argc - 1) {
-            iterations = STRTOL(argv[i + ++num_optargs], nullptr, 10);
+            context.iterations = STRTOL(argv[i + ++num_optargs], nullptr, 10);
             // strtol will return 0 on fail
-            if (iterations == 0) {
+            if (context.iterations == 0) {
               cerr << "There should be a positive number after -i option." << endl;
               PrintInfo();
               return 1;
@@ -141,22 +449,36 @@ int main(int argc, char** argv) {
           break;
         case 'd':
           if (i < argc - 1) {
-            max_depth = STRTOL(argv[i + ++num_optargs], nullptr, 10);
+            context.max_depth = STRTOL(argv[i + ++num_optargs], nullptr, 10);
             // strtol will return 0 on fail
-            if (max_depth == 0) {
+            if (context.max_depth == 0) {
               cerr << "There should be a positive number after -d option." << endl;
               PrintInfo();
               return 1;
             }
           }
           break;
+        case 'j':
+          if (i < argc - 1) {
+            num_jobs = STRTOL(argv[i + ++num_optargs], nullptr, 10);
+            // strtol will return 0 on fail
+            if (num_jobs <= 0) {
+              cerr << "There should be a positive number after -j option." << endl;
+              PrintInfo();
+              return 1;
+            }
+          }
+          break;
         case 'q':
           cout.setstate(std::ios::failbit);
-          is_verbose = false;
+          context.is_verbose = false;
           break;
         case 'v':
           cout.clear();
-          is_verbose = true;
+          context.is_verbose = true;
+          break;
+        case '0':
+          null_separated = true;
           break;
         case '-':
           if (STRCMP(argv[i] + j + 1, "fastmode") == 0) {
@@ -165,31 +487,115 @@ int main(int argc, char** argv) {
           } else if (STRCMP(argv[i] + j + 1, "iteration") == 0) {
             j += 8;
             argv[i][j + 1] = 'i';
+          } else if (STRCMP(argv[i] + j + 1, "converge") == 0) {
+            j += 8;
+            if (i < argc - 1) {
+              context.convergence_iterations = STRTOL(argv[i + ++num_optargs], nullptr, 10);
+              // strtol will return 0 on fail
+              if (context.convergence_iterations <= 0) {
+                cerr << "There should be a positive number after --converge option." << endl;
+                PrintInfo();
+                return 1;
+              }
+            }
           } else if (STRCMP(argv[i] + j + 1, "max_depth") == 0) {
             j += 8;
             argv[i][j + 1] = 'd';
+          } else if (STRCMP(argv[i] + j + 1, "jobs") == 0) {
+            j += 3;
+            argv[i][j + 1] = 'j';
           } else if (STRCMP(argv[i] + j + 1, "quiet") == 0) {
             j += 4;
             argv[i][j + 1] = 'q';
           } else if (STRCMP(argv[i] + j + 1, "verbose") == 0) {
             j += 6;
             argv[i][j + 1] = 'v';
+          } else if (STRCMP(argv[i] + j + 1, "cache") == 0) {
+            j += 5;
+            if (i < argc - 1) {
+#ifdef _WIN32
+              char mbs[MAX_PATH] = { 0 };
+              WideCharToMultiByte(CP_ACP, 0, argv[i + ++num_optargs], -1, mbs, sizeof(mbs) - 1, nullptr, nullptr);
+              cache_dir = mbs;
+#else
+              cache_dir = argv[i + ++num_optargs];
+#endif  // _WIN32
+            }
+          } else if (STRCMP(argv[i] + j + 1, "files-from") == 0) {
+            j += 10;
+            if (i < argc - 1)
+              files_from = argv[i + ++num_optargs];
+          } else if (STRCMP(argv[i] + j + 1, "output-dir") == 0) {
+            j += 10;
+            if (i < argc - 1)
+              output_dir = argv[i + ++num_optargs];
+          } else if (STRCMP(argv[i] + j + 1, "suffix") == 0) {
+            j += 6;
+            if (i < argc - 1)
+              output_suffix = argv[i + ++num_optargs];
+          } else if (STRCMP(argv[i] + j + 1, "profile") == 0) {
+            j += 7;
+            profile_enabled = true;
+          } else if (STRCMP(argv[i] + j + 1, "stats-json") == 0) {
+            j += 10;
+            if (i < argc - 1) {
+#ifdef _WIN32
+              char mbs[MAX_PATH] = { 0 };
+              WideCharToMultiByte(CP_ACP, 0, argv[i + ++num_optargs], -1, mbs, sizeof(mbs) - 1, nullptr, nullptr);
+              stats_path = mbs;
+#else
+              stats_path = argv[i + ++num_optargs];
+#endif  // _WIN32
+            }
+          } else if (STRCMP(argv[i] + j + 1, "time-budget") == 0) {
+            j += 11;
+            if (i < argc - 1) {
+              time_budget = STRTOL(argv[i + ++num_optargs], nullptr, 10);
+              // strtol will return 0 on fail
+              if (time_budget <= 0) {
+                cerr << "There should be a positive number after --time-budget option." << endl;
+                PrintInfo();
+                return 1;
+              }
+            }
+          } else if (STRCMP(argv[i] + j + 1, "max-memory") == 0) {
+            j += 10;
+            if (i < argc - 1) {
+              long max_memory_mb = STRTOL(argv[i + ++num_optargs], nullptr, 10);
+              // strtol will return 0 on fail
+              if (max_memory_mb <= 0) {
+                cerr << "There should be a positive number after --max-memory option." << endl;
+                PrintInfo();
+                return 1;
+              }
+              max_memory = static_cast<size_t>(max_memory_mb) << 20;
+            }
           } else if (STRCMP(argv[i] + j + 1, "keep-exif") == 0) {
             j += 9;
-            Jpeg::keep_exif_ = true;
+            context.keep_exif = true;
           } else if (STRCMP(argv[i] + j + 1, "keep-icc-profile") == 0) {
             j += 16;
-            Jpeg::keep_icc_profile_ = true;
-            Png::keep_icc_profile_ = true;
+            context.keep_icc_profile = true;
           } else if (STRCMP(argv[i] + j + 1, "jpeg-keep-all-metadata") == 0) {
             j += 22;
-            Jpeg::keep_all_metadata_ = true;
+            context.jpeg_keep_all_metadata = true;
           } else if (STRCMP(argv[i] + j + 1, "jpeg-arithmetic-coding") == 0) {
             j += 22;
-            Jpeg::force_arithmetic_coding_ = true;
+            context.jpeg_arithmetic_coding = true;
+          } else if (STRCMP(argv[i] + j + 1, "png-filter-candidates") == 0) {
+            j += 21;
+            if (i < argc - 1) {
+              context.png_filter_candidates = STRTOL(argv[i + ++num_optargs], nullptr, 10);
+              // strtol will return 0 on fail
+              if (context.png_filter_candidates <= 0) {
+                cerr << "There should be a positive number after --png-filter-candidates option." << endl;
+                PrintInfo();
+                return 1;
+              }
+            }
           } else if (STRCMP(argv[i] + j + 1, "zip-force-deflate") == 0) {
             j += 17;
-            Zip::force_deflate_ = true;
+            context.zip_force_deflate = true;
           } else {
 #ifdef _WIN32
             char mbs[64] = { 0 };
@@ -211,26 +617,86 @@ int main(int argc, char** argv) {
     i += num_optargs;
   }
 
-  if (i == argc) {
+  if (i == argc && files_from.empty()) {
     cerr << "No file path provided." << endl;
     PrintInfo();
     return 1;
   }
 
+  for (int k = i; k < argc; k++) {
+    if (STRCMP(argv[k], "-") == 0) {
+      if (stats_path == "-") {
+        cerr << "--stats-json - can't be used with a path of -, both write to stdout." << endl;
+        return 1;
+      }
+      // stdout is the output file now, the messages go to stderr
+      // rdbuf() clears the failbit of -q
+      std::ios::iostate state = cout.rdstate();
+      cout.rdbuf(cerr.rdbuf());
+      cout.setstate(state);
+      break;
+    }
+  }
+
   cout << std::fixed;
   cout.precision(2);
 
+  std::unique_ptr<JobQueue> queue;
+  if (num_jobs > 1) {
+    // archive entries share the same threads with files
+    JobQueue::SetThreadLimit(num_jobs);
+    context.num_threads = num_jobs;
+    queue.reset(new JobQueue(num_jobs));
+    job_queue = queue.get();
+  }
+
+  std::unique_ptr<ResultCache> cache;
+  if (!cache_dir.empty()) {
+    cache.reset(new ResultCache(cache_dir));
+    result_cache = cache.get();
+  }
+
+  if (!stats_path.empty() && !OpenStats(stats_path)) {
+    perror("Open stats file error");
+    return 1;
+  }
+
+  std::unique_ptr<TimeBudget> time_budget_plan;
+  if (time_budget) {
+    time_budget_plan.reset(new TimeBudget(time_budget, num_jobs, context));
+    budget = time_budget_plan.get();
+  }
+
   // support multiple input file
-  do {
-    if (IsDirectory(argv[i])) {
-      // directory
-      TraverseDirectory(argv[i], ProcessFile);
-    } else {
-      // file
-      ProcessFile(argv[i]);
-    }
+  for (; i < argc; i++) {
+    if (STRCMP(argv[i], "-") == 0)
+      LeanifyStdin(context);
+    else
+      ProcessPath(argv[i]);
+  }
+  if (!files_from.empty())
+    ProcessFileList(files_from);
+
+  for (size_t k = 0; k < collected_files.size(); k++) {
+    auto job = [k] {
+      Context ctx = budget ? budget->Start(k) : context;
+      LeanifyPath(collected_files[k].first.c_str(), collected_files[k].second, ctx);
+      if (budget)
+        budget->Finish(k);
+    };
+    if (job_queue)
+      job_queue->Push(job);
+    else
+      job();
+  }
+
+  // wait for all the files to finish
+  queue.reset();
+  job_queue = nullptr;
 
-  } while (++i < argc);
+  CloseStats();
+  if (profile_enabled)
+    PrintProfile();
 
   PauseIfNotTerminal();
 
@@ -9,18 +9,44 @@
 #define STRCMP strcmp
 #endif  // _WIN32
 
-bool is_fast;
-bool is_verbose;
+#include <string>
+
+#include "context.h"
+
+#ifdef _WIN32
+using PathString = std::wstring;
+#else
+using PathString = std::string;
+#endif  // _WIN32
+
 #ifdef _WIN32
 bool is_pause;
 #endif  // _WIN32
 
-// iteration of zopfli
-int iterations;
+// settings of the files given in command line
+Context context;
+
+// number of files processed at the same time
+int num_jobs;
+
+// seconds the whole run should take, 0 for no limit
+int time_budget;
+
+// directory of the result cache, empty for no cache
+std::string cache_dir;
+
+// file to write the statistics to, empty for none
+std::string stats_path;
+
+// file with a list of paths to process, "-" for stdin
+PathString files_from;
+// the paths in the list are separated by '\0' instead of new lines
+bool null_separated;
 
-// a normal file: depth 1
-// file inside zip that is inside another zip: depth 3
-int depth;
-int max_depth;
+// with either of these the results are written to new files and the inputs are left untouched
+// directory to write the results to, keeping the paths relative to the given directories
+PathString output_dir;
+// added to the file names of the results before the extension
+PathString output_suffix;
 
 #endif  // MAIN_H_
@@ -0,0 +1,99 @@
+#include "memory_budget.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+
+#include <zopfli/util.h>
+
+size_t max_memory = 0;
+
+namespace {
+
+// The longest match cache, the LZ77 stores and the costs of a master block. Measured on binary data, where most
+// of the bytes are literals in the LZ77 stores, text needs about a third of it.
+const size_t kZopfliBytesPerByte = 128;
+// hash tables, they don't depend on the size
+const size_t kZopfliFixedBytes = 2 << 20;
+
+// master block sizes tried before fast mode, each needs less memory and compresses a bit worse
+const size_t kSmallerBlockSizes[] = { 250000, 50000 };
+
+// part of the limit kept for the memo
+const size_t kMemoFraction = 8;
+
+std::mutex grant_mutex;
+std::condition_variable grant_released;
+size_t granted = 0;
+
+// the limit for the files, without the memo
+size_t FileMemory() {
+  return max_memory - MemoMemory();
+}
+
+}  // namespace
+
+size_t MemoMemory() {
+  return max_memory / kMemoFraction;
+}
+
+size_t ZopfliMemory(size_t size, const Context& ctx) {
+  if (ctx.is_fast)
+    return 0;
+  size_t block_size = ctx.zopfli_block_size ? ctx.zopfli_block_size : ZOPFLI_MASTER_BLOCK_SIZE;
+  return std::min(size, block_size) * kZopfliBytesPerByte + kZopfliFixedBytes;
+}
+
+size_t EmbeddedMemory(size_t size, const Context& ctx) {
+  // decoded once more and compressed again
+  return 2 * size + ZopfliMemory(size, ctx);
+}
+
+Context FitInMemory(const Context& ctx, const std::function<size_t(const Context&)>& estimate) {
+  if (!max_memory || estimate(ctx) <= FileMemory())
+    return ctx;
+
+  Context cheaper = ctx;
+  if (!ctx.is_fast) {
+    for (size_t block_size : kSmallerBlockSizes) {
+      if (ctx.zopfli_block_size && ctx.zopfli_block_size <= block_size)
+        continue;
+      cheaper.zopfli_block_size = block_size;
+      if (estimate(cheaper) <= FileMemory())
+        return cheaper;
+    }
+    // the block size doesn't matter without Zopfli
+    cheaper.zopfli_block_size = ctx.zopfli_block_size;
+    cheaper.is_fast = true;
+  }
+  return cheaper;
+}
+
+MemoryGrant::MemoryGrant(size_t size) : size_(max_memory ? size : 0), count_(1) {
+  if (size_ == 0)
+    return;
+  std::unique_lock<std::mutex> lock(grant_mutex);
+  // a file that is too big for the limit runs alone
+  grant_released.wait(lock, [this] { return granted == 0 || granted + size_ <= FileMemory(); });
+  granted += size_;
+}
+
+MemoryGrant::MemoryGrant(size_t size, size_t count) : size_(0), count_(count) {
+  if (!max_memory || size == 0)
+    return;
+  std::lock_guard<std::mutex> lock(grant_mutex);
+  size_t available = granted < FileMemory() ? FileMemory() - granted : 0;
+  count_ = std::min(count, available / size);
+  size_ = size * count_;
+  granted += size_;
+}
+
+MemoryGrant::~MemoryGrant() {
+  if (size_ == 0)
+    return;
+  {
+    std::lock_guard<std::mutex> lock(grant_mutex);
+    granted -= size_;
+  }
+  grant_released.notify_all();
+}
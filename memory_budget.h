@@ -0,0 +1,52 @@
+#ifndef MEMORY_BUDGET_H_
+#define MEMORY_BUDGET_H_
+
+#include <cstddef>
+#include <functional>
+
+#include "context.h"
+
+// Admission control for --max-memory. A file only starts once the memory it is estimated to need is free, and
+// the parts of a file that could run on more threads only do so while their memory is free as well.
+// The estimates are rough, they are meant to keep many files in flight from running out of memory together.
+
+// set with --max-memory before any thread starts, in bytes, 0 for no limit
+extern size_t max_memory;
+
+// The part of |max_memory| kept for the outputs of embedded files that are leanified only once, the files
+// are admitted into the rest of it. 0 without a limit.
+size_t MemoMemory();
+
+// Memory Zopfli needs to compress |size| bytes with the settings of |ctx|, without the input and the output.
+size_t ZopfliMemory(size_t size, const Context& ctx);
+
+// Memory an embedded file of |size| bytes of unknown format might need, with the settings of |ctx|.
+size_t EmbeddedMemory(size_t size, const Context& ctx);
+
+// Returns |ctx| with smaller Zopfli blocks, or fast mode, if |estimate| of it doesn't fit in |max_memory|.
+// If nothing fits, the cheapest one is returned, the file then runs alone.
+Context FitInMemory(const Context& ctx, const std::function<size_t(const Context&)>& estimate);
+
+// Holds a part of |max_memory| until it goes out of scope, does nothing without a limit.
+class MemoryGrant {
+ public:
+  // Waits until |size| bytes are free. More than the limit is granted once nothing else is.
+  explicit MemoryGrant(size_t size);
+  // Takes |size| bytes for each of up to |count| parts, only as many as are free now, without waiting.
+  MemoryGrant(size_t size, size_t count);
+  ~MemoryGrant();
+
+  MemoryGrant(const MemoryGrant&) = delete;
+  MemoryGrant& operator=(const MemoryGrant&) = delete;
+
+  // number of parts granted, |count| without a limit
+  size_t count() const {
+    return count_;
+  }
+
+ private:
+  size_t size_;
+  size_t count_;
+};
+
+#endif  // MEMORY_BUDGET_H_
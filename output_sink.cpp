@@ -0,0 +1,66 @@
+#include "output_sink.h"
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+namespace {
+
+// small writes like headers are gathered in buffers of this size
+const size_t kChunkSize = 65536;
+
+}  // namespace
+
+void OutputSink::Write(const void* data, size_t size) {
+  if (size == 0)
+    return;
+  // The chunk is never grown past its capacity, so its data never moves.
+  if (!write_chunk_ || write_chunk_->capacity() - write_chunk_->size() < size) {
+    buffers_.emplace_back();
+    write_chunk_ = &buffers_.back();
+    write_chunk_->reserve(std::max(size, kChunkSize));
+  }
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  write_chunk_->insert(write_chunk_->end(), p, p + size);
+  Reference(write_chunk_->data() + write_chunk_->size() - size, size);
+}
+
+void OutputSink::Reference(const void* data, size_t size) {
+  if (size == 0)
+    return;
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  // contiguous with the last slice, like consecutive writes to a chunk
+  if (!slices_.empty() && slices_.back().data + slices_.back().size == p)
+    slices_.back().size += size;
+  else
+    slices_.push_back({ p, size });
+  size_ += size;
+}
+
+void OutputSink::Take(std::vector<uint8_t>&& buffer) {
+  buffers_.push_back(std::move(buffer));
+  Reference(buffers_.back().data(), buffers_.back().size());
+}
+
+void OutputSink::Append(OutputSink&& other) {
+  for (const Slice& slice : other.slices_)
+    Reference(slice.data, slice.size);
+  for (auto& buffer : other.buffers_)
+    buffers_.push_back(std::move(buffer));
+  other.slices_.clear();
+  other.buffers_.clear();
+  other.write_chunk_ = nullptr;
+  other.size_ = 0;
+}
+
+void OutputSink::CopyTo(uint8_t* dst, size_t offset /*= 0*/) const {
+  for (const Slice& slice : slices_) {
+    if (offset >= slice.size) {
+      offset -= slice.size;
+      continue;
+    }
+    memmove(dst, slice.data + offset, slice.size - offset);
+    dst += slice.size - offset;
+    offset = 0;
+  }
+}
@@ -0,0 +1,56 @@
+#ifndef OUTPUT_SINK_H_
+#define OUTPUT_SINK_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+// The output of a file as a list of slices, each of them either references the input or a buffer owned by
+// the sink. A container writes the parts it keeps as references instead of moving them into place, and the
+// whole file is written at once in the end, so the data of deeply nested files is not moved at every depth.
+class OutputSink {
+ public:
+  struct Slice {
+    const uint8_t* data;
+    size_t size;
+  };
+
+  OutputSink() = default;
+  // the slices point into the buffers
+  OutputSink(const OutputSink&) = delete;
+  OutputSink& operator=(const OutputSink&) = delete;
+  OutputSink(OutputSink&&) = default;
+  OutputSink& operator=(OutputSink&&) = default;
+
+  // The data is copied.
+  void Write(const void* data, size_t size);
+  // The data is only referenced, it must stay valid and unchanged until the sink is written.
+  void Reference(const void* data, size_t size);
+  // Takes the buffer, its data is referenced.
+  void Take(std::vector<uint8_t>&& buffer);
+  // Moves all the slices and buffers of |other| to the end.
+  void Append(OutputSink&& other);
+
+  size_t size() const {
+    return size_;
+  }
+
+  const std::vector<Slice>& slices() const {
+    return slices_;
+  }
+
+  // Copies the output from |offset| to the end to |dst|. Each slice is copied with memmove in order, so |dst| may
+  // be where the referenced input is as long as the output never gets ahead of the input it references.
+  void CopyTo(uint8_t* dst, size_t offset = 0) const;
+
+ private:
+  std::vector<Slice> slices_;
+  // a deque never moves its elements, and moving a vector doesn't move its data, so the slices stay valid
+  std::deque<std::vector<uint8_t>> buffers_;
+  // the buffer that Write() copies to
+  std::vector<uint8_t>* write_chunk_ = nullptr;
+  size_t size_ = 0;
+};
+
+#endif  // OUTPUT_SINK_H_
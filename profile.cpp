@@ -0,0 +1,47 @@
+#include "profile.h"
+
+#include <atomic>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+
+using std::cerr;
+using std::endl;
+
+bool profile_enabled = false;
+
+namespace {
+
+struct StageCounters {
+  std::atomic<uint64_t> calls{ 0 };
+  std::atomic<uint64_t> nanoseconds{ 0 };
+  std::atomic<uint64_t> bytes{ 0 };
+};
+
+StageCounters counters[kNumStages];
+
+const char* const kStageNames[kNumStages] = { "detect",  "inflate", "zopfli", "zopflipng",
+                                              "mozjpeg", "lzma",    "crc32",  "memmove" };
+
+}  // namespace
+
+void AddProfile(ProfileStage stage, std::chrono::steady_clock::duration time, size_t bytes) {
+  StageCounters& c = counters[stage];
+  c.calls.fetch_add(1, std::memory_order_relaxed);
+  c.nanoseconds.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(time).count(),
+                          std::memory_order_relaxed);
+  c.bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void PrintProfile() {
+  cerr << "Stage          Calls     Seconds          MB        MB/s" << endl;
+  cerr << std::fixed;
+  for (int i = 0; i < kNumStages; i++) {
+    const StageCounters& c = counters[i];
+    double seconds = c.nanoseconds / 1e9;
+    double mb = c.bytes / 1048576.0;
+    cerr << std::left << std::setw(10) << kStageNames[i] << std::right << std::setw(10) << c.calls
+         << std::setprecision(3) << std::setw(12) << seconds << std::setprecision(2) << std::setw(12) << mb
+         << std::setw(12) << (seconds > 0 ? mb / seconds : 0) << endl;
+  }
+}
@@ -0,0 +1,48 @@
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#include <chrono>
+#include <cstddef>
+
+// Stages measured with --profile, the time of a stage includes the stages it calls.
+enum ProfileStage {
+  kStageDetect,
+  kStageInflate,
+  kStageZopfli,
+  kStageZopfliPNG,
+  kStageMozjpeg,
+  kStageLzma,
+  kStageCrc32,
+  kStageMemmove,
+  kNumStages
+};
+
+// set with --profile before any thread starts
+extern bool profile_enabled;
+
+// Can be called from any thread.
+void AddProfile(ProfileStage stage, std::chrono::steady_clock::duration time, size_t bytes);
+
+// Prints the calls, time and bytes of every stage, summed over all threads.
+void PrintProfile();
+
+// Adds the time until it goes out of scope and |bytes| to |stage|, only a branch if --profile is off.
+class ScopedTimer {
+ public:
+  explicit ScopedTimer(ProfileStage stage, size_t bytes = 0) : stage_(stage), bytes_(bytes) {
+    if (profile_enabled)
+      start_ = std::chrono::steady_clock::now();
+  }
+
+  ~ScopedTimer() {
+    if (profile_enabled)
+      AddProfile(stage_, std::chrono::steady_clock::now() - start_, bytes_);
+  }
+
+ private:
+  ProfileStage stage_;
+  size_t bytes_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+#endif  // PROFILE_H_
@@ -0,0 +1,91 @@
+#include "result_cache.h"
+
+#include <atomic>
+#include <cstdio>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+#ifdef _WIN32
+#include <direct.h>  // _mkdir
+#include <process.h>  // _getpid
+#define getpid _getpid
+#else
+#include <sys/stat.h>  // mkdir
+#include <unistd.h>  // getpid
+#endif  // _WIN32
+
+#include "hash64.h"
+#include "version.h"
+
+using std::cerr;
+using std::endl;
+using std::string;
+
+ResultCache::ResultCache(const string& dir) : dir_(dir) {
+  // fails if it exists already
+#ifdef _WIN32
+  _mkdir(dir.c_str());
+#else
+  mkdir(dir.c_str(), 0777);
+#endif  // _WIN32
+  if (!dir_.empty() && dir_.back() != '/' && dir_.back() != '\\')
+    dir_ += '/';
+}
+
+string ResultCache::Key(const void* data, size_t size, const Context& ctx, const string& filename) {
+  // Everything that changes the output: the options, the version and the extension, which decides
+  // the format of some text files. Only the depth left matters, not how deep the file is.
+  std::ostringstream options;
+  options << VERSION_STR << ' ' << ctx.is_fast << ' ' << ctx.iterations << ' ' << ctx.convergence_iterations << ' '
+          << ctx.zopfli_block_size << ' ' << ctx.max_depth - ctx.depth << ' ' << ctx.keep_exif << ctx.keep_icc_profile
+          << ctx.jpeg_keep_all_metadata << ctx.jpeg_arithmetic_coding << ' ' << ctx.png_filter_candidates << ' '
+          << ctx.zip_force_deflate;
+  size_t dot = filename.find_last_of('.');
+  if (dot != string::npos) {
+    string ext = filename.substr(dot + 1);
+    // toupper
+    for (auto& c : ext)
+      c &= ~0x20;
+    options << ' ' << ext;
+  }
+  string options_str = options.str();
+
+  std::ostringstream key;
+  key << std::hex << std::setfill('0') << std::setw(16) << Hash64(data, size) << '-' << size << '-' << std::setw(16)
+      << Hash64(options_str.data(), options_str.size());
+  return key.str();
+}
+
+bool ResultCache::Get(const string& key, std::vector<uint8_t>* output) const {
+  FILE* f = fopen((dir_ + key).c_str(), "rb");
+  if (!f)
+    return false;
+
+  output->clear();
+  uint8_t buffer[65536];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+    output->insert(output->end(), buffer, buffer + n);
+  bool ok = !ferror(f);
+  fclose(f);
+  return ok;
+}
+
+void ResultCache::Put(const string& key, const void* output, size_t size) const {
+  // unique among the threads and processes writing to the cache
+  static std::atomic<unsigned> counter(0);
+  string temp_path = dir_ + key + ".tmp" + std::to_string(getpid()) + "-" + std::to_string(counter++);
+
+  FILE* f = fopen(temp_path.c_str(), "wb");
+  if (!f) {
+    cerr << "Can't write to cache: " << temp_path << endl;
+    return;
+  }
+  bool ok = fwrite(output, 1, size, f) == size;
+  ok = fclose(f) == 0 && ok;
+  // Renaming is atomic, readers see either the whole entry or nothing.
+  // It fails on Windows if another process added the same entry first, which is fine.
+  if (!ok || rename(temp_path.c_str(), (dir_ + key).c_str()) != 0)
+    remove(temp_path.c_str());
+}
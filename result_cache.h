@@ -0,0 +1,32 @@
+#ifndef RESULT_CACHE_H_
+#define RESULT_CACHE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "context.h"
+
+// On-disk cache of Leanify results, one file per entry in a directory.
+// An entry is keyed by the hash of the input and the options that affect the output, and holds either
+// the leanified output or nothing if the input is already optimal.
+// Entries are written to a temporary file and renamed, so the directory can be shared by several processes.
+class ResultCache {
+ public:
+  explicit ResultCache(const std::string& dir);
+
+  // |filename| is needed because some formats are detected by the extension.
+  // Also used to key the in-memory memo of LeanifyFile.
+  static std::string Key(const void* data, size_t size, const Context& ctx, const std::string& filename);
+
+  // Returns true if |key| is in the cache, |output| is left empty if the input is already optimal.
+  bool Get(const std::string& key, std::vector<uint8_t>* output) const;
+  // Stores the output of |key|, pass size 0 if the input is already optimal.
+  void Put(const std::string& key, const void* output, size_t size) const;
+
+ private:
+  std::string dir_;
+};
+
+#endif  // RESULT_CACHE_H_
@@ -0,0 +1,95 @@
+#include "stats.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+
+using std::string;
+
+namespace {
+
+FILE* stats_file = nullptr;
+std::mutex stats_mutex;
+
+// Length of the valid UTF-8 sequence at the start of |s|, 0 if it is not valid.
+size_t Utf8Length(const unsigned char* s, size_t size) {
+  size_t len;
+  uint32_t min;
+  if (s[0] < 0x80)
+    return 1;
+  else if ((s[0] & 0xE0) == 0xC0)
+    len = 2, min = 0x80;
+  else if ((s[0] & 0xF0) == 0xE0)
+    len = 3, min = 0x800;
+  else if ((s[0] & 0xF8) == 0xF0)
+    len = 4, min = 0x10000;
+  else
+    return 0;
+  if (len > size)
+    return 0;
+  uint32_t code_point = s[0] & (0x7F >> len);
+  for (size_t i = 1; i < len; i++) {
+    if ((s[i] & 0xC0) != 0x80)
+      return 0;
+    code_point = code_point << 6 | (s[i] & 0x3F);
+  }
+  // no overlong forms, surrogates or code points past Unicode
+  if (code_point < min || (code_point >= 0xD800 && code_point <= 0xDFFF) || code_point > 0x10FFFF)
+    return 0;
+  return len;
+}
+
+// JSON string with quotes. Valid UTF-8 is copied as it is, other bytes above 0x7F (names in a zip are often in
+// CP437) are escaped as the code point of the same value.
+string Quote(const string& str) {
+  string out = "\"";
+  const unsigned char* s = reinterpret_cast<const unsigned char*>(str.data());
+  for (size_t i = 0; i < str.size();) {
+    unsigned char c = s[i];
+    size_t len = Utf8Length(s + i, str.size() - i);
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (c < 0x20 || len == 0) {
+      char escape[8];
+      snprintf(escape, sizeof(escape), "\\u%04x", c);
+      out += escape;
+    } else {
+      out.append(str, i, len);
+      i += len;
+      continue;
+    }
+    i++;
+  }
+  return out + '"';
+}
+
+}  // namespace
+
+bool OpenStats(const string& path) {
+  stats_file = path == "-" ? stdout : fopen(path.c_str(), "w");
+  return stats_file != nullptr;
+}
+
+void CloseStats() {
+  if (stats_file && stats_file != stdout)
+    fclose(stats_file);
+  stats_file = nullptr;
+}
+
+bool IsStatsEnabled() {
+  return stats_file != nullptr;
+}
+
+void WriteStats(const FileStats& stats) {
+  std::ostringstream line;
+  line << std::fixed << std::setprecision(6) << "{\"path\":" << Quote(stats.path) << ",\"format\":" << Quote(stats.format)
+       << ",\"depth\":" << stats.depth << ",\"original_size\":" << stats.original_size
+       << ",\"new_size\":" << stats.new_size << ",\"wall_time\":" << stats.wall_time
+       << ",\"cpu_time\":" << stats.cpu_time << ",\"engine\":\"" << stats.engine << "\"}\n";
+  std::lock_guard<std::mutex> lock(stats_mutex);
+  fputs(line.str().c_str(), stats_file);
+  fflush(stats_file);
+}
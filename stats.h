@@ -0,0 +1,31 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <cstddef>
+#include <string>
+
+// What happened to a file or an embedded file, one JSON line each with --stats-json.
+struct FileStats {
+  // embedded files are named like "archive.zip/dir/entry.png"
+  std::string path;
+  // name from GetTypeName, empty if the format is not supported
+  std::string format;
+  int depth;
+  size_t original_size;
+  size_t new_size;
+  // in seconds, including the embedded files, the CPU time only of the thread that leanified it
+  double wall_time;
+  double cpu_time;
+  // encoder of the output, like "Zopfli", "store" if the data is not encoded again
+  const char* engine;
+};
+
+// Starts writing the statistics to |path|, "-" for stdout, returns false if it can't be opened.
+bool OpenStats(const std::string& path);
+void CloseStats();
+bool IsStatsEnabled();
+
+// Writes one line, can be called from any thread.
+void WriteStats(const FileStats& stats);
+
+#endif  // STATS_H_
@@ -0,0 +1,146 @@
+#include "time_budget.h"
+
+#include <algorithm>
+#include <cmath>
+#include <queue>
+#include <thread>
+#include <utility>
+
+using std::string;
+
+// Rough speed and savings of a group of formats, measured on typical files.
+struct TimeBudget::Profile {
+  // seconds per MB of input in fast mode, with one Zopfli iteration and for every further iteration
+  double seconds_fast, seconds_one_iteration, seconds_per_iteration;
+  // fraction of the size saved at every level
+  double saving[kNumLevels];
+};
+
+namespace {
+
+// fixed cost of opening and mapping a file
+const double kSecondsPerFile = 0.001;
+
+}  // namespace
+
+TimeBudget::TimeBudget(double seconds, int num_threads, const Context& ctx)
+    : ctx_(ctx),
+      // threads beyond the number of cores don't add any time
+      num_threads_(std::max(std::min(num_threads, static_cast<int>(std::thread::hardware_concurrency())), 1)),
+      deadline_(std::chrono::steady_clock::now() + std::chrono::milliseconds(static_cast<int64_t>(seconds * 1000))) {}
+
+void TimeBudget::AddFile(const string& type, size_t size) {
+  // PNG and JPEG are recompressed, containers and gzip recompress their deflate streams
+  static const Profile kPng = { 5, 25, 1.5, { 0.02, 0.1, 0.105 } };
+  static const Profile kJpeg = { 0.1, 0.5, 0, { 0, 0.05, 0.05 } };
+  static const Profile kDeflate = { 0.02, 4, 0.3, { 0.01, 0.06, 0.065 } };
+  static const Profile kText = { 0.05, 0.05, 0, { 0.02, 0.02, 0.02 } };
+  static const Profile kUnsupported = { 0, 0, 0, { 0, 0, 0 } };
+
+  const Profile* profile = &kText;
+  if (type == "PNG")
+    profile = &kPng;
+  else if (type == "JPEG")
+    profile = &kJpeg;
+  else if (type == "ZIP" || type == "GZ" || type == "tar" || type == "SWF" || type == "DWF" || type == "ICO" ||
+           type == "PE" || type == "GFT" || type == "RDB")
+    profile = &kDeflate;
+  else if (type.empty())
+    profile = &kUnsupported;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  files_.push_back({ profile, size, kFast, false, false, {} });
+  planned_ = false;
+}
+
+Context TimeBudget::Start(size_t index) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  // plan again if the files took a different time than estimated
+  double ratio = finished_estimate_ > 0 ? finished_time_ / finished_estimate_ : 1;
+  if (!planned_ || std::fabs(ratio / planned_ratio_ - 1) > 0.25)
+    Plan();
+
+  FilePlan& file = files_[index];
+  file.started = true;
+  file.start_time = std::chrono::steady_clock::now();
+
+  Context ctx = ctx_;
+  if (file.level == kFast)
+    ctx.is_fast = true;
+  else if (file.level == kOneIteration)
+    ctx.iterations = 1;
+  return ctx;
+}
+
+void TimeBudget::Finish(size_t index) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  FilePlan& file = files_[index];
+  file.finished = true;
+  finished_estimate_ += EstimateTime(file, file.level);
+  finished_time_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - file.start_time).count();
+}
+
+double TimeBudget::EstimateTime(const FilePlan& file, Level level) const {
+  const Profile& p = *file.profile;
+  double seconds_per_mb = p.seconds_fast;
+  if (level == kOneIteration)
+    seconds_per_mb = p.seconds_one_iteration;
+  else if (level == kFull)
+    seconds_per_mb = p.seconds_one_iteration + p.seconds_per_iteration * (ctx_.iterations - 1);
+  return kSecondsPerFile + seconds_per_mb * file.size / (1 << 20);
+}
+
+double TimeBudget::EstimateSaving(const FilePlan& file, Level level) const {
+  return file.profile->saving[level] * file.size;
+}
+
+void TimeBudget::Plan() {
+  auto now = std::chrono::steady_clock::now();
+  double ratio = finished_estimate_ > 0 ? finished_time_ / finished_estimate_ : 1;
+  planned_ = true;
+  planned_ratio_ = ratio;
+
+  // thread time left until the deadline, after the running files and fast mode for all the others
+  double available = std::chrono::duration<double>(deadline_ - now).count() * num_threads_;
+  std::vector<size_t> pending;
+  for (size_t i = 0; i < files_.size(); i++) {
+    FilePlan& file = files_[i];
+    if (!file.started) {
+      file.level = kFast;
+      available -= EstimateTime(file, kFast) * ratio;
+      pending.push_back(i);
+    } else if (!file.finished) {
+      double elapsed = std::chrono::duration<double>(now - file.start_time).count();
+      available -= std::max(EstimateTime(file, file.level) * ratio - elapsed, 0.0);
+    }
+  }
+
+  // Raise the level of the files that save the most bytes per second first.
+  // Saving per second drops with every level, so a file is raised one level at a time.
+  auto upgrade_time = [&](const FilePlan& file) {
+    Level next = static_cast<Level>(file.level + 1);
+    return (EstimateTime(file, next) - EstimateTime(file, file.level)) * ratio;
+  };
+  auto upgrade_value = [&](const FilePlan& file) {
+    Level next = static_cast<Level>(file.level + 1);
+    double saving = EstimateSaving(file, next) - EstimateSaving(file, file.level);
+    double time = upgrade_time(file);
+    return time > 0 ? saving / time : HUGE_VAL;
+  };
+  std::priority_queue<std::pair<double, size_t>> upgrades;
+  for (size_t i : pending)
+    upgrades.emplace(upgrade_value(files_[i]), i);
+  while (!upgrades.empty()) {
+    size_t index = upgrades.top().second;
+    FilePlan& file = files_[index];
+    upgrades.pop();
+    double time = upgrade_time(file);
+    if (time > available)
+      continue;
+
+    available -= std::max(time, 0.0);
+    file.level = static_cast<Level>(file.level + 1);
+    if (file.level + 1 < kNumLevels)
+      upgrades.emplace(upgrade_value(file), index);
+  }
+}
@@ -0,0 +1,61 @@
+#ifndef TIME_BUDGET_H_
+#define TIME_BUDGET_H_
+
+#include <chrono>
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "context.h"
+
+// Spreads a wall-clock budget over a list of files by choosing for every file one of:
+// fast mode, a single Zopfli iteration or the full number of iterations.
+// The time and the savings of every choice are estimated from the size and the format of the file,
+// the most bytes saved per second are bought first. The estimates are corrected with the time the
+// finished files actually took, and the remaining files are planned again when they are off.
+class TimeBudget {
+ public:
+  // |ctx| is the context with the full settings, |num_threads| is the number of files processed at once.
+  TimeBudget(double seconds, int num_threads, const Context& ctx);
+
+  // |type| is the format name returned by GetTypeName.
+  void AddFile(const std::string& type, size_t size);
+
+  // Returns the context to leanify the |index|-th added file with, call when it starts.
+  Context Start(size_t index);
+  // Call when the |index|-th file is done.
+  void Finish(size_t index);
+
+ private:
+  enum Level { kFast, kOneIteration, kFull, kNumLevels };
+
+  struct Profile;
+
+  struct FilePlan {
+    const Profile* profile;
+    size_t size;
+    Level level;
+    bool started, finished;
+    std::chrono::steady_clock::time_point start_time;
+  };
+
+  double EstimateTime(const FilePlan& file, Level level) const;
+  double EstimateSaving(const FilePlan& file, Level level) const;
+  // Chooses the level of every file that hasn't started, with the time that is left.
+  void Plan();
+
+  const Context ctx_;
+  const int num_threads_;
+  const std::chrono::steady_clock::time_point deadline_;
+
+  std::mutex mutex_;
+  std::vector<FilePlan> files_;
+  bool planned_ = false;
+  // actual time / estimated time of the finished files, and the ratio used by the last plan
+  double finished_estimate_ = 0;
+  double finished_time_ = 0;
+  double planned_ratio_ = 1;
+};
+
+#endif  // TIME_BUDGET_H_
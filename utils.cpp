@@ -4,6 +4,7 @@
 #include <Windows.h>  // WideCharToMultiByte
 #else
 #include <iconv.h>  // convert UTF16 to UTF8 on non Windows
+#include <time.h>  // clock_gettime
 #include <cstdio>
 #endif
 
@@ -24,8 +25,8 @@ void UTF16toMBS(const wchar_t* u, size_t srclen, char* mbs, size_t dstlen) {
 #endif  // _WIN32
 }
 
-void PrintFileName(const string& name) {
-  for (int i = 1; i < depth; i++)
+void PrintFileName(const Context& ctx, const string& name) {
+  for (int i = 1; i < ctx.depth; i++)
     cout << "-> ";
   cout << name << endl;
 }
@@ -49,3 +50,20 @@ string ShrinkSpace(const char* str) {
   }
   return out_str;
 }
+
+double ThreadCpuTime() {
+#ifdef _WIN32
+  FILETIME creation_time, exit_time, kernel_time, user_time;
+  if (!GetThreadTimes(GetCurrentThread(), &creation_time, &exit_time, &kernel_time, &user_time))
+    return 0;
+  // in 100 nanoseconds
+  return ((uint64_t(kernel_time.dwHighDateTime) << 32 | kernel_time.dwLowDateTime) +
+          (uint64_t(user_time.dwHighDateTime) << 32 | user_time.dwLowDateTime)) /
+         1e7;
+#else
+  timespec ts;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+    return 0;
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif  // _WIN32
+}
@@ -6,8 +6,7 @@
 #include <iostream>
 #include <string>
 
-extern int depth;
-extern bool is_verbose;
+#include "context.h"
 
 #ifdef _MSC_VER
 #define BSWAP32(x) _byteswap_ulong(x)
@@ -25,25 +24,22 @@ extern bool is_verbose;
 
 void UTF16toMBS(const wchar_t* u, size_t srclen, char* mbs, size_t dstlen);
 
-void PrintFileName(const std::string& name);
+void PrintFileName(const Context& ctx, const std::string& name);
 
 std::string ShrinkSpace(const char* value);
 
-template <typename T>
-void VerbosePrint(const T& t) {
-  if (!is_verbose)
-    return;
-
-  std::cout << t << std::endl;
-}
+// CPU time used by the calling thread, in seconds.
+double ThreadCpuTime();
 
-template <typename T, typename... Args>
-void VerbosePrint(const T& t, const Args&... args) {
-  if (!is_verbose)
+template <typename... Args>
+void VerbosePrint(const Context& ctx, const Args&... args) {
+  if (!ctx.is_verbose)
     return;
 
-  std::cout << t;
-  VerbosePrint(args...);
+  // print the arguments in order
+  int expand[] = { 0, ((std::cout << args), 0)... };
+  (void)expand;
+  std::cout << std::endl;
 }
 
 #endif  // UTILS_H_